@@ -0,0 +1,154 @@
+// Compares the word/SIMD bitmap scanners and the summary index in util.h
+// against the original bit-at-a-time scanners on a large, mostly full
+// bitmap, the case that dominates allocation on big images.
+//
+//   make bench-bitmap
+//   ./bench/bitmap_bench [bits]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include "../util.h"
+
+static int
+legacy_next_free(char* bitmap, int from, int size)
+{
+	for (int ii = from; ii < size; ++ii) {
+		if (bitmap_read(bitmap, ii) == 0) {
+			return ii;
+		}
+	}
+	return -1;
+}
+
+static int
+legacy_free_range_size(char* bitmap, int start, int range, int size)
+{
+	if (start + range > size) {
+		return -1;
+	}
+	for (int ii = start; ii < start + range; ii++) {
+		if (bitmap_read(bitmap, ii)) {
+			return ii - start;
+		}
+	}
+	return range;
+}
+
+static int
+legacy_find_range(char* bitmap, int range, int size)
+{
+	int start = legacy_next_free(bitmap, 0, size);
+	while (start >= 0) {
+		int run = legacy_free_range_size(bitmap, start, range, size);
+		if (run < 0) {
+			return -1;
+		}
+		if (run == range) {
+			return start;
+		}
+		start = legacy_next_free(bitmap, start + run, size);
+	}
+	return -1;
+}
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// fills all but a sprinkling of bits in the upper half of the bitmap, plus
+// one free run of 64 bits near the end
+static char*
+make_bitmap(int size)
+{
+	char* bitmap = malloc((size + 7) / 8);
+	memset(bitmap, 0xff, (size + 7) / 8);
+	srand(1);
+	for (int ii = 0; ii < 64; ii++) {
+		bitmap_set(bitmap, size / 2 + rand() % (size / 2 - 1000), false);
+	}
+	for (int ii = 0; ii < 64; ii++) {
+		bitmap_set(bitmap, size - 500 + ii, false);
+	}
+	return bitmap;
+}
+
+static void
+report(const char* name, int iters, double legacy, double fast)
+{
+	printf("%-22s %12.0f ns %12.0f ns %8.1fx\n", name,
+		legacy / iters * 1e9, fast / iters * 1e9, legacy / fast);
+}
+
+int
+main(int argc, char* argv[])
+{
+	int size = argc > 1 ? atoi(argv[1]) : 1 << 24;
+	int iters = 20;
+	char* bitmap = make_bitmap(size);
+	volatile int sink = 0;
+
+	printf("%d bits, %d iterations", size, iters);
+#if defined(__AVX2__)
+	printf(", avx2\n");
+#elif defined(__SSE2__)
+	printf(", sse2\n");
+#else
+	printf(", scalar\n");
+#endif
+	printf("%-22s %15s %15s %9s\n", "", "bit-at-a-time", "word/simd", "speedup");
+
+	assert(legacy_next_free(bitmap, 0, size) == bitmap_first_free(bitmap, size));
+	double t0 = now();
+	for (int ii = 0; ii < iters; ii++) {
+		sink += legacy_next_free(bitmap, 0, size);
+	}
+	double t1 = now();
+	for (int ii = 0; ii < iters; ii++) {
+		sink += bitmap_first_free(bitmap, size);
+	}
+	double t2 = now();
+	report("first free", iters, t1 - t0, t2 - t1);
+
+	assert(legacy_find_range(bitmap, 64, size) == bitmap_find_range(bitmap, 64, size));
+	t0 = now();
+	for (int ii = 0; ii < iters; ii++) {
+		sink += legacy_find_range(bitmap, 64, size);
+	}
+	t1 = now();
+	for (int ii = 0; ii < iters; ii++) {
+		sink += bitmap_find_range(bitmap, 64, size);
+	}
+	t2 = now();
+	report("find range of 64", iters, t1 - t0, t2 - t1);
+
+	// allocate and free one bit at a time, as reserve_data_block does
+	bitmap_summary bs = {0};
+	bitmap_summary_init(&bs, bitmap, size);
+	assert(bitmap_summary_first_free(&bs) == bitmap_first_free(bitmap, size));
+	assert(bitmap_summary_find_range(&bs, 64) == bitmap_find_range(bitmap, 64, size));
+	t0 = now();
+	for (int ii = 0; ii < iters; ii++) {
+		int bit = legacy_next_free(bitmap, 0, size);
+		bitmap_set(bitmap, bit, true);
+		bitmap_set(bitmap, bit, false);
+	}
+	t1 = now();
+	for (int ii = 0; ii < iters; ii++) {
+		int bit = bitmap_summary_first_free(&bs);
+		bitmap_summary_set(&bs, bit, true);
+		bitmap_summary_set(&bs, bit, false);
+	}
+	t2 = now();
+	report("reserve + free", iters, t1 - t0, t2 - t1);
+
+	free(bs.summary);
+	free(bitmap);
+	return sink == 42;
+}
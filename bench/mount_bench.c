@@ -0,0 +1,365 @@
+// Drives a mounted nufs the way applications do, through the kernel, from
+// several threads at once: parallel sequential streams, small-file
+// create+write+fsync, stat storms and a mixed profile. Prints one JSON
+// object per run so results can be diffed and plotted.
+//
+//   make bench-mount
+//   ./bench/mount_bench [-t threads] [-d seconds] [-l label] dir [workload...]
+//
+// where a workload is one of seq, smallfile, stat or mixed; all of them
+// run by default. dir should be empty and on the filesystem under test.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+const int MB_IO_SIZE = 4096;
+const int MB_SEQ_CHUNK = 128 * 1024;
+const int MB_SEQ_FILE_SIZE = 64 * 1024 * 1024;
+const int MB_STAT_FILES = 1000;
+
+static const char* root;
+static int num_threads = 4;
+static double duration = 5.0;
+
+// one thread's share of a workload
+typedef struct mb_worker {
+	pthread_t thread;
+	int id;
+	uint64_t deadline;
+	uint64_t* lat;      // ns per op
+	int ops;
+	int capacity;
+	uint64_t last;      // when the last op finished
+	uint64_t bytes;
+	int errors;
+	unsigned seed;
+	char* buf;
+} mb_worker;
+
+typedef struct mb_workload {
+	const char* name;
+	void (*setup)();
+	void* (*run)(void* worker);
+} mb_workload;
+
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+expired(mb_worker* ww)
+{
+	return now_ns() >= ww->deadline;
+}
+
+// records one op that began at start; ok is false if it failed
+static void
+record(mb_worker* ww, uint64_t start, int ok)
+{
+	uint64_t end = now_ns();
+	if (ww->ops == ww->capacity) {
+		ww->capacity = ww->capacity ? ww->capacity * 2 : 4096;
+		ww->lat = realloc(ww->lat, ww->capacity * sizeof(uint64_t));
+	}
+	ww->lat[ww->ops++] = end - start;
+	ww->last = end;
+	if (!ok) {
+		ww->errors++;
+	}
+}
+
+static void
+path_of(char* path, const char* kind, int worker, int ii)
+{
+	sprintf(path, "%s/%s-%d-%d", root, kind, worker, ii);
+}
+
+// each thread streams its own file out and back in
+static void*
+run_seq(void* arg)
+{
+	mb_worker* ww = arg;
+	char path[4096];
+	path_of(path, "seq", ww->id, 0);
+	int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+		ww->errors++;
+		return NULL;
+	}
+
+	off_t off = 0;
+	int writing = 1;
+	while (!expired(ww)) {
+		if (off >= MB_SEQ_FILE_SIZE) {
+			off = 0;
+			writing = !writing;
+		}
+		uint64_t start = now_ns();
+		ssize_t done = writing ? pwrite(fd, ww->buf, MB_SEQ_CHUNK, off)
+		                       : pread(fd, ww->buf, MB_SEQ_CHUNK, off);
+		record(ww, start, done == MB_SEQ_CHUNK);
+		if (done > 0) {
+			ww->bytes += done;
+		}
+		off += MB_SEQ_CHUNK;
+	}
+	close(fd);
+	unlink(path);
+	return NULL;
+}
+
+// create, write 4K, fsync, close: what a mail spool or a package manager does
+static void*
+run_smallfile(void* arg)
+{
+	mb_worker* ww = arg;
+	char path[4096];
+	int count = 0;
+	while (!expired(ww)) {
+		path_of(path, "small", ww->id, count++);
+		uint64_t start = now_ns();
+		int fd = open(path, O_CREAT | O_WRONLY | O_EXCL, 0644);
+		int ok = fd >= 0;
+		if (ok) {
+			ok = write(fd, ww->buf, MB_IO_SIZE) == MB_IO_SIZE;
+			ok = fsync(fd) == 0 && ok;
+			ok = close(fd) == 0 && ok;
+		}
+		record(ww, start, ok);
+		ww->bytes += ok ? MB_IO_SIZE : 0;
+	}
+	for (int ii = 0; ii < count; ii++) {
+		path_of(path, "small", ww->id, ii);
+		unlink(path);
+	}
+	return NULL;
+}
+
+static void
+setup_stat_files()
+{
+	char path[4096];
+	for (int ii = 0; ii < MB_STAT_FILES; ii++) {
+		path_of(path, "stat", 0, ii);
+		int fd = open(path, O_CREAT | O_WRONLY, 0644);
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
+
+static void*
+run_stat(void* arg)
+{
+	mb_worker* ww = arg;
+	char path[4096];
+	struct stat st;
+	while (!expired(ww)) {
+		path_of(path, "stat", 0, rand_r(&ww->seed) % MB_STAT_FILES);
+		uint64_t start = now_ns();
+		record(ww, start, stat(path, &st) == 0);
+	}
+	return NULL;
+}
+
+// mostly reads and stats of a shared set of small files, some overwrites,
+// and a trickle of create+unlink
+static void*
+run_mixed(void* arg)
+{
+	mb_worker* ww = arg;
+	char path[4096];
+	struct stat st;
+	int count = 0;
+	while (!expired(ww)) {
+		int dice = rand_r(&ww->seed) % 100;
+		int ok;
+		uint64_t start = now_ns();
+		if (dice < 40) {
+			path_of(path, "stat", 0, rand_r(&ww->seed) % MB_STAT_FILES);
+			ok = stat(path, &st) == 0;
+		} else if (dice < 70) {
+			path_of(path, "stat", 0, rand_r(&ww->seed) % MB_STAT_FILES);
+			int fd = open(path, O_RDONLY);
+			ok = fd >= 0 && pread(fd, ww->buf, MB_IO_SIZE, 0) >= 0;
+			if (fd >= 0) {
+				close(fd);
+			}
+		} else if (dice < 90) {
+			path_of(path, "stat", 0, rand_r(&ww->seed) % MB_STAT_FILES);
+			int fd = open(path, O_WRONLY);
+			ok = fd >= 0 && pwrite(fd, ww->buf, MB_IO_SIZE, 0) == MB_IO_SIZE;
+			if (fd >= 0) {
+				close(fd);
+			}
+			ww->bytes += ok ? MB_IO_SIZE : 0;
+		} else {
+			path_of(path, "mixed", ww->id, count++);
+			int fd = open(path, O_CREAT | O_WRONLY | O_EXCL, 0644);
+			ok = fd >= 0 && close(fd) == 0 && unlink(path) == 0;
+		}
+		record(ww, start, ok);
+	}
+	return NULL;
+}
+
+static void
+cleanup_stat_files()
+{
+	char path[4096];
+	for (int ii = 0; ii < MB_STAT_FILES; ii++) {
+		path_of(path, "stat", 0, ii);
+		unlink(path);
+	}
+}
+
+static const mb_workload workloads[] = {
+	{ "seq", NULL, run_seq },
+	{ "smallfile", NULL, run_smallfile },
+	{ "stat", setup_stat_files, run_stat },
+	{ "mixed", setup_stat_files, run_mixed },
+};
+
+static int
+cmp_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us(uint64_t* lat, int ops, double pct)
+{
+	if (ops == 0) {
+		return 0;
+	}
+	return lat[(int) (pct / 100.0 * (ops - 1) + 0.5)] / 1e3;
+}
+
+// runs one workload on every thread and prints its JSON object
+static void
+run_workload(const mb_workload* wl, int first)
+{
+	if (wl->setup) {
+		wl->setup();
+	}
+
+	mb_worker* workers = calloc(num_threads, sizeof(mb_worker));
+	uint64_t start = now_ns();
+	for (int ii = 0; ii < num_threads; ii++) {
+		workers[ii].id = ii;
+		workers[ii].deadline = start + (uint64_t) (duration * 1e9);
+		workers[ii].seed = ii + 1;
+		workers[ii].buf = malloc(MB_SEQ_CHUNK);
+		memset(workers[ii].buf, 'a' + ii % 26, MB_SEQ_CHUNK);
+		pthread_create(&workers[ii].thread, NULL, wl->run, &workers[ii]);
+	}
+
+	int ops = 0;
+	int errors = 0;
+	uint64_t bytes = 0;
+	uint64_t last = start;
+	for (int ii = 0; ii < num_threads; ii++) {
+		pthread_join(workers[ii].thread, NULL);
+		ops += workers[ii].ops;
+		errors += workers[ii].errors;
+		bytes += workers[ii].bytes;
+		if (workers[ii].last > last) {
+			last = workers[ii].last;
+		}
+	}
+	// measured to the last op, not the cleanup after it
+	double seconds = last > start ? (last - start) / 1e9 : duration;
+
+	uint64_t* lat = malloc((ops + 1) * sizeof(uint64_t));
+	int used = 0;
+	for (int ii = 0; ii < num_threads; ii++) {
+		memcpy(lat + used, workers[ii].lat, workers[ii].ops * sizeof(uint64_t));
+		used += workers[ii].ops;
+		free(workers[ii].lat);
+		free(workers[ii].buf);
+	}
+	qsort(lat, ops, sizeof(uint64_t), cmp_u64);
+
+	printf("%s\n    {\"name\": \"%s\", \"ops\": %d, \"errors\": %d, \"seconds\": %.3f, "
+		"\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+		"\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}",
+		first ? "" : ",", wl->name, ops, errors, seconds, ops / seconds,
+		bytes / seconds / (1 << 20), percentile_us(lat, ops, 50), percentile_us(lat, ops, 90),
+		percentile_us(lat, ops, 99), percentile_us(lat, ops, 100));
+	fflush(stdout);
+
+	if (wl->setup == setup_stat_files) {
+		cleanup_stat_files();
+	}
+	free(lat);
+	free(workers);
+}
+
+static int
+selected(const char* name, int argc, char* argv[])
+{
+	if (argc == 0) {
+		return 1;
+	}
+	for (int ii = 0; ii < argc; ii++) {
+		if (strcmp(argv[ii], name) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+	const char* label = "";
+	int usage = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:d:l:")) != -1) {
+		switch (opt) {
+		case 't':
+			num_threads = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+		case 'd':
+			duration = atof(optarg) > 0 ? atof(optarg) : 1;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		default:
+			usage = 1;
+		}
+	}
+	if (usage || optind >= argc) {
+		fprintf(stderr, "usage: %s [-t threads] [-d seconds] [-l label] dir [workload...]\n",
+			argv[0]);
+		return 1;
+	}
+	root = argv[optind++];
+
+	printf("{\"label\": \"%s\", \"threads\": %d, \"workloads\": [", label, num_threads);
+	int first = 1;
+	int nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+	for (int ii = 0; ii < nworkloads; ii++) {
+		if (selected(workloads[ii].name, argc - optind, argv + optind)) {
+			run_workload(&workloads[ii], first);
+			first = 0;
+		}
+	}
+	printf("\n]}\n");
+	return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+# Mounts a fresh temporary image on mnt the way `make mount` does, once
+# with FUSE single-threaded (-s) and once multithreaded, runs
+# bench/mount_bench against each, and prints the results as one JSON array.
+#
+#   make bench-mount
+#   THREADS=8 DURATION=10 ./bench/mount_bench.sh [nufs flags...]
+#
+# nufs flags such as --lowlevel are passed through to every mount. Each
+# workload reports a line like
+#
+#   {"name": "stat", "ops": 3979193, "errors": 0, "seconds": 5.000,
+#    "ops_per_sec": 795815.6, "mb_per_sec": 0.00, "latency_us": {...}}
+
+THREADS=${THREADS:-4}
+DURATION=${DURATION:-5}
+MNT=mnt
+
+mkdir -p $MNT
+
+echo "["
+first=1
+for mode in single multi; do
+    image=$(mktemp /tmp/nufs-mount-bench-XXXXXX)
+    flags=""
+    if [ $mode = single ]; then
+        flags="-s"
+    fi
+
+    ./nufs "$@" $flags -f $MNT $image >/dev/null 2>&1 &
+    pid=$!
+    # wait until mnt is a different filesystem from its parent
+    tries=0
+    while [ "$(stat -c %d $MNT)" = "$(stat -c %d .)" ]; do
+        tries=$((tries + 1))
+        if [ $tries -gt 100 ] || ! kill -0 $pid 2>/dev/null; then
+            echo "mount_bench: nufs did not mount $MNT" >&2
+            kill $pid 2>/dev/null
+            rm -f $image
+            exit 1
+        fi
+        sleep 0.1
+    done
+
+    if [ $first = 0 ]; then
+        echo ","
+    fi
+    first=0
+    ./bench/mount_bench -t $THREADS -d $DURATION -l $mode $MNT
+
+    fusermount -u $MNT
+    wait $pid
+    rm -f $image
+done
+echo "]"
@@ -0,0 +1,356 @@
+// Times the storage engine directly, without FUSE, on a throwaway image:
+// sequential and random I/O, metadata storms, deep and wide lookups, and
+// truncate churn. Each workload reports ops/s and per-op latency
+// percentiles, so an engine change can be measured before and after.
+//
+//   make bench
+//   ./bench/storage_bench [-s scale] [workload...]
+//
+// where a workload is one of seq, random, storm, deep, wide or truncate;
+// all of them run by default.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../storage.h"
+#include "../handle.h"
+
+const int BENCH_IO_SIZE = 4096;
+const int BENCH_SEQ_CHUNK = 128 * 1024;
+
+static int scale = 1;
+
+typedef struct bench_run {
+	const char* name;
+	uint64_t* lat;      // ns per op
+	int ops;
+	int capacity;
+	uint64_t bytes;
+	double elapsed;     // seconds, including the timing overhead
+	int errors;
+} bench_run;
+
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+run_start(bench_run* run, const char* name, int capacity)
+{
+	run->name = name;
+	run->lat = malloc(capacity * sizeof(uint64_t));
+	run->ops = 0;
+	run->capacity = capacity;
+	run->bytes = 0;
+	run->errors = 0;
+	run->elapsed = now_ns() / 1e9;
+}
+
+// records one op that began at start and returned rv
+static void
+run_op(bench_run* run, uint64_t start, int rv)
+{
+	uint64_t end = now_ns();
+	if (run->ops < run->capacity) {
+		run->lat[run->ops++] = end - start;
+	}
+	if (rv < 0) {
+		run->errors++;
+	}
+}
+
+static int
+cmp_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us(bench_run* run, double pct)
+{
+	int ii = (int) (pct / 100.0 * (run->ops - 1) + 0.5);
+	return run->lat[ii] / 1e3;
+}
+
+static void
+run_report(bench_run* run)
+{
+	run->elapsed = now_ns() / 1e9 - run->elapsed;
+	qsort(run->lat, run->ops, sizeof(uint64_t), cmp_u64);
+	printf("%-18s %9d %12.0f", run->name, run->ops, run->ops / run->elapsed);
+	if (run->bytes) {
+		printf(" %9.1f", run->bytes / run->elapsed / (1 << 20));
+	} else {
+		printf(" %9s", "-");
+	}
+	printf(" %9.1f %9.1f %9.1f %9.1f", percentile_us(run, 50), percentile_us(run, 90),
+		percentile_us(run, 99), run->lat[run->ops - 1] / 1e3);
+	if (run->errors) {
+		printf("  (%d errors)", run->errors);
+	}
+	printf("\n");
+	free(run->lat);
+}
+
+static int
+open_file(const char* path)
+{
+	int rv = create_inode_at_path(path, S_IFREG | 0644);
+	if (rv < 0) {
+		return rv;
+	}
+	return handle_open(inode_index_from_path(path));
+}
+
+static void
+bench_seq(bench_run* run, char* buf)
+{
+	int size = 64 * (1 << 20) * scale;
+	uint64_t fh = open_file("/seq");
+	file_handle* file = handle_get(fh);
+
+	run_start(run, "seq-write", size / BENCH_SEQ_CHUNK);
+	for (int off = 0; off < size; off += BENCH_SEQ_CHUNK) {
+		uint64_t start = now_ns();
+		run_op(run, start, write_handle(file, buf, BENCH_SEQ_CHUNK, off));
+		run->bytes += BENCH_SEQ_CHUNK;
+	}
+	run_report(run);
+
+	run_start(run, "seq-read", size / BENCH_SEQ_CHUNK);
+	for (int off = 0; off < size; off += BENCH_SEQ_CHUNK) {
+		uint64_t start = now_ns();
+		run_op(run, start, read_handle(file, buf, BENCH_SEQ_CHUNK, off));
+		run->bytes += BENCH_SEQ_CHUNK;
+	}
+	run_report(run);
+	handle_release(fh);
+}
+
+static void
+bench_random(bench_run* run, char* buf)
+{
+	int blocks = 16 * 256 * scale;   // 16MB per scale
+	int ops = 50000 * scale;
+	uint64_t fh = open_file("/random");
+	file_handle* file = handle_get(fh);
+	// lay the file out first so reads hit data, not end of file
+	for (int ii = 0; ii < blocks; ii++) {
+		write_handle(file, buf, BENCH_IO_SIZE, (off_t) ii * BENCH_IO_SIZE);
+	}
+
+	srand(1);
+	run_start(run, "random-write-4k", ops);
+	for (int ii = 0; ii < ops; ii++) {
+		off_t off = (off_t) (rand() % blocks) * BENCH_IO_SIZE;
+		uint64_t start = now_ns();
+		run_op(run, start, write_handle(file, buf, BENCH_IO_SIZE, off));
+		run->bytes += BENCH_IO_SIZE;
+	}
+	run_report(run);
+
+	run_start(run, "random-read-4k", ops);
+	for (int ii = 0; ii < ops; ii++) {
+		off_t off = (off_t) (rand() % blocks) * BENCH_IO_SIZE;
+		uint64_t start = now_ns();
+		run_op(run, start, read_handle(file, buf, BENCH_IO_SIZE, off));
+		run->bytes += BENCH_IO_SIZE;
+	}
+	run_report(run);
+	handle_release(fh);
+}
+
+static void
+bench_storm(bench_run* run, char* buf)
+{
+	int files = 20000 * scale;
+	char path[64];
+	struct stat st;
+	create_dir("/storm", 0755);
+
+	run_start(run, "create", files);
+	for (int ii = 0; ii < files; ii++) {
+		sprintf(path, "/storm/file-%d", ii);
+		uint64_t start = now_ns();
+		run_op(run, start, create_inode_at_path(path, S_IFREG | 0644));
+	}
+	run_report(run);
+
+	srand(2);
+	run_start(run, "stat", files);
+	for (int ii = 0; ii < files; ii++) {
+		sprintf(path, "/storm/file-%d", rand() % files);
+		uint64_t start = now_ns();
+		run_op(run, start, get_stat(path, &st));
+	}
+	run_report(run);
+
+	run_start(run, "unlink", files);
+	for (int ii = 0; ii < files; ii++) {
+		sprintf(path, "/storm/file-%d", ii);
+		uint64_t start = now_ns();
+		run_op(run, start, unlink_file(path));
+	}
+	run_report(run);
+}
+
+static void
+bench_deep(bench_run* run, char* buf)
+{
+	int depth = 64;
+	int ops = 100000 * scale;
+	char path[64 * 8 + 16] = "";
+	struct stat st;
+	for (int ii = 0; ii < depth; ii++) {
+		sprintf(path + strlen(path), "/d%d", ii);
+		create_dir(path, 0755);
+	}
+	strcat(path, "/leaf");
+	create_inode_at_path(path, S_IFREG | 0644);
+
+	run_start(run, "deep-lookup", ops);
+	for (int ii = 0; ii < ops; ii++) {
+		uint64_t start = now_ns();
+		run_op(run, start, get_stat(path, &st));
+	}
+	run_report(run);
+}
+
+static void
+bench_wide(bench_run* run, char* buf)
+{
+	int entries = 100000 * scale;
+	int ops = 100000 * scale;
+	char path[64];
+	struct stat st;
+	create_dir("/wide", 0755);
+	for (int ii = 0; ii < entries; ii++) {
+		sprintf(path, "/wide/entry-%d", ii);
+		create_inode_at_path(path, S_IFREG | 0644);
+	}
+
+	srand(3);
+	run_start(run, "wide-lookup", ops);
+	for (int ii = 0; ii < ops; ii++) {
+		sprintf(path, "/wide/entry-%d", rand() % entries);
+		uint64_t start = now_ns();
+		run_op(run, start, get_stat(path, &st));
+	}
+	run_report(run);
+
+	// names that are not there cost a probe of the index as well
+	run_start(run, "wide-lookup-miss", ops);
+	for (int ii = 0; ii < ops; ii++) {
+		sprintf(path, "/wide/missing-%d", rand() % entries);
+		uint64_t start = now_ns();
+		get_stat(path, &st);
+		run_op(run, start, 0);
+	}
+	run_report(run);
+}
+
+static void
+bench_truncate(bench_run* run, char* buf)
+{
+	int ops = 20000 * scale;
+	int max_size = 1 << 20;
+	create_inode_at_path("/churn", S_IFREG | 0644);
+
+	srand(4);
+	run_start(run, "truncate-churn", ops);
+	for (int ii = 0; ii < ops; ii++) {
+		// alternate growing and shrinking so blocks really come and go
+		off_t size = ii % 2 ? rand() % (max_size / 8) : max_size / 2 + rand() % (max_size / 2);
+		uint64_t start = now_ns();
+		run_op(run, start, truncate("/churn", size));
+	}
+	run_report(run);
+}
+
+typedef struct bench_workload {
+	const char* name;
+	void (*fn)(bench_run* run, char* buf);
+} bench_workload;
+
+static const bench_workload workloads[] = {
+	{ "seq", bench_seq },
+	{ "random", bench_random },
+	{ "storm", bench_storm },
+	{ "deep", bench_deep },
+	{ "wide", bench_wide },
+	{ "truncate", bench_truncate },
+};
+
+static int
+selected(const char* name, int argc, char* argv[])
+{
+	if (argc == 0) {
+		return 1;
+	}
+	for (int ii = 0; ii < argc; ii++) {
+		if (strcmp(argv[ii], name) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+	char image[] = "/tmp/nufs-bench-XXXXXX";
+	int opt;
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+		case 's':
+			scale = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s scale] [workload...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	int fd = mkstemp(image);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	if (storage_init(image, 16 << 20, 0) < 0) {
+		fprintf(stderr, "cannot create image at %s\n", image);
+		unlink(image);
+		return 1;
+	}
+
+	char* buf = malloc(BENCH_SEQ_CHUNK);
+	for (int ii = 0; ii < BENCH_SEQ_CHUNK; ii++) {
+		buf[ii] = ii % 251;
+	}
+
+	printf("image %s, scale %d\n", image, scale);
+	printf("%-18s %9s %12s %9s %9s %9s %9s %9s\n", "workload", "ops", "ops/s", "MB/s",
+		"p50_us", "p90_us", "p99_us", "max_us");
+	bench_run run;
+	int nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+	for (int ii = 0; ii < nworkloads; ii++) {
+		if (selected(workloads[ii].name, argc - optind, argv + optind)) {
+			workloads[ii].fn(&run, buf);
+		}
+	}
+
+	free(buf);
+	unlink(image);
+	return 0;
+}
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "capture.h"
+
+// Unlike the tracer, a capture can't drop anything and still replay, so
+// writers take a lock and append to one buffered file. Records are written
+// as their ops finish, and stamped with the finish time under the lock,
+// which keeps those times in file order. Each also carries the time its op
+// started, which the frontends take with stats_begin on the same clock, so
+// that a timed replay starts each op when it started rather than once the
+// one before it had finished.
+
+// longest name kept; a longer one is cut short
+#define CAPTURE_NAME_MAX 4095
+const int CAPTURE_BUFFER_SIZE = 1 << 20;
+
+int capture_enabled = 0;
+
+static FILE* capture_file = NULL;
+static uint64_t capture_start;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+capture_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int
+capture_open(const char* path)
+{
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		return -errno;
+	}
+	setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+	capture_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = CAPTURE_VERSION;
+	header.record_size = sizeof(capture_record);
+	fwrite(&header, sizeof(header), 1, file);
+	// out of the buffer before FUSE forks, or both processes would write it
+	fflush(file);
+
+	capture_file = file;
+	capture_start = capture_now();
+	capture_enabled = 1;
+	return 0;
+}
+
+void
+capture_close()
+{
+	pthread_mutex_lock(&capture_lock);
+	capture_enabled = 0;
+	if (capture_file != NULL) {
+		fclose(capture_file);
+		capture_file = NULL;
+	}
+	pthread_mutex_unlock(&capture_lock);
+}
+
+static size_t
+name_len(const char* name)
+{
+	size_t len = name ? strlen(name) : 0;
+	return len < CAPTURE_NAME_MAX ? len : CAPTURE_NAME_MAX;
+}
+
+static void
+capture_write(capture_record* rec, uint64_t start, const char* name, const char* name2)
+{
+	size_t len = name_len(name);
+	size_t len2 = name_len(name2);
+	rec->names_len = len + len2 + 2;
+
+	pthread_mutex_lock(&capture_lock);
+	if (capture_file != NULL) {
+		rec->start = start > capture_start ? start - capture_start : 0;
+		rec->time = capture_now() - capture_start;
+		fwrite(rec, sizeof(capture_record), 1, capture_file);
+		fwrite(name ? name : "", 1, len, capture_file);
+		fputc('\0', capture_file);
+		fwrite(name2 ? name2 : "", 1, len2, capture_file);
+		fputc('\0', capture_file);
+	}
+	pthread_mutex_unlock(&capture_lock);
+}
+
+void
+capture_path(int op, uint64_t start, const char* path, const char* path2,
+             uint64_t handle, int64_t offset, uint64_t size, int result)
+{
+	capture_record rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.op = op;
+	rec.inode = -1;
+	rec.inode2 = -1;
+	rec.result = result;
+	rec.handle = handle;
+	rec.offset = offset;
+	rec.size = size;
+	capture_write(&rec, start, path, path2);
+}
+
+void
+capture_inode(int op, uint64_t start, int inode, const char* name, int inode2,
+              const char* name2, uint64_t handle, int64_t offset, uint64_t size,
+              int result)
+{
+	capture_record rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.op = op;
+	rec.flags = CAPTURE_BY_INODE;
+	rec.inode = inode;
+	rec.inode2 = inode2;
+	rec.result = result;
+	rec.handle = handle;
+	rec.offset = offset;
+	rec.size = size;
+	capture_write(&rec, start, name, name2);
+}
+
+int
+capture_read_header(FILE* file)
+{
+	capture_header header;
+	if (fread(&header, sizeof(header), 1, file) != 1
+			|| memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != CAPTURE_VERSION
+			|| header.record_size != sizeof(capture_record)) {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+int
+capture_read(FILE* file, capture_record* rec, char* names, const char** name2)
+{
+	size_t got = fread(rec, 1, sizeof(capture_record), file);
+	if (got == 0 && feof(file)) {
+		return 0;
+	}
+	if (got != sizeof(capture_record) || rec->op >= CAPTURE_NUM_OPS || rec->names_len < 2
+			|| fread(names, 1, rec->names_len, file) != rec->names_len
+			|| names[rec->names_len - 1] != '\0') {
+		return -EINVAL;
+	}
+	*name2 = names + strlen(names) + 1;
+	if (*name2 >= names + rec->names_len) {
+		return -EINVAL;
+	}
+	return 1;
+}
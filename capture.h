@@ -0,0 +1,97 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Capture of every storage call the frontends make, in a compact binary
+// form that nufs-replay can run again offline. A capture file is a
+// capture_header followed by records, each a capture_record and then its
+// names: two NUL-terminated strings, empty when unused.
+
+#define CAPTURE_MAGIC   "NUFSCAP1"
+#define CAPTURE_VERSION 2
+
+typedef enum capture_op {
+	CAPTURE_LOOKUP,     // name in directory inode
+	CAPTURE_GETATTR,
+	CAPTURE_READDIR,    // offset is the cookie
+	CAPTURE_MKNOD,      // size is the mode
+	CAPTURE_MKDIR,      // size is the mode
+	CAPTURE_LINK,       // name to name2, or inode into inode2 as name2
+	CAPTURE_UNLINK,
+	CAPTURE_RMDIR,
+	CAPTURE_RENAME,     // name to name2; by inode, from inode to inode2
+	CAPTURE_CHMOD,      // size is the mode
+	CAPTURE_TRUNCATE,   // size is the new size
+	CAPTURE_OPEN,       // handle is the handle opened
+	CAPTURE_RELEASE,
+	CAPTURE_READ,
+	CAPTURE_WRITE,
+	CAPTURE_UTIMENS,    // offset and size are the atime and mtime seconds
+	CAPTURE_FSYNC,
+	CAPTURE_FALLOCATE,  // handle is the mode; offset and size the range
+	CAPTURE_NUM_OPS
+} capture_op;
+
+// the op was addressed by inode index, from the low-level frontend, rather
+// than by path
+#define CAPTURE_BY_INODE 1
+
+typedef struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+} capture_header;
+
+typedef struct capture_record {
+	uint64_t start;     // ns since the capture started, when the op started
+	uint64_t time;      // ns since the capture started, when the op finished
+	uint8_t op;
+	uint8_t flags;
+	uint16_t names_len; // bytes of names after the record
+	int32_t inode;      // by inode: the inode, or the directory of name
+	int32_t inode2;     // by inode: the directory of name2
+	int32_t result;     // what the op returned
+	uint64_t handle;    // open file the op went through, 0 for none
+	int64_t offset;
+	uint64_t size;
+} capture_record;
+
+extern int capture_enabled;
+
+// start is when the op started, as stats_begin returns it
+#define CAPTURE_PATH(op, start, path, path2, handle, offset, size, result) \
+	do { \
+		if (__builtin_expect(capture_enabled, 0)) { \
+			capture_path((op), (start), (path), (path2), (handle), (offset), (size), \
+				(result)); \
+		} \
+	} while (0)
+
+#define CAPTURE_INODE(op, start, inode, name, inode2, name2, handle, offset, size, result) \
+	do { \
+		if (__builtin_expect(capture_enabled, 0)) { \
+			capture_inode((op), (start), (inode), (name), (inode2), (name2), (handle), \
+				(offset), (size), (result)); \
+		} \
+	} while (0)
+
+// starts capturing to a new file at path; returns -errno on failure
+int  capture_open(const char* path);
+// writes out everything captured and stops
+void capture_close();
+void capture_path(int op, uint64_t start, const char* path, const char* path2,
+                  uint64_t handle, int64_t offset, uint64_t size, int result);
+void capture_inode(int op, uint64_t start, int inode, const char* name, int inode2,
+                   const char* name2, uint64_t handle, int64_t offset, uint64_t size,
+                   int result);
+
+// reading a capture back: checks the header, then returns 1 per record,
+// with its names in names (at least CAPTURE_NAMES_MAX bytes) and name2
+// pointed at the second; 0 at the end and -EINVAL if the file is damaged
+#define CAPTURE_NAMES_MAX 65536
+int  capture_read_header(FILE* file);
+int  capture_read(FILE* file, capture_record* rec, char* names, const char** name2);
+
+#endif
@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "dcache.h"
+#include "util.h"
+
+// Path lookup cache: maps (parent inode, name) to the child inode index so a
+// warm path walk costs one hash probe per component instead of a scan of
+// every directory block. Entries remember the generation of their parent;
+// freeing an inode bumps its generation, which orphans everything cached
+// underneath it without walking the table.
+//
+// Names known not to exist are cached too, with a child of -ENOENT, so that
+// repeated probes for missing files skip the directory scan. Adding an entry
+// overwrites any negative entry for the same name.
+//
+// The buckets are split among DCACHE_STRIPES locks, bucket b under lock b
+// mod DCACHE_STRIPES, so lookups in different buckets do not wait for each
+// other. The bucket count is a multiple of the lock count, so a name keeps
+// its lock as the table grows. Growing the table, and growing the array of
+// generations, take every lock in order. Each lock counts the hits and
+// misses in its buckets. A bucket lock is always the innermost lock taken.
+
+const int DCACHE_INITIAL_BUCKETS = 1024;
+const int DCACHE_MAX_BUCKETS = 1 << 20;
+#define DCACHE_STRIPES 256
+
+typedef struct dentry {
+	struct dentry* next;
+	unsigned hash;
+	int parent;
+	unsigned parent_gen;
+	int child;
+	int len;
+	char name[];
+} dentry;
+
+// a lock and the counts for the buckets under it, a cache line apiece
+typedef struct dcache_stripe {
+	pthread_mutex_t lock;
+	long hits;
+	long negative_hits;
+	long misses;
+} __attribute__((aligned(64))) dcache_stripe;
+
+static dentry** buckets = NULL;
+static int num_buckets = 0;
+static int num_entries = 0;
+
+static unsigned* generations = NULL;
+static int num_generations = 0;
+// serializes dcache_forget_inode
+static pthread_mutex_t generations_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static dcache_stripe stripes[DCACHE_STRIPES];
+
+static unsigned
+dentry_hash(int parent, const char* name, int len)
+{
+	return name_hash(name, len) ^ ((unsigned) parent * 0x9e3779b1u);
+}
+
+static dcache_stripe*
+stripe_for(unsigned hash)
+{
+	return &stripes[hash % DCACHE_STRIPES];
+}
+
+static void
+lock_all()
+{
+	for (int ii = 0; ii < DCACHE_STRIPES; ii++) {
+		pthread_mutex_lock(&stripes[ii].lock);
+	}
+}
+
+static void
+unlock_all()
+{
+	for (int ii = DCACHE_STRIPES - 1; ii >= 0; ii--) {
+		pthread_mutex_unlock(&stripes[ii].lock);
+	}
+}
+
+// the caller holds a bucket lock
+static unsigned
+parent_generation(int parent)
+{
+	return parent < num_generations
+		? __atomic_load_n(&generations[parent], __ATOMIC_RELAXED) : 0;
+}
+
+void
+dcache_init()
+{
+	for (int ii = 0; ii < DCACHE_STRIPES; ii++) {
+		pthread_mutex_init(&stripes[ii].lock, NULL);
+	}
+	num_buckets = DCACHE_INITIAL_BUCKETS;
+	buckets = calloc(num_buckets, sizeof(dentry*));
+	num_entries = 0;
+}
+
+// the caller holds the bucket's lock
+static dentry**
+dcache_find(unsigned hash, int parent, const char* name, int len)
+{
+	dentry** link = &buckets[hash & (num_buckets - 1)];
+	while (*link != NULL) {
+		dentry* entry = *link;
+		if (entry->hash == hash && entry->parent == parent && entry->len == len
+				&& memcmp(entry->name, name, len) == 0) {
+			return link;
+		}
+		link = &entry->next;
+	}
+	return link;
+}
+
+static void
+dcache_unlink(dentry** link)
+{
+	dentry* entry = *link;
+	*link = entry->next;
+	free(entry);
+	__atomic_sub_fetch(&num_entries, 1, __ATOMIC_RELAXED);
+}
+
+int
+dcache_lookup(int parent, const char* name, int len)
+{
+	unsigned hash = dentry_hash(parent, name, len);
+	dcache_stripe* stripe = stripe_for(hash);
+	pthread_mutex_lock(&stripe->lock);
+	dentry** link = dcache_find(hash, parent, name, len);
+	dentry* entry = *link;
+	int child = DCACHE_MISS;
+	if (entry == NULL) {
+		stripe->misses++;
+	} else if (entry->parent_gen != parent_generation(parent)) {
+		// the parent was freed since this was cached
+		dcache_unlink(link);
+		stripe->misses++;
+	} else {
+		if (entry->child < 0) {
+			stripe->negative_hits++;
+		} else {
+			stripe->hits++;
+		}
+		child = entry->child;
+	}
+	pthread_mutex_unlock(&stripe->lock);
+	return child;
+}
+
+// doubles the buckets, unless another thread already has
+static void
+dcache_grow()
+{
+	lock_all();
+	if (num_entries >= num_buckets && num_buckets < DCACHE_MAX_BUCKETS) {
+		int new_num_buckets = num_buckets * 2;
+		dentry** new_buckets = calloc(new_num_buckets, sizeof(dentry*));
+		for (int ii = 0; ii < num_buckets; ii++) {
+			dentry* entry = buckets[ii];
+			while (entry != NULL) {
+				dentry* next = entry->next;
+				dentry** head = &new_buckets[entry->hash & (new_num_buckets - 1)];
+				entry->next = *head;
+				*head = entry;
+				entry = next;
+			}
+		}
+		free(buckets);
+		buckets = new_buckets;
+		__atomic_store_n(&num_buckets, new_num_buckets, __ATOMIC_RELAXED);
+	}
+	unlock_all();
+}
+
+void
+dcache_insert(int parent, const char* name, int len, int child)
+{
+	unsigned hash = dentry_hash(parent, name, len);
+	dcache_stripe* stripe = stripe_for(hash);
+	int size = __atomic_load_n(&num_buckets, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&num_entries, __ATOMIC_RELAXED) >= size && size < DCACHE_MAX_BUCKETS) {
+		dcache_grow();
+	}
+
+	pthread_mutex_lock(&stripe->lock);
+	dentry** link = dcache_find(hash, parent, name, len);
+	if (*link != NULL) {
+		(*link)->child = child;
+		(*link)->parent_gen = parent_generation(parent);
+		pthread_mutex_unlock(&stripe->lock);
+		return;
+	}
+
+	if (num_buckets == DCACHE_MAX_BUCKETS
+			&& __atomic_load_n(&num_entries, __ATOMIC_RELAXED) >= num_buckets) {
+		// full: make room by dropping whatever shares our bucket
+		dentry** head = &buckets[hash & (num_buckets - 1)];
+		while (*head != NULL) {
+			dcache_unlink(head);
+		}
+		link = head;
+	}
+
+	dentry* entry = malloc(sizeof(dentry) + len);
+	entry->next = NULL;
+	entry->hash = hash;
+	entry->parent = parent;
+	entry->parent_gen = parent_generation(parent);
+	entry->child = child;
+	entry->len = len;
+	memcpy(entry->name, name, len);
+	*link = entry;
+	__atomic_add_fetch(&num_entries, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&stripe->lock);
+}
+
+void
+dcache_insert_negative(int parent, const char* name, int len)
+{
+	dcache_insert(parent, name, len, -ENOENT);
+}
+
+void
+dcache_remove(int parent, const char* name, int len)
+{
+	unsigned hash = dentry_hash(parent, name, len);
+	dcache_stripe* stripe = stripe_for(hash);
+	pthread_mutex_lock(&stripe->lock);
+	dentry** link = dcache_find(hash, parent, name, len);
+	if (*link != NULL) {
+		dcache_unlink(link);
+	}
+	pthread_mutex_unlock(&stripe->lock);
+}
+
+void
+dcache_forget_inode(int inode_index)
+{
+	pthread_mutex_lock(&generations_lock);
+	if (inode_index >= num_generations) {
+		// lookups read the array under their bucket locks
+		lock_all();
+		int new_size = max(inode_index + 1, num_generations * 2);
+		generations = realloc(generations, new_size * sizeof(unsigned));
+		memset(generations + num_generations, 0,
+			(new_size - num_generations) * sizeof(unsigned));
+		num_generations = new_size;
+		unlock_all();
+	}
+	__atomic_add_fetch(&generations[inode_index], 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&generations_lock);
+}
+
+void
+dcache_get_stats(dcache_stats* out)
+{
+	memset(out, 0, sizeof(dcache_stats));
+	for (int ii = 0; ii < DCACHE_STRIPES; ii++) {
+		pthread_mutex_lock(&stripes[ii].lock);
+		out->hits += stripes[ii].hits;
+		out->negative_hits += stripes[ii].negative_hits;
+		out->misses += stripes[ii].misses;
+		pthread_mutex_unlock(&stripes[ii].lock);
+	}
+	out->entries = __atomic_load_n(&num_entries, __ATOMIC_RELAXED);
+}
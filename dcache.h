@@ -0,0 +1,22 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+// returned by dcache_lookup when (parent, name) is not cached
+#define DCACHE_MISS (-1)
+
+typedef struct dcache_stats {
+	long hits;          // answered with a cached inode
+	long negative_hits; // answered with a cached -ENOENT
+	long misses;        // fell through to the directory blocks
+	int  entries;
+} dcache_stats;
+
+void dcache_init();
+int  dcache_lookup(int parent, const char* name, int len);
+void dcache_insert(int parent, const char* name, int len, int child);
+void dcache_insert_negative(int parent, const char* name, int len);
+void dcache_remove(int parent, const char* name, int len);
+void dcache_forget_inode(int inode_index);
+void dcache_get_stats(dcache_stats* stats);
+
+#endif
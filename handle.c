@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "handle.h"
+#include "storage.h"
+
+// Slots live in fixed-size chunks that never move once allocated, so
+// handle_get reads a slot without the table lock; every read and write
+// looks up its handle, and a shared mutex there would serialize them.
+#define HANDLE_CHUNK_SLOTS 1024
+#define HANDLE_MAX_CHUNKS 1024
+
+static file_handle** handle_chunks[HANDLE_MAX_CHUNKS];
+static int num_slots = 0;
+
+// ids of released slots, reused before the table grows
+static int* free_ids = NULL;
+static int num_free_ids = 0;
+
+// guards id and chunk allocation; a file_handle's fields belong to storage.c
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static file_handle**
+handle_slot(uint64_t id)
+{
+	if (id == 0 || id >= (uint64_t) HANDLE_CHUNK_SLOTS * HANDLE_MAX_CHUNKS) {
+		return NULL;
+	}
+	file_handle** chunk = __atomic_load_n(&handle_chunks[id / HANDLE_CHUNK_SLOTS],
+		__ATOMIC_ACQUIRE);
+	return chunk ? &chunk[id % HANDLE_CHUNK_SLOTS] : NULL;
+}
+
+static int
+next_handle_id()
+{
+	if (num_free_ids == 0) {
+		int chunk = num_slots / HANDLE_CHUNK_SLOTS;
+		if (chunk >= HANDLE_MAX_CHUNKS) {
+			return -ENFILE;
+		}
+		__atomic_store_n(&handle_chunks[chunk],
+			calloc(HANDLE_CHUNK_SLOTS, sizeof(file_handle*)), __ATOMIC_RELEASE);
+		num_slots += HANDLE_CHUNK_SLOTS;
+		free_ids = realloc(free_ids, num_slots * sizeof(int));
+		// slot 0 is never handed out
+		for (int ii = num_slots - 1; ii >= num_slots - HANDLE_CHUNK_SLOTS && ii > 0; ii--) {
+			free_ids[num_free_ids++] = ii;
+		}
+	}
+	return free_ids[--num_free_ids];
+}
+
+// returns the new handle id, or -errno
+int
+handle_open(int inode_index)
+{
+	int rv = open_inode(inode_index);
+	if (rv < 0) {
+		return rv;
+	}
+
+	file_handle* fh = calloc(1, sizeof(file_handle));
+	fh->inode_index = inode_index;
+
+	pthread_mutex_lock(&handles_lock);
+	int id = next_handle_id();
+	if (id > 0) {
+		__atomic_store_n(handle_slot(id), fh, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&handles_lock);
+
+	if (id < 0) {
+		close_inode(inode_index);
+		free(fh);
+	}
+	return id;
+}
+
+file_handle*
+handle_get(uint64_t id)
+{
+	file_handle** slot = handle_slot(id);
+	return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
+}
+
+void
+handle_release(uint64_t id)
+{
+	pthread_mutex_lock(&handles_lock);
+	file_handle** slot = handle_slot(id);
+	file_handle* fh = slot ? __atomic_exchange_n(slot, NULL, __ATOMIC_ACQ_REL) : NULL;
+	if (fh != NULL) {
+		free_ids[num_free_ids++] = id;
+	}
+	pthread_mutex_unlock(&handles_lock);
+	if (fh == NULL) {
+		return;
+	}
+
+	close_inode(fh->inode_index);
+	free(fh);
+}
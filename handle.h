@@ -0,0 +1,15 @@
+#ifndef HANDLE_H
+#define HANDLE_H
+
+#include <stdint.h>
+
+#include "storage.h"
+
+// Table of open files. A handle id is what the frontends store in
+// fuse_file_info->fh; 0 is never a valid id.
+
+int          handle_open(int inode_index);
+file_handle* handle_get(uint64_t fh);
+void         handle_release(uint64_t fh);
+
+#endif
@@ -0,0 +1,1049 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "journal.h"
+#include "pages.h"
+#include "util.h"
+
+// Layout: page 0 of the journal is a header naming the sequence number of
+// the first live transaction and the page it starts on. The other pages
+// are a circular log of transactions, each one or more descriptors listing
+// the image pages it holds, each followed by a copy of the pages it lists
+// as they were at commit, and then a commit block whose checksum covers the
+// rest. A transaction that would run past the end of the log goes to page
+// 1 instead. A transaction counts only if all its descriptors and its
+// commit block carry the next sequence number and the checksum matches, so
+// a commit torn by a crash, or a stale one from an earlier lap, ends the
+// replay, and a transaction is replayed whole or not at all however many
+// descriptors it takes.
+//
+// Group commit: operations never wait for a commit. The commit thread
+// sleeps until an operation dirties something, lets the batch build up for
+// JOURNAL_COMMIT_USEC (less when a lot is dirty), stops new operations
+// from starting, waits for running ones to finish, copies every page
+// dirtied since the last commit into the log and lets operations go
+// again. It then syncs the log with one msync, so one sync covers every
+// operation in the batch, while the next batch builds up.
+//
+// Metadata is changed in the private mapping, so nothing reaches the image
+// before it commits; the thread copies each committed page to the shared
+// mapping only once the log is on disk. The image therefore never holds
+// half an operation, and replay never has anything to undo.
+//
+// Freed pages. A page that a live transaction logged may be freed and
+// then hold file data; replaying the old copy would overwrite that. So a
+// transaction lists as revoked each page it frees that a live transaction
+// logged, and replay skips the copies of a page that a later transaction
+// revoked. A freed page is not even handed back for reuse until its free
+// has committed, since a crash before then would bring back whatever
+// pointed at it.
+//
+// Checkpoints. Once more than half the log is in use, the thread starts
+// writing back the image pages logged so far, without waiting, and notes
+// where the log ends. Commits carry on into the free part of the log.
+// When the thread is next idle, or the log runs short of room, it syncs
+// those pages, which by then are mostly written, and moves the header
+// past the transactions they cover. A batch that outgrows the free part
+// of the log anyway (one operation can dirty a lot) waits for a full
+// checkpoint with operations stopped. An unmount checkpoints, so a clean
+// image replays nothing.
+//
+// Batch size. A batch has to fit in the log, since nothing of it may reach
+// the image before it commits. Apart from the shared pages (the
+// superblock and bitmaps, which one operation freeing a fragmented file
+// may dirty nearly all of) an operation dirties at most JOURNAL_OP_PAGES,
+// so journal_begin lets an operation start only while the batch, with that
+// many more for each operation running, leaves room in an empty log for
+// every shared page. New journals are sized to hold the shared pages on
+// top of the log proper.
+
+#define JOURNAL_MAGIC   0x4c4e524a // "JRNL"
+#define JOURNAL_DESC    0x43534544 // "DESC"
+#define JOURNAL_COMMIT  0x54494d43 // "CMIT"
+// version 2 journals are ones whose transactions all take one descriptor,
+// and version 1 ones also neither wrap nor revoke; both read the same way
+#define JOURNAL_VERSION 3
+
+const int JOURNAL_MIN_PAGES = 64;
+const int JOURNAL_MAX_PAGES = 1024;
+const int JOURNAL_COMMIT_USEC = 5000;
+// pages one operation may dirty besides the shared ones; the most is a
+// rename into a directory whose index has to split
+const int JOURNAL_OP_PAGES = 32;
+// private copies of committed pages kept, so that a page changed again
+// soon does not have to be copied again (16M)
+const int JOURNAL_KEEP_PAGES = 4096;
+
+typedef struct journal_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t first_seq;
+	int32_t first_page;  // 0 in version 1, where the log starts at page 1
+} journal_header;
+
+// pages[] holds the count logged pages, then the revoked ones; when a
+// transaction lists more than one descriptor holds, each is full but the
+// last, so the logged pages come first and the revoked ones after
+typedef struct journal_desc {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t seq;
+	int32_t pages[];
+} journal_desc;
+
+typedef struct journal_commit {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t seq;
+	uint64_t checksum;
+	uint32_t revokes;    // 0 in version 1
+} journal_commit;
+
+#define JOURNAL_DESC_PAGES ((4096 - (int) sizeof(journal_desc)) / (int) sizeof(int32_t))
+
+// a list of image pages and a hash set over it, so that none is listed twice
+typedef struct page_set {
+	int* pages;
+	int count;
+	int capacity;
+	int* slots;
+	int num_slots;
+} page_set;
+
+// runs of image pages
+typedef struct page_run {
+	int start;
+	int count;
+} page_run;
+
+typedef struct run_list {
+	page_run* runs;
+	int count;
+	int capacity;
+} run_list;
+
+// a page revoked by transaction seq
+typedef struct revoke {
+	int pnum;
+	uint64_t seq;
+} revoke;
+
+static bool enabled = false;
+static int journal_start;
+static int journal_pages;
+static int head;             // first page of the oldest live transaction
+static int tail;             // where the next one goes, unless it wraps
+static int used;             // log pages from head to tail, with any skipped
+static int max_batch;        // pages a batch may dirty before operations wait
+static int shared_pages;     // pages any operation may dirty, besides its own
+static int op_limit;         // what the batch and the operations running may
+                             // add to it must stay within, for the shared
+                             // pages to fit beside it
+static void (*release)(int pnum, int count) = NULL;
+
+static uint64_t next_seq;    // the sequence number of the next commit
+static uint64_t durable_seq; // everything up to this one is on disk
+
+// the batch: pages dirtied and pages freed since the last commit, and data
+// pages that have to be on disk before it commits
+static page_set dirty;
+static run_list freed;
+static run_list ordered;
+
+// pages logged by live transactions: those logged since the checkpoint in
+// progress began, and those it covers
+static page_set logged;
+static page_set checkpointing;
+static bool checkpoint_started = false;
+static int checkpoint_head;  // where the log ended when it began
+static int checkpoint_used;
+static uint64_t checkpoint_seq;
+// pages copied to the image since their private copies were last dropped
+static page_set copied;
+
+static int active = 0;       // operations between begin and end
+static bool quiescing = false;
+static bool committing = false;
+static bool commit_requested = false;
+static bool sleeping = false; // the thread is waiting for a batch to start
+static bool stopping = false;
+static __thread int depth = 0;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t begin_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t commit_thread;
+static bool thread_started = false;
+
+int
+journal_size(int64_t max_page_count, int shared)
+{
+	return clamp(max_page_count / 1024, JOURNAL_MIN_PAGES, JOURNAL_MAX_PAGES) + shared;
+}
+
+static void*
+journal_page(int ii)
+{
+	return pages_get_page(journal_start + ii);
+}
+
+static bool
+page_set_contains(page_set* ps, int pnum)
+{
+	if (ps->num_slots == 0) {
+		return false;
+	}
+	for (unsigned slot = (unsigned) pnum * 0x9e3779b1u;; slot++) {
+		int entry = ps->slots[slot & (ps->num_slots - 1)];
+		if (entry == pnum) {
+			return true;
+		}
+		if (entry < 0) {
+			return false;
+		}
+	}
+}
+
+static void
+page_set_insert_slot(page_set* ps, int pnum)
+{
+	unsigned slot = (unsigned) pnum * 0x9e3779b1u;
+	while (ps->slots[slot & (ps->num_slots - 1)] >= 0) {
+		slot++;
+	}
+	ps->slots[slot & (ps->num_slots - 1)] = pnum;
+}
+
+// adds pnum, returning false if it was already there
+static bool
+page_set_add(page_set* ps, int pnum)
+{
+	if (page_set_contains(ps, pnum)) {
+		return false;
+	}
+	if (ps->count == ps->capacity) {
+		ps->capacity = ps->capacity ? ps->capacity * 2 : 256;
+		ps->pages = realloc(ps->pages, ps->capacity * sizeof(int));
+	}
+	ps->pages[ps->count++] = pnum;
+	if (ps->count * 2 > ps->num_slots) {
+		// rebuild at twice the size, which takes pnum in too
+		ps->num_slots = ps->num_slots ? ps->num_slots * 2 : 512;
+		free(ps->slots);
+		ps->slots = malloc(ps->num_slots * sizeof(int));
+		memset(ps->slots, 0xff, ps->num_slots * sizeof(int));
+		for (int ii = 0; ii < ps->count; ii++) {
+			page_set_insert_slot(ps, ps->pages[ii]);
+		}
+	} else {
+		page_set_insert_slot(ps, pnum);
+	}
+	return true;
+}
+
+static void
+page_set_clear(page_set* ps)
+{
+	if (ps->count > 0) {
+		memset(ps->slots, 0xff, ps->num_slots * sizeof(int));
+		ps->count = 0;
+	}
+}
+
+static void
+page_set_free(page_set* ps)
+{
+	free(ps->pages);
+	free(ps->slots);
+	memset(ps, 0, sizeof(page_set));
+}
+
+// appends a run, extending the last one when they touch
+static void
+run_list_add(run_list* rl, int start, int count)
+{
+	if (rl->count > 0) {
+		page_run* last = &rl->runs[rl->count - 1];
+		if (last->start + last->count == start) {
+			last->count += count;
+			return;
+		}
+	}
+	if (rl->count == rl->capacity) {
+		rl->capacity = rl->capacity ? rl->capacity * 2 : 64;
+		rl->runs = realloc(rl->runs, rl->capacity * sizeof(page_run));
+	}
+	rl->runs[rl->count].start = start;
+	rl->runs[rl->count].count = count;
+	rl->count++;
+}
+
+static int
+compare_runs(const void* aa, const void* bb)
+{
+	const page_run* ra = aa;
+	const page_run* rb = bb;
+	return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+// whether pnum is in a run of rl, which is sorted
+static bool
+run_list_contains(run_list* rl, int pnum)
+{
+	int lo = 0;
+	int hi = rl->count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (rl->runs[mid].start + rl->runs[mid].count <= pnum) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < rl->count && rl->runs[lo].start <= pnum;
+}
+
+static int
+compare_pages(const void* aa, const void* bb)
+{
+	int pa = *(const int*) aa;
+	int pb = *(const int*) bb;
+	return (pa > pb) - (pa < pb);
+}
+
+// Syncs image pages, or with wait unset only starts writing them, a run
+// of consecutive ones at a time. Sorts pages.
+static int
+flush_pages(int* pages, int count, bool wait)
+{
+	qsort(pages, count, sizeof(int), compare_pages);
+	int rv = 0;
+	for (int ii = 0; ii < count;) {
+		int run = 1;
+		while (ii + run < count && pages[ii + run] == pages[ii] + run) {
+			run++;
+		}
+		int err = wait ? pages_sync(pages[ii], run) : pages_writeback(pages[ii], run);
+		if (err < 0 && rv == 0) {
+			rv = err;
+		}
+		ii += run;
+	}
+	return rv;
+}
+
+static uint64_t
+checksum_update(uint64_t sum, const void* page)
+{
+	const uint64_t* words = page;
+	for (int ii = 0; ii < 4096 / (int) sizeof(uint64_t); ii++) {
+		sum = (sum ^ words[ii]) * 0x100000001b3ull;
+	}
+	return sum;
+}
+
+// log pages a transaction of count pages and revokes revoked ones takes
+static int
+transaction_size(int count, int revokes)
+{
+	int descs = max(1, (count + revokes + JOURNAL_DESC_PAGES - 1) / JOURNAL_DESC_PAGES);
+	return descs + count + 1;
+}
+
+// the desc'th descriptor of the transaction at at, which logs count pages
+static journal_desc*
+transaction_desc(int at, int count, int desc)
+{
+	return journal_page(at + desc + min(count, desc * JOURNAL_DESC_PAGES));
+}
+
+// the log page holding the copy of the ii'th page the transaction at at logs
+static int
+transaction_copy(int at, int ii)
+{
+	return at + 1 + ii / JOURNAL_DESC_PAGES + ii;
+}
+
+// the ii'th page the transaction at at lists: logged, or past count, revoked
+static int
+transaction_entry(int at, int count, int ii)
+{
+	return transaction_desc(at, count, ii / JOURNAL_DESC_PAGES)->pages[ii % JOURNAL_DESC_PAGES];
+}
+
+static void
+write_header(uint64_t first_seq, int first_page)
+{
+	journal_header* header = journal_page(0);
+	header->magic = JOURNAL_MAGIC;
+	header->version = JOURNAL_VERSION;
+	header->first_seq = first_seq;
+	header->first_page = first_page;
+	pages_sync(journal_start, 1);
+}
+
+static void
+journal_setup(int start, int count, int shared, uint64_t first_seq)
+{
+	journal_start = start;
+	journal_pages = count;
+	head = 1;
+	tail = 1;
+	used = 0;
+	shared_pages = shared;
+	// a quarter of the log past the shared pages, so that a batch fits
+	// beside a checkpoint
+	max_batch = max(1, (count - 1 - shared) / 4);
+	// an empty log less the shared pages and the descriptors and commit
+	// block of a batch that fills it; a journal made before journals were
+	// sized for the shared pages may leave nothing, and then operations
+	// run one at a time
+	op_limit = count - 1 - shared - (transaction_size(count, 0) - count);
+	next_seq = first_seq;
+	durable_seq = first_seq - 1;
+	enabled = true;
+}
+
+int
+journal_format(int start, int count, int shared)
+{
+	int rv = pages_sync(0, pages_count());
+	if (rv < 0) {
+		return rv;
+	}
+	journal_setup(start, count, shared, 1);
+	write_header(1, 1);
+	return 0;
+}
+
+void
+journal_set_release(void (*fn)(int pnum, int count))
+{
+	release = fn;
+}
+
+// checks transaction seq at journal page at; returns its page count, or 0
+// if it is not a whole, committed transaction
+static int
+valid_transaction(int at, uint64_t seq)
+{
+	uint64_t sum = 0xcbf29ce484222325ull;
+	int next = at;
+	int count = 0;
+	int descs = 0;
+	// descriptors, each followed by its copies, up to the commit block;
+	// only a descriptor after full ones lists logged pages
+	for (;;) {
+		if (next + 1 > journal_pages) {
+			return 0;
+		}
+		journal_desc* desc = journal_page(next);
+		if (descs > 0 && desc->magic == JOURNAL_COMMIT) {
+			break;
+		}
+		if (desc->magic != JOURNAL_DESC || desc->seq != seq || (int) desc->count > JOURNAL_DESC_PAGES
+				|| next + 1 + (int) desc->count > journal_pages
+				|| (desc->count > 0 && count != descs * JOURNAL_DESC_PAGES)) {
+			return 0;
+		}
+		sum = checksum_update(sum, desc);
+		for (int ii = 0; ii < (int) desc->count; ii++) {
+			sum = checksum_update(sum, journal_page(next + 1 + ii));
+		}
+		count += desc->count;
+		next += 1 + desc->count;
+		descs++;
+	}
+	journal_commit* commit = journal_page(next);
+	if (commit->seq != seq || (int) commit->count != count
+			|| transaction_size(count, commit->revokes) != next + 1 - at) {
+		return 0;
+	}
+	return sum == commit->checksum ? next + 1 - at : 0;
+}
+
+// finds transaction seq at journal page *at, or at page 1 if it wrapped;
+// returns its page count, or 0 at the end of the log
+static int
+find_transaction(int* at, uint64_t seq)
+{
+	int size = valid_transaction(*at, seq);
+	if (size == 0 && *at != 1) {
+		size = valid_transaction(1, seq);
+		if (size > 0) {
+			*at = 1;
+		}
+	}
+	return size;
+}
+
+static int
+compare_revokes(const void* aa, const void* bb)
+{
+	const revoke* ra = aa;
+	const revoke* rb = bb;
+	if (ra->pnum != rb->pnum) {
+		return (ra->pnum > rb->pnum) - (ra->pnum < rb->pnum);
+	}
+	return (ra->seq > rb->seq) - (ra->seq < rb->seq);
+}
+
+// whether a transaction at or after seq revoked pnum; revoked is sorted
+static bool
+revoked_since(revoke* revoked, int count, int pnum, uint64_t seq)
+{
+	// one past the last revoke of pnum
+	int lo = 0;
+	int hi = count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (revoked[mid].pnum <= pnum) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo > 0 && revoked[lo - 1].pnum == pnum && revoked[lo - 1].seq >= seq;
+}
+
+int
+journal_recover(int start, int count, int shared)
+{
+	journal_start = start;
+	journal_pages = count;
+	journal_header* header = journal_page(0);
+	if (header->magic != JOURNAL_MAGIC || header->version < 1 || header->version > JOURNAL_VERSION) {
+		return -EINVAL;
+	}
+	uint64_t first_seq = header->first_seq;
+	int first_page = header->first_page > 0 ? header->first_page : 1;
+
+	// the first pass finds which pages were revoked, and by which transaction
+	revoke* revoked = NULL;
+	int num_revoked = 0;
+	int revoked_capacity = 0;
+	uint64_t seq = first_seq;
+	int at = first_page;
+	int size;
+	while ((size = find_transaction(&at, seq)) > 0) {
+		journal_commit* done = journal_page(at + size - 1);
+		for (int ii = 0; ii < (int) done->revokes; ii++) {
+			if (num_revoked == revoked_capacity) {
+				revoked_capacity = revoked_capacity ? revoked_capacity * 2 : 64;
+				revoked = realloc(revoked, revoked_capacity * sizeof(revoke));
+			}
+			revoked[num_revoked].pnum = transaction_entry(at, done->count, done->count + ii);
+			revoked[num_revoked].seq = seq;
+			num_revoked++;
+		}
+		at += size;
+		seq++;
+	}
+	qsort(revoked, num_revoked, sizeof(revoke), compare_revokes);
+
+	// the second puts back every copy that no later transaction revoked
+	page_set replayed = {0};
+	int num_replayed = 0;
+	int rv = 0;
+	seq = first_seq;
+	at = first_page;
+	while (rv == 0 && (size = find_transaction(&at, seq)) > 0) {
+		int num_logged = ((journal_commit*) journal_page(at + size - 1))->count;
+		for (int ii = 0; ii < num_logged; ii++) {
+			int pnum = transaction_entry(at, num_logged, ii);
+			if (revoked_since(revoked, num_revoked, pnum, seq)) {
+				continue;
+			}
+			// the image may not have grown on disk before the crash
+			if (pnum >= pages_count() && pages_grow(pnum + 1) < 0) {
+				rv = -EIO;
+				break;
+			}
+			memcpy(pages_get_page(pnum), journal_page(transaction_copy(at, ii)), 4096);
+			page_set_add(&replayed, pnum);
+		}
+		at += size;
+		seq++;
+		num_replayed++;
+	}
+	free(revoked);
+
+	// the image now holds everything, so the journal can start over
+	if (rv == 0) {
+		rv = flush_pages(replayed.pages, replayed.count, true);
+	}
+	if (rv == 0 && (num_replayed > 0 || first_page != 1 || header->version != JOURNAL_VERSION)) {
+		write_header(seq, 1);
+	}
+	page_set_free(&replayed);
+	if (rv < 0) {
+		return rv;
+	}
+	journal_setup(start, count, shared, seq);
+	return num_replayed;
+}
+
+// wakes the thread if it is waiting for a batch to start; the caller
+// holds journal_lock
+static void
+batch_started()
+{
+	if (sleeping) {
+		sleeping = false;
+		pthread_cond_signal(&commit_cond);
+	}
+}
+
+static bool
+batch_empty()
+{
+	return dirty.count == 0 && freed.count == 0;
+}
+
+// the caller holds journal_lock
+static void
+add_dirty_page(int pnum)
+{
+	if (!page_set_add(&dirty, pnum)) {
+		return;
+	}
+	batch_started();
+	if (dirty.count == max_batch / 2) {
+		// commit before the batch outgrows the log
+		commit_requested = true;
+		pthread_cond_signal(&commit_cond);
+	}
+}
+
+// stops new operations from starting and waits for running ones to end;
+// the caller holds journal_lock
+static void
+quiesce()
+{
+	quiescing = true;
+	while (active > 0) {
+		pthread_cond_wait(&idle_cond, &journal_lock);
+	}
+}
+
+static void
+resume()
+{
+	quiescing = false;
+	pthread_cond_broadcast(&begin_cond);
+}
+
+// Drops the private copies of pages copied to the image, unless they were
+// dirtied since, once there are too many. With operations stopped, such a
+// copy is the same as the page in the image, so it only holds memory.
+static void
+drop_copied()
+{
+	if (copied.count < JOURNAL_KEEP_PAGES) {
+		return;
+	}
+	qsort(copied.pages, copied.count, sizeof(int), compare_pages);
+	for (int ii = 0; ii < copied.count;) {
+		if (page_set_contains(&dirty, copied.pages[ii])) {
+			ii++;
+			continue;
+		}
+		int run = 1;
+		while (ii + run < copied.count && copied.pages[ii + run] == copied.pages[ii] + run
+				&& !page_set_contains(&dirty, copied.pages[ii + run])) {
+			run++;
+		}
+		pages_drop(copied.pages[ii], run);
+		ii += run;
+	}
+	page_set_clear(&copied);
+}
+
+// log pages free for a transaction of size pages; returns where it goes,
+// or -1 if it does not fit
+static int
+log_place(int size, int* skipped)
+{
+	int at = tail;
+	*skipped = 0;
+	if (at + size > journal_pages) {
+		*skipped = journal_pages - at;
+		at = 1;
+	}
+	return used + *skipped + size <= journal_pages - 1 ? at : -1;
+}
+
+// starts writing back the pages logged so far, which the checkpoint then
+// covers along with every transaction before the end of the log
+static void
+checkpoint_start()
+{
+	page_set swap = checkpointing;
+	checkpointing = logged;
+	logged = swap;
+	page_set_clear(&logged);
+	checkpoint_head = tail;
+	checkpoint_used = used;
+	checkpoint_seq = next_seq;
+	checkpoint_started = true;
+	flush_pages(checkpointing.pages, checkpointing.count, false);
+}
+
+// waits for the checkpoint's pages and moves the header past the
+// transactions it covers; the caller holds journal_lock, which is dropped
+// meanwhile
+static void
+checkpoint_finish()
+{
+	pthread_mutex_unlock(&journal_lock);
+	flush_pages(checkpointing.pages, checkpointing.count, true);
+	head = checkpoint_head;
+	used -= checkpoint_used;
+	if (used == 0) {
+		head = 1;
+		tail = 1;
+	}
+	write_header(checkpoint_seq, head);
+	pthread_mutex_lock(&journal_lock);
+	page_set_clear(&checkpointing);
+	checkpoint_started = false;
+}
+
+// syncs every page logged so far and empties the log
+static void
+checkpoint_all()
+{
+	if (checkpoint_started) {
+		checkpoint_finish();
+	}
+	checkpoint_start();
+	checkpoint_finish();
+}
+
+// after a commit: finishes the checkpoint in progress once the thread is
+// idle or the log is short of room, and starts one once the log is half
+// full
+static void
+checkpoint_step(bool idle)
+{
+	int room = journal_pages - 1 - used;
+	if (checkpoint_started && (idle || room < 2 * max_batch + 2)) {
+		checkpoint_finish();
+	}
+	if (!checkpoint_started && used > (journal_pages - 1) / 2) {
+		checkpoint_start();
+	}
+}
+
+// collects, after the count pages already in pages, those freed in the
+// batch that a live transaction logged; returns how many
+static int
+collect_revokes(int* pages, int count)
+{
+	int revokes = 0;
+	for (int ii = 0; ii < logged.count; ii++) {
+		if (run_list_contains(&freed, logged.pages[ii])) {
+			pages[count + revokes++] = logged.pages[ii];
+		}
+	}
+	for (int ii = 0; ii < checkpointing.count; ii++) {
+		int pnum = checkpointing.pages[ii];
+		if (run_list_contains(&freed, pnum) && !page_set_contains(&logged, pnum)) {
+			pages[count + revokes++] = pnum;
+		}
+	}
+	return revokes;
+}
+
+// Commits the batch as one transaction. The caller holds journal_lock,
+// which is dropped while the log is synced, the pages are copied to the
+// image and the freed ones are released.
+static void
+commit()
+{
+	while (committing) {
+		pthread_cond_wait(&durable_cond, &journal_lock);
+	}
+	if (batch_empty()) {
+		return;
+	}
+	committing = true;
+	quiesce();
+	drop_copied();
+
+	// a page freed in the batch is not logged, and is revoked if a live
+	// transaction logged it
+	qsort(freed.runs, freed.count, sizeof(page_run), compare_runs);
+	int* pages = malloc((dirty.count + logged.count + checkpointing.count) * sizeof(int));
+	int count = 0;
+	for (int ii = 0; ii < dirty.count; ii++) {
+		if (!run_list_contains(&freed, dirty.pages[ii])) {
+			pages[count++] = dirty.pages[ii];
+		}
+	}
+
+	uint64_t seq = next_seq++;
+	int revokes = collect_revokes(pages, count);
+	int size = transaction_size(count, revokes);
+	int skipped;
+	int at = log_place(size, &skipped);
+	if (at < 0) {
+		// the batch outgrew what is free despite the throttle; with the
+		// log empty, nothing needs revoking
+		checkpoint_all();
+		revokes = 0;
+		size = transaction_size(count, 0);
+		at = log_place(size, &skipped);
+	}
+	if (at < 0) {
+		// journal_begin keeps every batch within an empty log, unless the
+		// journal predates sizing for the shared pages and one operation
+		// dirtied more of them than it has room for. Writing the batch in
+		// place could leave half of it on disk; stopping leaves the image
+		// as of the last commit.
+		fprintf(stderr, "nufs: a batch of %d pages does not fit in the journal\n", count);
+		abort();
+	}
+
+	// descriptors listing the pages, each followed by the copies of the
+	// ones it lists, then the commit block
+	uint64_t sum = 0xcbf29ce484222325ull;
+	for (int first = 0, next = at; next < at + size - 1; first += JOURNAL_DESC_PAGES) {
+		journal_desc* desc = journal_page(next++);
+		memset(desc, 0, 4096);
+		desc->magic = JOURNAL_DESC;
+		desc->count = clamp(count - first, 0, JOURNAL_DESC_PAGES);
+		desc->seq = seq;
+		memcpy(desc->pages, pages + first,
+			clamp(count + revokes - first, 0, JOURNAL_DESC_PAGES) * sizeof(int));
+		sum = checksum_update(sum, desc);
+		for (int ii = 0; ii < (int) desc->count; ii++) {
+			void* image = journal_page(next++);
+			memcpy(image, pages_get_meta(pages[first + ii]), 4096);
+			sum = checksum_update(sum, image);
+		}
+	}
+	journal_commit* done = journal_page(at + size - 1);
+	memset(done, 0, 4096);
+	done->magic = JOURNAL_COMMIT;
+	done->count = count;
+	done->seq = seq;
+	done->checksum = sum;
+	done->revokes = revokes;
+	used += skipped + size;
+	tail = at + size;
+
+	// the copies are a consistent snapshot; the next batch can start
+	run_list released = freed;
+	run_list data = ordered;
+	memset(&freed, 0, sizeof(run_list));
+	memset(&ordered, 0, sizeof(run_list));
+	page_set_clear(&dirty);
+	resume();
+	pthread_mutex_unlock(&journal_lock);
+
+	for (int ii = 0; ii < data.count; ii++) {
+		pages_sync(data.runs[ii].start, data.runs[ii].count);
+	}
+	free(data.runs);
+	pages_sync(journal_start + at, size);
+	pthread_mutex_lock(&journal_lock);
+	durable_seq = seq;
+	pthread_cond_broadcast(&durable_cond);
+	pthread_mutex_unlock(&journal_lock);
+
+	for (int ii = 0; ii < count; ii++) {
+		memcpy(pages_get_page(pages[ii]), journal_page(transaction_copy(at, ii)), 4096);
+		page_set_add(&logged, pages[ii]);
+		page_set_add(&copied, pages[ii]);
+	}
+	for (int ii = 0; ii < released.count; ii++) {
+		pages_zero(released.runs[ii].start, released.runs[ii].count);
+		if (release != NULL) {
+			release(released.runs[ii].start, released.runs[ii].count);
+		}
+	}
+	free(released.runs);
+	free(pages);
+
+	pthread_mutex_lock(&journal_lock);
+	committing = false;
+	pthread_cond_broadcast(&durable_cond);
+}
+
+static void*
+journal_thread(void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&journal_lock);
+	while (!stopping) {
+		if (batch_empty() && !commit_requested) {
+			if (checkpoint_started) {
+				checkpoint_step(true);
+				continue;
+			}
+			// nothing to do until an operation changes something
+			sleeping = true;
+			pthread_cond_wait(&commit_cond, &journal_lock);
+			sleeping = false;
+			continue;
+		}
+		if (!commit_requested) {
+			// let the batch build up
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += JOURNAL_COMMIT_USEC * 1000;
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&commit_cond, &journal_lock, &until);
+		}
+		commit_requested = false;
+		commit();
+		checkpoint_step(false);
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return NULL;
+}
+
+// started by the first operation, so that it runs in the process that
+// serves requests and not in the one FUSE leaves behind when it forks;
+// the caller holds journal_lock
+static void
+start_thread()
+{
+	if (!thread_started) {
+		thread_started = pthread_create(&commit_thread, NULL, journal_thread, NULL) == 0;
+	}
+}
+
+void
+journal_begin()
+{
+	if (!enabled || depth++ > 0) {
+		return;
+	}
+	pthread_mutex_lock(&journal_lock);
+	start_thread();
+	// a commit is taking its snapshot, or the batch is as big as it
+	// should get before one does, or could grow too big for the log if
+	// one more operation joined those running
+	while (quiescing || (thread_started && (dirty.count >= max_batch
+			|| (active > 0 && dirty.count + (active + 1) * JOURNAL_OP_PAGES > op_limit)))) {
+		pthread_cond_wait(&begin_cond, &journal_lock);
+	}
+	active++;
+	pthread_mutex_unlock(&journal_lock);
+}
+
+void
+journal_end()
+{
+	if (!enabled || --depth > 0) {
+		return;
+	}
+	pthread_mutex_lock(&journal_lock);
+	active--;
+	if (active == 0 && quiescing) {
+		pthread_cond_signal(&idle_cond);
+	}
+	// an operation waiting for room in the batch may fit now
+	pthread_cond_broadcast(&begin_cond);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+void
+journal_dirty(const void* addr, size_t len)
+{
+	if (!enabled) {
+		return;
+	}
+	int first = pages_number(addr);
+	int last = pages_number((const char*) addr + len - 1);
+	pthread_mutex_lock(&journal_lock);
+	for (int pnum = first; pnum <= last; pnum++) {
+		add_dirty_page(pnum);
+	}
+	pthread_mutex_unlock(&journal_lock);
+}
+
+void
+journal_free(int pnum, int count)
+{
+	if (!enabled) {
+		pages_zero(pnum, count);
+		if (release != NULL) {
+			release(pnum, count);
+		}
+		return;
+	}
+	pthread_mutex_lock(&journal_lock);
+	run_list_add(&freed, pnum, count);
+	batch_started();
+	pthread_mutex_unlock(&journal_lock);
+}
+
+void
+journal_order(int pnum, int count)
+{
+	if (!enabled) {
+		pages_sync(pnum, count);
+		return;
+	}
+	pthread_mutex_lock(&journal_lock);
+	run_list_add(&ordered, pnum, count);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+void
+journal_sync()
+{
+	if (!enabled) {
+		return;
+	}
+	pthread_mutex_lock(&journal_lock);
+	if (!thread_started) {
+		// no operation has started it yet, or it could not start
+		commit();
+	}
+	uint64_t target = batch_empty() ? next_seq - 1 : next_seq;
+	if (!batch_empty()) {
+		commit_requested = true;
+		pthread_cond_signal(&commit_cond);
+	}
+	while (durable_seq < target) {
+		pthread_cond_wait(&durable_cond, &journal_lock);
+	}
+	pthread_mutex_unlock(&journal_lock);
+}
+
+void
+journal_close()
+{
+	if (!enabled) {
+		return;
+	}
+	pthread_mutex_lock(&journal_lock);
+	stopping = true;
+	pthread_cond_signal(&commit_cond);
+	pthread_mutex_unlock(&journal_lock);
+	if (thread_started) {
+		pthread_join(commit_thread, NULL);
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	thread_started = false;
+	stopping = false;
+	commit();
+	checkpoint_all();
+	enabled = false;
+	pthread_mutex_unlock(&journal_lock);
+}
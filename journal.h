@@ -0,0 +1,51 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Write-ahead journal for metadata. Each operation that changes metadata
+// runs between journal_begin and journal_end and reports every metadata
+// page it writes with journal_dirty. Metadata is written through the
+// private mapping (pages_get_meta), so those writes stay in memory; a
+// commit thread gathers the pages of all operations finished since the
+// last commit, logs them with one sync, and only then copies them to the
+// image. After a crash, journal_recover puts back every committed page.
+
+// pages the journal of an image that can grow to max_page_count pages
+// takes, given how many shared pages it has: metadata pages such as the
+// superblock and bitmaps that a single operation may dirty any number of
+int  journal_size(int64_t max_page_count, int shared);
+// starts an empty journal in pages [start, start + count), after syncing
+// the whole image so that it needs nothing from any earlier journal
+int  journal_format(int start, int count, int shared);
+// replays the transactions committed to the journal in pages [start,
+// start + count), then empties it; returns how many were replayed, or
+// -EINVAL if there is no journal there
+int  journal_recover(int start, int count, int shared);
+// sets the function that is handed each run of pages freed with
+// journal_free once the free has committed
+void journal_set_release(void (*release)(int pnum, int count));
+
+void journal_begin();
+void journal_end();
+// notes that [addr, addr + len) in the private mapping was changed
+void journal_dirty(const void* addr, size_t len);
+// notes that the running operation freed image pages [pnum, pnum + count).
+// They must not be reused until the free commits, since a crash before
+// then brings back whatever pointed at them; the commit zeroes them and
+// passes them to the release function.
+void journal_free(int pnum, int count);
+// notes that the running operation wrote file data to image pages [pnum,
+// pnum + count) that metadata it changed now points to; the commit syncs
+// them before the metadata, so a crash cannot leave it pointing at pages
+// that never reached the disk
+void journal_order(int pnum, int count);
+// commits what has been done so far and waits until it is on disk; never
+// call it between journal_begin and journal_end
+void journal_sync();
+// commits and checkpoints everything, leaving the journal empty, and stops
+// the commit thread
+void journal_close();
+
+#endif
@@ -1,9 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <bsd/string.h>
 #include <dirent.h>
 #include <assert.h>
@@ -13,25 +15,44 @@
 
 #include "storage.h"
 #include "slist.h"
+#include "nufs_ll.h"
+#include "handle.h"
+#include "trace.h"
+#include "stats.h"
+#include "capture.h"
+#include "writeback.h"
 
-const static int MAX_FILENAME = 256;
+// a read-only view of the stats, served here rather than from the image
+const static char* NUFS_STATS_DIR = "/.nufs";
+const static char* NUFS_STATS_FILE = "/.nufs/stats";
+
+static int
+nufs_is_stats_file(const char* path)
+{
+    return strcmp(path, NUFS_STATS_FILE) == 0;
+}
+
+static int
+nufs_is_stats(const char* path)
+{
+    return strcmp(path, NUFS_STATS_DIR) == 0 || nufs_is_stats_file(path);
+}
 
 // implementation for: man 2 access
 // Checks if a file exists.
 int
 nufs_access(const char *path, int mask)
 {
-    printf("\n\naccess(%s, %04o)\n", path, mask);
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "access(%s, %04o)", path, mask);
     struct stat st;
-    int rv = get_stat(path, &st);
-    if(rv < 0) {
-    	return -ENOENT;
+    int rv = 0;
+    if (!nufs_is_stats(path)) {
+        rv = get_stat(path, &st);
+        CAPTURE_PATH(CAPTURE_GETATTR, start, path, NULL, 0, 0, 0, rv);
     }
-    
-    int mode = st.st_mode;
-    
-    
-    return 0;
+    stats_end(STATS_ACCESS, start);
+    return rv < 0 ? -ENOENT : 0;
 }
 
 // implementation for: man 2 stat
@@ -39,46 +60,57 @@ nufs_access(const char *path, int mask)
 int
 nufs_getattr(const char *path, struct stat *st)
 {
-    printf("\n\ngetattr(%s)= ", path);
-    int rv = get_stat(path, st);
-    printf("%li bytes.\n", st->st_size);
-    
-    if (rv == -1) {
-        return -ENOENT;
-    }
-    else {
-        return 0;
+    uint64_t start = stats_begin();
+    int rv = 0;
+    if (nufs_is_stats(path)) {
+        memset(st, 0, sizeof(struct stat));
+        st->st_mode = nufs_is_stats_file(path) ? S_IFREG | 0444 : S_IFDIR | 0555;
+        st->st_nlink = 1;
+        st->st_size = nufs_is_stats_file(path) ? stats_format(NULL, 0) : 0;
+    } else {
+        rv = get_stat(path, st);
+        CAPTURE_PATH(CAPTURE_GETATTR, start, path, NULL, 0, 0, 0, rv);
     }
+    TRACE(TRACE_DEBUG, "getattr(%s) = %d, %ld bytes", path, rv,
+          rv == 0 ? (long) st->st_size : 0L);
+    stats_end(STATS_GETATTR, start);
+    return rv < 0 ? -ENOENT : 0;
+}
+
+typedef struct nufs_readdir_ctx {
+    void* buf;
+    fuse_fill_dir_t filler;
+} nufs_readdir_ctx;
+
+static int
+nufs_readdir_fill(void* ctx, const char* name, int inode_index,
+                  const struct stat* st, off_t next)
+{
+    nufs_readdir_ctx* rc = ctx;
+    return rc->filler(rc->buf, name, st, next);
 }
 
 // implementation for: man 2 readdir
-// lists the contents of a directory
+// lists the contents of a directory a buffer at a time, resuming from the
+// offset FUSE hands back, which is a cookie from the last call
 int
 nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
              off_t offset, struct fuse_file_info *fi)
 {
-    struct stat st;
-
-    printf("\n\nreaddir(%s)\n", path);
-	slist* filenames = get_filenames_from_dir(path);
-	slist* curr_filename = filenames;
-	while(curr_filename != NULL) {
-		printf("curr filename: %s\n", curr_filename->data);
-		char filepath[MAX_FILENAME];
-		strcpy(filepath, path);
-		strcat(filepath, curr_filename->data);
-
-		get_stat(filepath, &st);
-		int rv = filler(buf, curr_filename->data, &st, 0);
-		if(rv != 0) {
-			break;
-		}
-		
-		curr_filename = curr_filename->next;
-	}
-
-	s_free(filenames);
-    return 0;
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "readdir(%s, %ld)", path, (long) offset);
+    int rv = 0;
+    if (strcmp(path, NUFS_STATS_DIR) == 0) {
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        filler(buf, NUFS_STATS_FILE + strlen(NUFS_STATS_DIR) + 1, NULL, 0);
+    } else {
+        nufs_readdir_ctx ctx = { buf, filler };
+        rv = read_dir(path, offset, nufs_readdir_fill, &ctx);
+        CAPTURE_PATH(CAPTURE_READDIR, start, path, NULL, 0, offset, 0, rv);
+    }
+    stats_end(STATS_READDIR, start);
+    return rv;
 }
 
 // mknod makes a filesystem object like a file or directory
@@ -86,8 +118,12 @@ nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 int
 nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-    printf("\n\nmknod(%s, %04o)\n", path, mode);
-    return create_inode_at_path(path, mode);
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "mknod(%s, %04o)", path, mode);
+    int rv = create_inode_at_path(path, mode);
+    CAPTURE_PATH(CAPTURE_MKNOD, start, path, NULL, 0, 0, mode, rv);
+    stats_end(STATS_MKNOD, start);
+    return rv;
 }
 
 // most of the following callbacks implement
@@ -95,30 +131,46 @@ nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 int
 nufs_mkdir(const char *path, mode_t mode)
 {
-	printf("\n\nmkdir(%s, %i)\n", path, mode);
-	return create_dir(path);
+	uint64_t start = stats_begin();
+	TRACE(TRACE_DEBUG, "mkdir(%s, %i)", path, mode);
+	int rv = create_dir(path, mode);
+	CAPTURE_PATH(CAPTURE_MKDIR, start, path, NULL, 0, 0, mode, rv);
+	stats_end(STATS_MKDIR, start);
+	return rv;
 }
 
 int
 nufs_link(const char *path_old, const char *path_new)
 {
-	printf("\n\nlink(%s, %s)\n", path_old, path_new);
-	return link_file(path_old, path_new);
+	uint64_t start = stats_begin();
+	TRACE(TRACE_DEBUG, "link(%s, %s)", path_old, path_new);
+	int rv = link_file(path_old, path_new);
+	CAPTURE_PATH(CAPTURE_LINK, start, path_old, path_new, 0, 0, 0, rv);
+	stats_end(STATS_LINK, start);
+	return rv;
 }
 
 int
 nufs_unlink(const char *path)
 {
-    printf("\n\nunlink(%s)\n", path);
-    return unlink_file(path);
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "unlink(%s)", path);
+    int rv = unlink_file(path);
+    CAPTURE_PATH(CAPTURE_UNLINK, start, path, NULL, 0, 0, 0, rv);
+    stats_end(STATS_UNLINK, start);
+    return rv;
 }
 
 // must be empty to succeed
 int
 nufs_rmdir(const char *path)
 {
-    printf("\n\nrmdir(%s)\n", path);
-    return remove_dir(path);
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "rmdir(%s)", path);
+    int rv = remove_dir(path);
+    CAPTURE_PATH(CAPTURE_RMDIR, start, path, NULL, 0, 0, 0, rv);
+    stats_end(STATS_RMDIR, start);
+    return rv;
 }
 
 // implements: man 2 rename
@@ -126,31 +178,73 @@ nufs_rmdir(const char *path)
 int
 nufs_rename(const char *from, const char *to)
 {
-    printf("\n\nrename(%s => %s)\n", from, to);
-    return rename_file(from, to);
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "rename(%s => %s)", from, to);
+    int rv = rename_file(from, to);
+    CAPTURE_PATH(CAPTURE_RENAME, start, from, to, 0, 0, 0, rv);
+    stats_end(STATS_RENAME, start);
+    return rv;
 }
 
 int
 nufs_chmod(const char *path, mode_t mode)
 {
-    printf("\n\nchmod(%s, %04o)\n", path, mode);
-    return set_mode(path, mode);
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "chmod(%s, %04o)", path, mode);
+    int rv = set_mode(path, mode);
+    CAPTURE_PATH(CAPTURE_CHMOD, start, path, NULL, 0, 0, mode, rv);
+    stats_end(STATS_CHMOD, start);
+    return rv;
 }
 
 int
 nufs_truncate(const char *path, off_t size)
 {
-    printf("\n\ntruncate(%s, %ld bytes)\n", path, size);
-    return truncate(path, size);
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "truncate(%s, %ld bytes)", path, size);
+    int rv = truncate(path, size);
+    CAPTURE_PATH(CAPTURE_TRUNCATE, start, path, NULL, 0, 0, size, rv);
+    stats_end(STATS_TRUNCATE, start);
+    return rv;
 }
 
-// this is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
+// resolves the path once and keeps the inode in a handle,
+// so reads and writes on the descriptor skip the path walk
 int
 nufs_open(const char *path, struct fuse_file_info *fi)
 {
-    printf("\n\nopen(%s)\n", path);
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "open(%s)", path);
+    int rv = 0;
+    if (nufs_is_stats_file(path)) {
+        // its length changes between getattr and read, so skip the page cache
+        rv = (fi->flags & O_ACCMODE) == O_RDONLY ? 0 : -EACCES;
+        fi->direct_io = 1;
+        fi->fh = 0;
+    } else if ((rv = inode_index_from_path(path)) >= 0) {
+        rv = handle_open(rv);
+        if (rv >= 0) {
+            fi->fh = rv;
+            rv = 0;
+        }
+        CAPTURE_PATH(CAPTURE_OPEN, start, path, NULL, fi->fh, 0, 0, rv);
+    } else {
+        CAPTURE_PATH(CAPTURE_OPEN, start, path, NULL, 0, 0, 0, rv);
+    }
+    stats_end(STATS_OPEN, start);
+    return rv;
+}
+
+int
+nufs_release(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "release(%s)", path);
+    handle_release(fi->fh);
+    if (fi->fh != 0) {
+        CAPTURE_PATH(CAPTURE_RELEASE, start, path, NULL, fi->fh, 0, 0, 0);
+    }
+    stats_end(STATS_RELEASE, start);
     return 0;
 }
 
@@ -158,32 +252,119 @@ nufs_open(const char *path, struct fuse_file_info *fi)
 int
 nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    printf("\n\nread(%s, %ld bytes, @%ld)\n", path, size, offset);
-    return read_file(path, buf, size, offset);
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "read(%s, %ld bytes, @%ld)", path, size, offset);
+    file_handle* fh = fi ? handle_get(fi->fh) : NULL;
+    int rv;
+    if (fh != NULL) {
+        rv = read_handle(fh, buf, size, offset);
+        CAPTURE_PATH(CAPTURE_READ, start, path, NULL, fi->fh, offset, size, rv);
+    } else if (nufs_is_stats_file(path)) {
+        rv = stats_read(buf, size, offset);
+    } else {
+        rv = read_file(path, buf, size, offset);
+        CAPTURE_PATH(CAPTURE_READ, start, path, NULL, 0, offset, size, rv);
+    }
+    stats_end(STATS_READ, start);
+    return rv;
 }
 
 // Actually write data
 int
 nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    printf("\n\nwrite(%s, %ld bytes, @%ld)\n", path, size, offset);
-    return write_file(path, buf, size, offset);
+    uint64_t start = stats_begin();
+    TRACE(TRACE_DEBUG, "write(%s, %ld bytes, @%ld)", path, size, offset);
+    file_handle* fh = fi ? handle_get(fi->fh) : NULL;
+    int rv = fh != NULL ? write_handle(fh, buf, size, offset)
+                        : write_file(path, buf, size, offset);
+    CAPTURE_PATH(CAPTURE_WRITE, start, path, NULL, fh ? fi->fh : 0, offset, size, rv);
+    stats_end(STATS_WRITE, start);
+    return rv;
+}
+
+// writes go straight into the image, so a close has nothing to flush
+int
+nufs_flush(const char *path, struct fuse_file_info *fi)
+{
+    TRACE(TRACE_DEBUG, "flush(%s)", path);
+    return 0;
 }
 
+// fdatasync too: the block map is needed to read the data back, and it is
+// metadata
+int
+nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    uint64_t start = stats_begin();
+    file_handle* fh = fi ? handle_get(fi->fh) : NULL;
+    int rv;
+    if (fh != NULL) {
+        rv = sync_inode(fh->inode_index);
+    } else if (nufs_is_stats_file(path)) {
+        rv = 0;
+    } else {
+        rv = inode_index_from_path(path);
+        rv = rv < 0 ? -ENOENT : sync_inode(rv);
+    }
+    CAPTURE_PATH(CAPTURE_FSYNC, start, path, NULL, fh ? fi->fh : 0, 0, datasync, rv);
+    TRACE(TRACE_DEBUG, "fsync(%s, %d) -> %d", path, datasync, rv);
+    stats_end(STATS_FSYNC, start);
+    return rv;
+}
+
+// preallocates, punches a hole in or zeroes part of a file; FUSE passes
+// fallocate on from 2.9
+#if FUSE_VERSION >= 29
+int
+nufs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    uint64_t start = stats_begin();
+    file_handle* fh = fi ? handle_get(fi->fh) : NULL;
+    int rv = fh != NULL ? fh->inode_index : inode_index_from_path(path);
+    rv = rv < 0 ? -ENOENT : fallocate_inode(rv, mode, offset, length);
+    CAPTURE_PATH(CAPTURE_FALLOCATE, start, path, NULL, mode, offset, length, rv);
+    TRACE(TRACE_DEBUG, "fallocate(%s, %d, %ld, %ld) -> %d", path, mode, offset, length, rv);
+    stats_end(STATS_FALLOCATE, start);
+    return rv;
+}
+#endif
+
 // Update the timestamps on a file or directory.
 int
 nufs_utimens(const char* path, const struct timespec ts[2])
 {
+    uint64_t start = stats_begin();
     int rv = set_time(path, ts);
-    printf("\n\nutimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
+    CAPTURE_PATH(CAPTURE_UTIMENS, start, path, NULL, 0, ts[0].tv_sec, ts[1].tv_sec, rv);
+    TRACE(TRACE_DEBUG, "utimens(%s, [%ld, %ld; %ld %ld]) -> %d",
            path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
+    stats_end(STATS_UTIMENS, start);
 	return rv;
 }
 
+// runs in the serving process, after FUSE has daemonized
+void*
+nufs_init(struct fuse_conn_info* conn)
+{
+    trace_start();
+    return NULL;
+}
+
+void
+nufs_destroy(void* private_data)
+{
+    storage_close();
+    capture_close();
+    trace_stop();
+}
+
 void
 nufs_init_ops(struct fuse_operations* ops)
 {
     memset(ops, 0, sizeof(struct fuse_operations));
+    ops->init     = nufs_init;
+    ops->destroy  = nufs_destroy;
     ops->access   = nufs_access;
     ops->getattr  = nufs_getattr;
     ops->readdir  = nufs_readdir;
@@ -196,19 +377,131 @@ nufs_init_ops(struct fuse_operations* ops)
     ops->chmod    = nufs_chmod;
     ops->truncate = nufs_truncate;
     ops->open	  = nufs_open;
+    ops->release  = nufs_release;
     ops->read     = nufs_read;
     ops->write    = nufs_write;
+    ops->flush    = nufs_flush;
+    ops->fsync    = nufs_fsync;
+    ops->fsyncdir = nufs_fsync;
     ops->utimens  = nufs_utimens;
+#if FUSE_VERSION >= 29
+    ops->fallocate = nufs_fallocate;
+#endif
 };
 
 struct fuse_operations nufs_ops;
 
+// nufs's own flags; everything else on the command line is for FUSE
+typedef struct nufs_options {
+    int lowlevel;       // --lowlevel: serve through the inode-based frontend
+    int64_t image_size; // --size=N[KMG]: size of a newly created image
+    int64_t max_size;   // --max-size=N[KMG]: how far a new image may grow
+    int trace_level;    // --trace=off|error|info|debug: what to log
+    const char* trace_file; // --trace-file=PATH: where to log, - for stdout
+    const char* capture_file; // --capture=PATH: record storage calls for nufs-replay
+    int64_t dirty_limit; // --dirty-limit=N[KMG]: dirty data that starts writeback early
+    int dirty_expire;    // --dirty-expire=MS: age at which dirty data is written back
+} nufs_options;
+
+static nufs_options options = { .image_size = 1024 * 1024, .trace_file = "-" };
+
+// parses a byte count with an optional K, M or G suffix; 0 if malformed
+int64_t
+nufs_parse_size(const char* text)
+{
+    char* end;
+    int64_t size = strtoll(text, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': size *= 1024; // fall through
+    case 'M': case 'm': size *= 1024; // fall through
+    case 'K': case 'k': size *= 1024;
+        end++;
+    }
+    return *end == '\0' && size > 0 ? size : 0;
+}
+
+// pulls our flags out of argv before FUSE sees it
+void
+nufs_parse_options(int* argc, char* argv[])
+{
+    int kept = 0;
+    for (int ii = 0; ii < *argc; ++ii) {
+        if (strcmp(argv[ii], "--lowlevel") == 0) {
+            options.lowlevel = 1;
+        }
+        else if (strncmp(argv[ii], "--size=", 7) == 0) {
+            options.image_size = nufs_parse_size(argv[ii] + 7);
+            if (options.image_size == 0) {
+                fprintf(stderr, "nufs: bad image size '%s'\n", argv[ii] + 7);
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[ii], "--max-size=", 11) == 0) {
+            options.max_size = nufs_parse_size(argv[ii] + 11);
+            if (options.max_size == 0) {
+                fprintf(stderr, "nufs: bad image size '%s'\n", argv[ii] + 11);
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[ii], "--trace=", 8) == 0) {
+            options.trace_level = trace_parse_level(argv[ii] + 8);
+            if (options.trace_level < 0) {
+                fprintf(stderr, "nufs: bad trace level '%s'\n", argv[ii] + 8);
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[ii], "--trace-file=", 13) == 0) {
+            options.trace_file = argv[ii] + 13;
+        }
+        else if (strncmp(argv[ii], "--capture=", 10) == 0) {
+            options.capture_file = argv[ii] + 10;
+        }
+        else if (strncmp(argv[ii], "--dirty-limit=", 14) == 0) {
+            options.dirty_limit = nufs_parse_size(argv[ii] + 14);
+            if (options.dirty_limit == 0) {
+                fprintf(stderr, "nufs: bad dirty limit '%s'\n", argv[ii] + 14);
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[ii], "--dirty-expire=", 15) == 0) {
+            options.dirty_expire = atoi(argv[ii] + 15);
+            if (options.dirty_expire <= 0) {
+                fprintf(stderr, "nufs: bad dirty expiry '%s'\n", argv[ii] + 15);
+                exit(1);
+            }
+        }
+        else {
+            argv[kept++] = argv[ii];
+        }
+    }
+    *argc = kept;
+    argv[kept] = NULL;
+}
+
 int
 main(int argc, char *argv[])
 {
+    nufs_parse_options(&argc, argv);
     assert(argc > 2 && argc < 6);
-    storage_init(argv[--argc]);
+    if (trace_open(options.trace_level, options.trace_file) < 0) {
+        fprintf(stderr, "nufs: can't open trace file %s\n", options.trace_file);
+        return 1;
+    }
+    if (options.capture_file && capture_open(options.capture_file) < 0) {
+        fprintf(stderr, "nufs: can't open capture file %s\n", options.capture_file);
+        return 1;
+    }
+    writeback_config(options.dirty_limit, options.dirty_expire);
+    const char* image = argv[--argc];
+    if (storage_init(image, options.image_size, options.max_size) < 0) {
+        fprintf(stderr, "nufs: %s is not a nufs image\n", image);
+        return 1;
+    }
+
+    if (options.lowlevel) {
+        return nufs_ll_main(argc, argv);
+    }
+
     nufs_init_ops(&nufs_ops);
-    
     return fuse_main(argc, argv, &nufs_ops, NULL);
 }
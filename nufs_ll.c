@@ -0,0 +1,601 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+
+#include "nufs_ll.h"
+#include "storage.h"
+#include "handle.h"
+#include "trace.h"
+#include "capture.h"
+#include "stats.h"
+
+// Alternative frontend on the FUSE low-level API. The kernel hands us inode
+// numbers rather than paths, so each request goes straight to the inode
+// instead of re-resolving a path from the root. FUSE reserves 1 for the
+// root, so a FUSE inode number is our inode index plus one.
+
+const static double NUFS_LL_TIMEOUT = 1.0;
+
+// a read-only view of the stats, as in the path-based frontend, under node
+// IDs past any inode's
+const static fuse_ino_t NUFS_LL_STATS_DIR = (fuse_ino_t) INT_MAX + 2;
+const static fuse_ino_t NUFS_LL_STATS_FILE = (fuse_ino_t) INT_MAX + 3;
+const static char* NUFS_LL_STATS_DIR_NAME = ".nufs";
+const static char* NUFS_LL_STATS_FILE_NAME = "stats";
+
+static int
+ll_index(fuse_ino_t ino)
+{
+    return (int) ino - 1;
+}
+
+static fuse_ino_t
+ll_ino(int inode_index)
+{
+    return (fuse_ino_t) inode_index + 1;
+}
+
+static int
+ll_stat(int inode_index, struct stat* st)
+{
+    int rv = get_stat_inode(inode_index, st);
+    st->st_ino = ll_ino(inode_index);
+    return rv;
+}
+
+static int
+ll_is_stats(fuse_ino_t ino)
+{
+    return ino == NUFS_LL_STATS_DIR || ino == NUFS_LL_STATS_FILE;
+}
+
+static void
+ll_stats_stat(fuse_ino_t ino, struct stat* st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = ino;
+    st->st_mode = ino == NUFS_LL_STATS_FILE ? S_IFREG | 0444 : S_IFDIR | 0555;
+    st->st_nlink = 1;
+    st->st_size = ino == NUFS_LL_STATS_FILE ? stats_format(NULL, 0) : 0;
+}
+
+// the stats directory or file under parent, or 0 if name is neither
+static fuse_ino_t
+ll_stats_child(fuse_ino_t parent, const char* name)
+{
+    if (parent == FUSE_ROOT_ID && strcmp(name, NUFS_LL_STATS_DIR_NAME) == 0) {
+        return NUFS_LL_STATS_DIR;
+    }
+    if (parent == NUFS_LL_STATS_DIR && strcmp(name, NUFS_LL_STATS_FILE_NAME) == 0) {
+        return NUFS_LL_STATS_FILE;
+    }
+    return 0;
+}
+
+static void
+ll_reply_stats_entry(fuse_req_t req, fuse_ino_t ino)
+{
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = ino;
+    e.attr_timeout = NUFS_LL_TIMEOUT;
+    e.entry_timeout = NUFS_LL_TIMEOUT;
+    ll_stats_stat(ino, &e.attr);
+    fuse_reply_entry(req, &e);
+}
+
+static void
+ll_reply_entry(fuse_req_t req, int inode_index)
+{
+    if (inode_index < 0) {
+        fuse_reply_err(req, -inode_index);
+        return;
+    }
+
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = ll_ino(inode_index);
+    e.generation = inode_generation(inode_index);
+    e.attr_timeout = NUFS_LL_TIMEOUT;
+    e.entry_timeout = NUFS_LL_TIMEOUT;
+    int rv = ll_stat(inode_index, &e.attr);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    fuse_reply_entry(req, &e);
+}
+
+static void
+ll_reply_status(fuse_req_t req, int rv)
+{
+    fuse_reply_err(req, rv < 0 ? -rv : 0);
+}
+
+static void
+nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    uint64_t start = stats_begin();
+    fuse_ino_t stats_ino = ll_stats_child(parent, name);
+    if (stats_ino != 0) {
+        stats_end(STATS_LOOKUP, start);
+        ll_reply_stats_entry(req, stats_ino);
+        return;
+    }
+    if (parent == NUFS_LL_STATS_DIR) {
+        stats_end(STATS_LOOKUP, start);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    int rv = lookup_child(ll_index(parent), name, strlen(name));
+    CAPTURE_INODE(CAPTURE_LOOKUP, start, ll_index(parent), name, -1, NULL, 0, 0, 0, rv);
+    stats_end(STATS_LOOKUP, start);
+    ll_reply_entry(req, rv);
+}
+
+static void
+nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    // inodes are not pinned in memory, so there is nothing to release; a
+    // freed index may be handed out again before the kernel forgets it,
+    // which the generation in each entry reply tells apart
+    fuse_reply_none(req);
+}
+
+static void
+nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    uint64_t start = stats_begin();
+    struct stat st;
+    int rv = 0;
+    if (ll_is_stats(ino)) {
+        ll_stats_stat(ino, &st);
+    } else {
+        rv = ll_stat(ll_index(ino), &st);
+        CAPTURE_INODE(CAPTURE_GETATTR, start, ll_index(ino), NULL, -1, NULL, 0, 0, 0, rv);
+    }
+    stats_end(STATS_GETATTR, start);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    fuse_reply_attr(req, &st, NUFS_LL_TIMEOUT);
+}
+
+static void
+nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
+                int to_set, struct fuse_file_info* fi)
+{
+    int inode_index = ll_index(ino);
+    int rv = 0;
+
+    // each change counts as the path-based callback that makes it
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        uint64_t start = stats_begin();
+        rv = set_mode_inode(inode_index, attr->st_mode);
+        CAPTURE_INODE(CAPTURE_CHMOD, start, inode_index, NULL, -1, NULL, 0, 0, attr->st_mode,
+                      rv);
+        stats_end(STATS_CHMOD, start);
+    }
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        uint64_t start = stats_begin();
+        rv = truncate_inode(inode_index, attr->st_size);
+        CAPTURE_INODE(CAPTURE_TRUNCATE, start, inode_index, NULL, -1, NULL, 0, 0, attr->st_size,
+                      rv);
+        stats_end(STATS_TRUNCATE, start);
+    }
+    if (rv == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        uint64_t start = stats_begin();
+        struct stat st;
+        get_stat_inode(inode_index, &st);
+        struct timespec ts[2];
+        ts[0].tv_sec = st.st_atime;
+        ts[1].tv_sec = st.st_mtime;
+        ts[0].tv_nsec = ts[1].tv_nsec = 0;
+        if (to_set & FUSE_SET_ATTR_ATIME) {
+            ts[0].tv_sec = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? time(NULL) : attr->st_atime;
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME) {
+            ts[1].tv_sec = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(NULL) : attr->st_mtime;
+        }
+        rv = set_time_inode(inode_index, ts);
+        CAPTURE_INODE(CAPTURE_UTIMENS, start, inode_index, NULL, -1, NULL, 0,
+                      ts[0].tv_sec, ts[1].tv_sec, rv);
+        stats_end(STATS_UTIMENS, start);
+    }
+
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    nufs_ll_getattr(req, ino, fi);
+}
+
+static void
+nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char* name,
+              mode_t mode, dev_t rdev)
+{
+    uint64_t start = stats_begin();
+    int rv = create_inode_at(ll_index(parent), name, mode);
+    CAPTURE_INODE(CAPTURE_MKNOD, start, ll_index(parent), name, -1, NULL, 0, 0, mode, rv);
+    stats_end(STATS_MKNOD, start);
+    ll_reply_entry(req, rv);
+}
+
+static void
+nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
+{
+    uint64_t start = stats_begin();
+    int rv = create_dir_at(ll_index(parent), name, mode);
+    CAPTURE_INODE(CAPTURE_MKDIR, start, ll_index(parent), name, -1, NULL, 0, 0, mode, rv);
+    stats_end(STATS_MKDIR, start);
+    ll_reply_entry(req, rv);
+}
+
+static void
+nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    uint64_t start = stats_begin();
+    int rv = unlink_file_at(ll_index(parent), name);
+    CAPTURE_INODE(CAPTURE_UNLINK, start, ll_index(parent), name, -1, NULL, 0, 0, 0, rv);
+    stats_end(STATS_UNLINK, start);
+    ll_reply_status(req, rv);
+}
+
+static void
+nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    uint64_t start = stats_begin();
+    int rv = remove_dir_at(ll_index(parent), name);
+    CAPTURE_INODE(CAPTURE_RMDIR, start, ll_index(parent), name, -1, NULL, 0, 0, 0, rv);
+    stats_end(STATS_RMDIR, start);
+    ll_reply_status(req, rv);
+}
+
+static void
+nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+               fuse_ino_t newparent, const char* newname)
+{
+    uint64_t start = stats_begin();
+    int rv = rename_file_at(ll_index(parent), name, ll_index(newparent), newname);
+    CAPTURE_INODE(CAPTURE_RENAME, start, ll_index(parent), name, ll_index(newparent), newname,
+                  0, 0, 0, rv);
+    stats_end(STATS_RENAME, start);
+    ll_reply_status(req, rv);
+}
+
+static void
+nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+             const char* newname)
+{
+    uint64_t start = stats_begin();
+    int rv = link_file_at(ll_index(ino), ll_index(newparent), newname);
+    CAPTURE_INODE(CAPTURE_LINK, start, ll_index(ino), NULL, ll_index(newparent), newname,
+                  0, 0, 0, rv);
+    stats_end(STATS_LINK, start);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    ll_reply_entry(req, ll_index(ino));
+}
+
+static void
+nufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    uint64_t start = stats_begin();
+    int fh;
+    if (ino == NUFS_LL_STATS_FILE) {
+        // its length changes between getattr and read, so skip the page cache
+        fh = (fi->flags & O_ACCMODE) == O_RDONLY ? 0 : -EACCES;
+        fi->direct_io = 1;
+    } else {
+        fh = handle_open(ll_index(ino));
+        CAPTURE_INODE(CAPTURE_OPEN, start, ll_index(ino), NULL, -1, NULL, fh > 0 ? fh : 0, 0, 0,
+                      fh < 0 ? fh : 0);
+    }
+    stats_end(STATS_OPEN, start);
+    if (fh < 0) {
+        fuse_reply_err(req, -fh);
+        return;
+    }
+    fi->fh = fh;
+    fuse_reply_open(req, fi);
+}
+
+static void
+nufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    uint64_t start = stats_begin();
+    if (ino != NUFS_LL_STATS_FILE) {
+        handle_release(fi->fh);
+        CAPTURE_INODE(CAPTURE_RELEASE, start, ll_index(ino), NULL, -1, NULL, fi->fh, 0, 0, 0);
+    }
+    stats_end(STATS_RELEASE, start);
+    fuse_reply_err(req, 0);
+}
+
+static void
+nufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char* name,
+               mode_t mode, struct fuse_file_info* fi)
+{
+    uint64_t start = stats_begin();
+    int inode_index = create_inode_at(ll_index(parent), name, mode);
+    CAPTURE_INODE(CAPTURE_MKNOD, start, ll_index(parent), name, -1, NULL, 0, 0, mode,
+                  inode_index);
+    if (inode_index < 0) {
+        stats_end(STATS_CREATE, start);
+        fuse_reply_err(req, -inode_index);
+        return;
+    }
+
+    int fh = handle_open(inode_index);
+    CAPTURE_INODE(CAPTURE_OPEN, start, inode_index, NULL, -1, NULL, fh > 0 ? fh : 0, 0, 0,
+                  fh < 0 ? fh : 0);
+    if (fh < 0) {
+        stats_end(STATS_CREATE, start);
+        fuse_reply_err(req, -fh);
+        return;
+    }
+    fi->fh = fh;
+
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = ll_ino(inode_index);
+    e.generation = inode_generation(inode_index);
+    e.attr_timeout = NUFS_LL_TIMEOUT;
+    e.entry_timeout = NUFS_LL_TIMEOUT;
+    ll_stat(inode_index, &e.attr);
+    stats_end(STATS_CREATE, start);
+    fuse_reply_create(req, &e, fi);
+}
+
+static void
+nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+             struct fuse_file_info* fi)
+{
+    uint64_t start = stats_begin();
+    char* buf = malloc(size);
+    int rv;
+    if (ino == NUFS_LL_STATS_FILE) {
+        rv = stats_read(buf, size, off);
+    } else {
+        file_handle* fh = handle_get(fi->fh);
+        rv = fh ? read_handle(fh, buf, size, off) : read_inode(ll_index(ino), buf, size, off);
+        CAPTURE_INODE(CAPTURE_READ, start, ll_index(ino), NULL, -1, NULL, fh ? fi->fh : 0, off,
+                      size, rv);
+    }
+    stats_end(STATS_READ, start);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_buf(req, buf, rv);
+    }
+    free(buf);
+}
+
+static void
+nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size,
+              off_t off, struct fuse_file_info* fi)
+{
+    uint64_t start = stats_begin();
+    file_handle* fh = handle_get(fi->fh);
+    int rv = fh ? write_handle(fh, buf, size, off) : write_inode(ll_index(ino), buf, size, off);
+    CAPTURE_INODE(CAPTURE_WRITE, start, ll_index(ino), NULL, -1, NULL, fh ? fi->fh : 0, off,
+                  size, rv);
+    stats_end(STATS_WRITE, start);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    fuse_reply_write(req, rv);
+}
+
+// writes go straight into the image, so a close has nothing to flush
+static void
+nufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    fuse_reply_err(req, 0);
+}
+
+// for files and directories alike; fdatasync too, since the block map is
+// metadata
+static void
+nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi)
+{
+    uint64_t start = stats_begin();
+    int rv = 0;
+    if (!ll_is_stats(ino)) {
+        rv = sync_inode(ll_index(ino));
+        CAPTURE_INODE(CAPTURE_FSYNC, start, ll_index(ino), NULL, -1, NULL, fi ? fi->fh : 0, 0,
+                      datasync, rv);
+    }
+    stats_end(STATS_FSYNC, start);
+    ll_reply_status(req, rv);
+}
+
+#if FUSE_VERSION >= 29
+static void
+nufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                  off_t length, struct fuse_file_info* fi)
+{
+    uint64_t start = stats_begin();
+    int rv = fallocate_inode(ll_index(ino), mode, offset, length);
+    CAPTURE_INODE(CAPTURE_FALLOCATE, start, ll_index(ino), NULL, -1, NULL, mode, offset,
+                  length, rv);
+    stats_end(STATS_FALLOCATE, start);
+    ll_reply_status(req, rv);
+}
+#endif
+
+typedef struct ll_dirbuf {
+    fuse_req_t req;
+    char* buf;
+    size_t size;
+    size_t used;
+} ll_dirbuf;
+
+static int
+ll_dirbuf_add(void* ctx, const char* name, int inode_index,
+              const struct stat* st, off_t next)
+{
+    ll_dirbuf* db = ctx;
+    struct stat entry_st = *st;
+    entry_st.st_ino = ll_ino(inode_index);
+
+    size_t entry_size = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used,
+                                          name, &entry_st, next);
+    if (entry_size > db->size - db->used) {
+        // full; the next call resumes with this entry
+        return 1;
+    }
+    db->used += entry_size;
+    return 0;
+}
+
+// the stats directory's three entries, with cookies 1 to 3
+static void
+ll_stats_readdir(ll_dirbuf* db, off_t off)
+{
+    const char* names[] = { ".", "..", NUFS_LL_STATS_FILE_NAME };
+    fuse_ino_t inos[] = { NUFS_LL_STATS_DIR, FUSE_ROOT_ID, NUFS_LL_STATS_FILE };
+    for (off_t ii = off; ii < 3; ii++) {
+        struct stat st;
+        ll_stats_stat(inos[ii], &st);
+        size_t entry_size = fuse_add_direntry(db->req, db->buf + db->used,
+                                              db->size - db->used, names[ii], &st, ii + 1);
+        if (entry_size > db->size - db->used) {
+            return;
+        }
+        db->used += entry_size;
+    }
+}
+
+// fills one reply buffer from the entry at cookie off onwards
+static void
+nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                struct fuse_file_info* fi)
+{
+    uint64_t start = stats_begin();
+    ll_dirbuf db = { req, malloc(size), size, 0 };
+    int rv = 0;
+    if (ino == NUFS_LL_STATS_DIR) {
+        ll_stats_readdir(&db, off);
+    } else {
+        rv = read_dir_inode(ll_index(ino), off, ll_dirbuf_add, &db);
+        CAPTURE_INODE(CAPTURE_READDIR, start, ll_index(ino), NULL, -1, NULL, 0, off, 0, rv);
+    }
+    stats_end(STATS_READDIR, start);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_buf(req, db.buf, db.used);
+    }
+    free(db.buf);
+}
+
+static void
+nufs_ll_init(void* userdata, struct fuse_conn_info* conn)
+{
+    // after FUSE has daemonized
+    trace_start();
+}
+
+static void
+nufs_ll_destroy(void* userdata)
+{
+    storage_close();
+    capture_close();
+    trace_stop();
+}
+
+static void
+nufs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    uint64_t start = stats_begin();
+    struct stat st;
+    int rv = 0;
+    if (!ll_is_stats(ino)) {
+        rv = get_stat_inode(ll_index(ino), &st);
+        CAPTURE_INODE(CAPTURE_GETATTR, start, ll_index(ino), NULL, -1, NULL, 0, 0, 0, rv);
+    }
+    stats_end(STATS_ACCESS, start);
+    ll_reply_status(req, rv);
+}
+
+void
+nufs_ll_init_ops(struct fuse_lowlevel_ops* ops)
+{
+    memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+    ops->init     = nufs_ll_init;
+    ops->destroy  = nufs_ll_destroy;
+    ops->lookup   = nufs_ll_lookup;
+    ops->forget   = nufs_ll_forget;
+    ops->getattr  = nufs_ll_getattr;
+    ops->setattr  = nufs_ll_setattr;
+    ops->mknod    = nufs_ll_mknod;
+    ops->mkdir    = nufs_ll_mkdir;
+    ops->unlink   = nufs_ll_unlink;
+    ops->rmdir    = nufs_ll_rmdir;
+    ops->rename   = nufs_ll_rename;
+    ops->link     = nufs_ll_link;
+    ops->open     = nufs_ll_open;
+    ops->release  = nufs_ll_release;
+    ops->create   = nufs_ll_create;
+    ops->read     = nufs_ll_read;
+    ops->write    = nufs_ll_write;
+    ops->flush    = nufs_ll_flush;
+    ops->fsync    = nufs_ll_fsync;
+    ops->fsyncdir = nufs_ll_fsync;
+    ops->readdir  = nufs_ll_readdir;
+    ops->access   = nufs_ll_access;
+#if FUSE_VERSION >= 29
+    ops->fallocate = nufs_ll_fallocate;
+#endif
+}
+
+struct fuse_lowlevel_ops nufs_ll_ops;
+
+int
+nufs_ll_main(int argc, char* argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_chan* ch;
+    char* mountpoint;
+    int multithreaded;
+    int foreground;
+    int err = -1;
+
+    nufs_ll_init_ops(&nufs_ll_ops);
+
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 &&
+        (ch = fuse_mount(mountpoint, &args)) != NULL) {
+        struct fuse_session* se = fuse_lowlevel_new(&args, &nufs_ll_ops,
+                                                    sizeof(nufs_ll_ops), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    fuse_opt_free_args(&args);
+
+    return err ? 1 : 0;
+}
@@ -0,0 +1,7 @@
+#ifndef NUFS_LL_H
+#define NUFS_LL_H
+
+// runs the FUSE low-level (inode based) frontend; storage must be initialized
+int nufs_ll_main(int argc, char* argv[]);
+
+#endif
@@ -15,36 +15,180 @@
 #include "slist.h"
 #include "util.h"
 
-const int NUFS_SIZE  = 1024 * 1024; // 1MB
-const int PAGE_COUNT = 256;
+static int     pages_fd    = -1;
+static void*   pages_base  =  0;
+static void*   meta_base   =  0;
+static int64_t page_count  =  0;
+static int64_t max_pages   =  0;
 
-static int   pages_fd   = -1;
-static void* pages_base =  0;
-
-void
-pages_init(const char* path)
+// Maps the image at path. An existing image is mapped at the size its
+// superblock records; a new (empty) file is first extended to size bytes
+// and left with a zeroed superblock for the caller to format. Returns 0,
+// or -EINVAL if the file is not a nufs image.
+//
+// The mapping always spans the image's maximum size, so growing it only
+// extends the file and pages never move.
+//
+// The image is mapped twice. File data and the journal go through a shared
+// mapping, so what is written there is what reaches the disk. Metadata goes
+// through a private one: a page written there stays a copy in memory, which
+// the journal writes to the shared mapping only once it has committed it,
+// so the kernel never writes back metadata that a crash could leave half
+// changed. A page not written since it was last dropped reads what the
+// shared one holds.
+int
+pages_init(const char* path, int64_t size, int64_t max_size)
 {
     pages_fd = open(path, O_CREAT | O_RDWR, 0644);
     assert(pages_fd != -1);
 
-    int rv = ftruncate(pages_fd, NUFS_SIZE);
+    struct stat st;
+    int rv = fstat(pages_fd, &st);
     assert(rv == 0);
 
-    pages_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, pages_fd, 0);
+    if (st.st_size == 0) {
+        page_count = size / 4096;
+        max_pages = max_size / 4096;
+        rv = ftruncate(pages_fd, page_count * 4096);
+        assert(rv == 0);
+    }
+    else {
+        superblock sb;
+        if (pread(pages_fd, &sb, sizeof(sb), 0) != sizeof(sb)
+            || sb.magic != NUFS_MAGIC || sb.version != NUFS_VERSION
+            || sb.page_count * 4096 > st.st_size) {
+            close(pages_fd);
+            return -EINVAL;
+        }
+        page_count = sb.page_count;
+        max_pages = sb.max_page_count;
+    }
+
+    // only the superblock is read here, so mounting costs the same at any size
+    pages_base = mmap(0, max_pages * 4096, PROT_READ | PROT_WRITE, MAP_SHARED, pages_fd, 0);
     assert(pages_base != MAP_FAILED);
+    meta_base = mmap(0, max_pages * 4096, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_NORESERVE, pages_fd, 0);
+    assert(meta_base != MAP_FAILED);
+    return 0;
 }
 
 void
 pages_free()
 {
-    int rv = munmap(pages_base, NUFS_SIZE);
+    int rv = munmap(pages_base, max_pages * 4096);
+    assert(rv == 0);
+    rv = munmap(meta_base, max_pages * 4096);
     assert(rv == 0);
 }
 
+// extends the image to count pages; they read as zeros
+int
+pages_grow(int64_t count)
+{
+    assert(count <= max_pages);
+    if (ftruncate(pages_fd, count * 4096) != 0) {
+        return -errno;
+    }
+    page_count = count;
+    return 0;
+}
+
+int64_t
+pages_count()
+{
+    return page_count;
+}
+
+superblock*
+pages_get_superblock()
+{
+    return (superblock*) meta_base;
+}
+
 void*
 pages_get_page(int pnum)
 {
-    return pages_base + 4096 * pnum;
+    return pages_base + 4096 * (int64_t) pnum;
+}
+
+// page pnum in the private mapping that metadata is read and written through
+void*
+pages_get_meta(int pnum)
+{
+    return meta_base + 4096 * (int64_t) pnum;
+}
+
+// copies pages [pnum, pnum + count) from the private mapping to the shared
+// one, for metadata written before there is a journal to carry it
+void
+pages_publish(int pnum, int count)
+{
+    memcpy(pages_get_page(pnum), pages_get_meta(pnum), 4096 * (int64_t) count);
+}
+
+// throws away the private copies of pages [pnum, pnum + count), which then
+// read what the shared mapping holds again
+void
+pages_drop(int pnum, int count)
+{
+    madvise(pages_get_meta(pnum), 4096 * (int64_t) count, MADV_DONTNEED);
+}
+
+// zeroes pages [pnum, pnum + count) in both mappings. Punching them out
+// of the file instead makes the filesystem underneath allocate them again
+// when they are reused, which is far slower.
+void
+pages_zero(int pnum, int count)
+{
+    memset(pages_get_page(pnum), 0, 4096 * (int64_t) count);
+    pages_drop(pnum, count);
+}
+
+// writes pages [pnum, pnum + count) to the image file and waits for them
+int
+pages_sync(int pnum, int64_t count)
+{
+    if (msync(pages_get_page(pnum), 4096 * count, MS_SYNC) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+// starts writing pages [pnum, pnum + count) to the image file without
+// waiting for them. msync(MS_ASYNC) would be the portable call, but Linux
+// treats it as a no-op for a shared mapping.
+int
+pages_writeback(int pnum, int64_t count)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+    if (sync_file_range(pages_fd, 4096 * (int64_t) pnum, 4096 * count, SYNC_FILE_RANGE_WRITE) != 0) {
+        return -errno;
+    }
+#else
+    if (msync(pages_get_page(pnum), 4096 * count, MS_ASYNC) != 0) {
+        return -errno;
+    }
+#endif
+    return 0;
+}
+
+// the page an address in either mapping falls in
+int
+pages_number(const void* addr)
+{
+    const char* meta = meta_base;
+    if ((const char*) addr >= meta && (const char*) addr < meta + max_pages * 4096) {
+        return ((const char*) addr - meta) / 4096;
+    }
+    return ((const char*) addr - (const char*) pages_base) / 4096;
+}
+
+// hints that pages [pnum, pnum + count) will be read soon
+void
+pages_prefetch(int pnum, int count)
+{
+    madvise(pages_get_page(pnum), 4096 * (int64_t) count, MADV_WILLNEED);
 }
 
 inode*
@@ -58,7 +202,7 @@ int
 pages_find_empty()
 {
     int pnum = -1;
-    for (int ii = 2; ii < PAGE_COUNT; ++ii) {
+    for (int ii = 2; ii < page_count; ++ii) {
         if (0) { // if page is empty
             pnum = ii;
             break;
@@ -2,6 +2,35 @@
 #define PAGES_H
 
 #include <stdio.h>
+#include <stdint.h>
+
+#define NUFS_MAGIC   0x5346554e // "NUFS"
+#define NUFS_VERSION 4
+#define NUFS_INODE_CHUNKS 32
+
+// page 0 of every image; records the geometry chosen when it was formatted
+// and how far the image has grown since
+typedef struct superblock {
+    uint32_t magic;
+    uint32_t version;
+    int64_t  page_count;        // pages in the image, including this one
+    int64_t  max_page_count;    // the bitmaps have room for this many
+    int32_t  num_inodes;
+    int32_t  max_inodes;
+    int32_t  num_data_blocks;
+    int32_t  data_bitmap_page;
+    int32_t  inode_bitmap_page;
+    int32_t  data_block_page;   // page holding data block 0
+    // the inode table is a list of chunks: chunk 0 holds first_chunk_inodes
+    // and each later one as many as all before it, so the table doubles
+    int32_t  first_chunk_inodes;
+    int32_t  num_inode_chunks;
+    int32_t  inode_chunks[NUFS_INODE_CHUNKS]; // first page of each chunk
+    // the metadata journal, carved out of the data blocks; an image
+    // formatted before there was one has 0 pages and gets one at mount
+    int32_t  journal_page;
+    int32_t  journal_pages;
+} superblock;
 
 typedef struct inode {
     int refs; // reference count
@@ -10,9 +39,20 @@ typedef struct inode {
     int xtra; // more stuff can go here
 } inode;
 
-void   pages_init(const char* path);
+int    pages_init(const char* path, int64_t size, int64_t max_size);
 void   pages_free();
+int    pages_grow(int64_t count);
+int64_t pages_count();
+superblock* pages_get_superblock();
 void*  pages_get_page(int pnum);
+void*  pages_get_meta(int pnum);
+void   pages_publish(int pnum, int count);
+void   pages_drop(int pnum, int count);
+void   pages_zero(int pnum, int count);
+void   pages_prefetch(int pnum, int count);
+int    pages_sync(int pnum, int64_t count);
+int    pages_writeback(int pnum, int64_t count);
+int    pages_number(const void* addr);
 inode* pages_get_node(int node_id);
 int    pages_find_empty();
 void   print_node(inode* node);
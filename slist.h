@@ -7,15 +7,6 @@ typedef struct slist {
     struct slist* next;
 } slist;
 
-typedef struct ilist {
-	int data;
-	int refs;
-	struct ilist* next;
-} ilist;
-
-ilist* i_cons(int i, ilist* rest);
-void   i_free(ilist* list);
-
 slist* s_cons(const char* text, slist* rest);
 void   s_free(slist* xs);
 slist* s_split(const char* text, char delim);
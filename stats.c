@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+// Latencies go in power-of-two buckets of nanoseconds: bucket b holds
+// times below 2^b, so reported percentiles are bucket upper bounds, within
+// a factor of two. A slot has a single writer, its thread, which stores
+// with relaxed atomics so readers never see a torn counter. Slots return
+// to the list when their thread exits, keeping their counts, and are
+// reused by the next thread.
+
+#define STATS_BUCKETS 64
+
+typedef struct stats_slot {
+	struct stats_slot* next;
+	int in_use;
+	uint64_t count[STATS_NUM_OPS];
+	uint64_t total_ns[STATS_NUM_OPS];
+	uint64_t buckets[STATS_NUM_OPS][STATS_BUCKETS];
+} stats_slot;
+
+static stats_slot* slots = NULL;
+static __thread stats_slot* my_slot = NULL;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+static const char* op_names[STATS_NUM_OPS] = {
+	[STATS_ACCESS]         = "access",
+	[STATS_GETATTR]        = "getattr",
+	[STATS_READDIR]        = "readdir",
+	[STATS_MKNOD]          = "mknod",
+	[STATS_MKDIR]          = "mkdir",
+	[STATS_LINK]           = "link",
+	[STATS_UNLINK]         = "unlink",
+	[STATS_RMDIR]          = "rmdir",
+	[STATS_RENAME]         = "rename",
+	[STATS_CHMOD]          = "chmod",
+	[STATS_TRUNCATE]       = "truncate",
+	[STATS_OPEN]           = "open",
+	[STATS_RELEASE]        = "release",
+	[STATS_READ]           = "read",
+	[STATS_WRITE]          = "write",
+	[STATS_UTIMENS]        = "utimens",
+	[STATS_FSYNC]          = "fsync",
+	[STATS_FALLOCATE]      = "fallocate",
+	[STATS_LOOKUP]         = "lookup",
+	[STATS_CREATE]         = "create",
+	[STATS_READ_FILE]      = "storage.read_file",
+	[STATS_WRITE_FILE]     = "storage.write_file",
+	[STATS_PATH_LOOKUP]    = "storage.inode_index_from_path",
+	[STATS_RESERVE_BLOCKS] = "storage.reserve_blocks_for_node",
+};
+
+static void
+slot_release(void* slot)
+{
+	__atomic_store_n(&((stats_slot*) slot)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+slot_key_init()
+{
+	pthread_key_create(&slot_key, slot_release);
+}
+
+static stats_slot*
+slot_for_thread()
+{
+	if (my_slot != NULL) {
+		return my_slot;
+	}
+
+	stats_slot* slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+	for (; slot != NULL; slot = slot->next) {
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&slot->in_use, &unused, 1, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if (slot == NULL) {
+		slot = calloc(1, sizeof(stats_slot));
+		slot->in_use = 1;
+		slot->next = __atomic_load_n(&slots, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&slots, &slot->next, slot, false,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+	}
+
+	pthread_once(&slot_key_once, slot_key_init);
+	pthread_setspecific(slot_key, slot);
+	my_slot = slot;
+	return slot;
+}
+
+uint64_t
+stats_begin()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void
+bump(uint64_t* counter, uint64_t by)
+{
+	__atomic_store_n(counter, *counter + by, __ATOMIC_RELAXED);
+}
+
+void
+stats_end(stats_op op, uint64_t start)
+{
+	uint64_t ns = stats_begin() - start;
+	stats_slot* slot = slot_for_thread();
+	bump(&slot->count[op], 1);
+	bump(&slot->total_ns[op], ns);
+	bump(&slot->buckets[op][64 - __builtin_clzll(ns | 1)], 1);
+}
+
+// upper bound, in microseconds, of the bucket holding the given quantile
+static double
+bucket_quantile(uint64_t* buckets, uint64_t count, double quantile)
+{
+	uint64_t wanted = (uint64_t) (count * quantile);
+	uint64_t seen = 0;
+	for (int bb = 0; bb < STATS_BUCKETS; bb++) {
+		seen += buckets[bb];
+		if (seen > wanted || (seen == count && buckets[bb] > 0)) {
+			return (double) (1ULL << bb) / 1000;
+		}
+	}
+	return 0;
+}
+
+int
+stats_format(char* buf, size_t size)
+{
+	uint64_t count[STATS_NUM_OPS] = {0};
+	uint64_t total_ns[STATS_NUM_OPS] = {0};
+	uint64_t buckets[STATS_NUM_OPS][STATS_BUCKETS];
+	memset(buckets, 0, sizeof(buckets));
+
+	stats_slot* slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+	for (; slot != NULL; slot = slot->next) {
+		for (int op = 0; op < STATS_NUM_OPS; op++) {
+			count[op] += __atomic_load_n(&slot->count[op], __ATOMIC_RELAXED);
+			total_ns[op] += __atomic_load_n(&slot->total_ns[op], __ATOMIC_RELAXED);
+			for (int bb = 0; bb < STATS_BUCKETS; bb++) {
+				buckets[op][bb] += __atomic_load_n(&slot->buckets[op][bb], __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	int len = snprintf(buf, size, "%-32s %10s %10s %10s %10s %10s %10s\n",
+		"op", "count", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+	for (int op = 0; op < STATS_NUM_OPS; op++) {
+		double mean = count[op] ? (double) total_ns[op] / count[op] / 1000 : 0;
+		bool room = (size_t) len < size;
+		len += snprintf(room ? buf + len : NULL, room ? size - len : 0,
+			"%-32s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", op_names[op],
+			(unsigned long) count[op], mean,
+			bucket_quantile(buckets[op], count[op], 0.5),
+			bucket_quantile(buckets[op], count[op], 0.9),
+			bucket_quantile(buckets[op], count[op], 0.99),
+			bucket_quantile(buckets[op], count[op], 1.0));
+	}
+	return len;
+}
+
+int
+stats_read(char* buf, size_t size, off_t offset)
+{
+	int len = stats_format(NULL, 0);
+	if (offset >= len) {
+		return 0;
+	}
+	char* text = malloc(len + 1);
+	stats_format(text, len + 1);
+	size_t count = (size_t) (len - offset) < size ? (size_t) (len - offset) : size;
+	memcpy(buf, text + offset, count);
+	free(text);
+	return count;
+}
@@ -0,0 +1,52 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Operation counters and latency histograms. Each thread records into its
+// own slot; stats_format merges them when the totals are read.
+
+typedef enum stats_op {
+	// FUSE callbacks
+	STATS_ACCESS,
+	STATS_GETATTR,
+	STATS_READDIR,
+	STATS_MKNOD,
+	STATS_MKDIR,
+	STATS_LINK,
+	STATS_UNLINK,
+	STATS_RMDIR,
+	STATS_RENAME,
+	STATS_CHMOD,
+	STATS_TRUNCATE,
+	STATS_OPEN,
+	STATS_RELEASE,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_UTIMENS,
+	STATS_FSYNC,
+	STATS_FALLOCATE,
+	// low-level FUSE callbacks with no path-based counterpart
+	STATS_LOOKUP,
+	STATS_CREATE,
+	// storage entry points
+	STATS_READ_FILE,
+	STATS_WRITE_FILE,
+	STATS_PATH_LOOKUP,
+	STATS_RESERVE_BLOCKS,
+	STATS_NUM_OPS
+} stats_op;
+
+// returns a start time to pass to stats_end
+uint64_t stats_begin();
+// counts one op that started at start
+void     stats_end(stats_op op, uint64_t start);
+// renders the merged totals as a text table; returns the full length, as
+// snprintf does
+int      stats_format(char* buf, size_t size);
+// reads the rendered totals as a file, for both frontends' /.nufs/stats
+int      stats_read(char* buf, size_t size, off_t offset);
+
+#endif
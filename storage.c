@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,33 +10,77 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
 
 #include "storage.h"
 #include "pages.h"
+#include "handle.h"
 #include "slist.h"
+#include "dcache.h"
 #include "util.h"
+#include "stats.h"
+#include "journal.h"
+#include "writeback.h"
 
 const int PAGE_SIZE = 4096;
-const int DATA_BITMAP_PAGE = 0;
-const int INODE_BITMAP_PAGE = 1;
-const int INODE_PAGE = 2;
-const int DATA_BLOCK_PAGE = 20;
-const int NUM_DATA_BLOCKS = 236;
-const int NUM_ENTRIES_IN_DIR = 15;
-const int NUM_DATA_BLOCK_IDS = 10;
-
-typedef struct file_entry {
-	char name[256];
-	int iNode_num;
-} file_entry;
-
+// smallest image we will format: superblock, bitmaps, inodes and some data
+const int MIN_IMAGE_PAGES = 16;
+// a new image gets one inode for every INODE_RATIO pages
+const int INODE_RATIO = 4;
+const int MIN_INODES = 64;
+// unless told otherwise, a new image may grow to DEFAULT_GROWTH times its
+// initial size, up to DEFAULT_MAX_SIZE
+const int DEFAULT_GROWTH = 1024;
+const int64_t DEFAULT_MAX_SIZE = 1LL << 40;
+// extents kept in the inode itself before spilling to an extent block
+const int NUM_INODE_EXTENTS = 4;
+const int NAME_MAX_LEN = 256;
+// back-to-back accesses before a handle counts as streaming
+const int SEQUENTIAL_STREAK = 2;
+const int PREFETCH_BLOCKS = 32;
+// an open file that grows by a write gets as many blocks again as it
+// holds reserved past EOF, up to this many, so that appends stay
+// contiguous and seldom allocate; the spares go on the last close or a
+// truncate
+const int PREALLOC_MAX_BLOCKS = 2048;
+
+// one entry in a directory block; rec_len spans the record and any unused
+// space after it, up to the next record
+typedef struct dir_record {
+	uint16_t rec_len;
+	uint8_t name_len;  // 0 for an unused record
+	uint8_t pad;
+	int inode_num;
+	char name[];       // NUL terminated
+} dir_record;
+
+// the smallest record, holding a one-character name
+const int DIR_RECORD_MIN = 12;
+
+// a directory block: dir_records back to back, filling the whole block
 typedef struct directory {
-	//bitmap is size 15
-	char* file_entry_bitmap;
-	file_entry entries;
+	char records[4096];
 } directory;
 
-// contains metadata for each file or directory
+// maps length file blocks starting at logical onto the data blocks
+// starting at physical
+typedef struct extent {
+	int logical;
+	int physical;
+	int length;
+} extent;
+
+const int EXTENTS_PER_BLOCK = 4096 / sizeof(extent);
+
+// a file this small keeps its data in the inode, in place of its extents
+const int INLINE_DATA_MAX = 196;
+// iNode flags
+const int INODE_INLINE = 1;
+
+// contains metadata for each file or directory; 256 bytes, 16 to a page
 typedef struct iNode {
 	// indicates object type (e.g. dir, file) and permissions
 	int mode;
@@ -47,27 +92,254 @@ typedef struct iNode {
 	time_t last_time_accessed;
 	time_t last_time_modified;
 	time_t last_time_status_change;
-	int data_block_ids[10];
-	int indirect_data_block_id;
+	// extents sorted by logical block, in extents[] or in the extent block
+	int num_extents;
+	int extent_block_id;
+	int flags;
+	union {
+		extent extents[4];
+		// with INODE_INLINE, the file's data, zero past EOF; such a file
+		// has no extents
+		char inline_data[196];
+	};
 } iNode;
 
+// Locking. Each inode has a reader/writer lock in its inode_state. Reading
+// an inode's attributes, block map, data or (for a directory) entries takes
+// it shared; changing any of them takes it exclusive. Locks nest in this
+// order:
+//
+//   1. rename_lock, taken by rename_file_at only
+//   2. directory locks, an ancestor before its descendants
+//   3. the locks of the entries being operated on in those directories
+//   4. inode_alloc_lock, then data_alloc_lock
+//   5. the dcache's and the handle table's own locks
+//
+// Apart from rename, an operation holds at most a directory and one of its
+// entries, in that order. A cross-directory rename could need its parents
+// in either order, so it first takes rename_lock, which stops any other
+// rename from changing which directory is above which, and then locks the
+// ancestor first. A freshly reserved inode is not locked; nothing can
+// reach it until its entry is added. An inode's sync_lock, which only
+// fsync takes, comes before its lock.
+//
+// Journaling. Each operation that changes metadata runs its body, the
+// matching *_in_txn function, between journal_begin and journal_end, and
+// journal_dirty is called on every superblock, bitmap, inode, extent and
+// directory byte it writes. journal_begin comes before any lock, since it
+// may wait for a commit, and a commit waits for operations to end.
+// Metadata is read and written through the private mapping (get_inode,
+// get_meta_block and the bitmaps) and file data through the shared one
+// (get_data_block); a metadata write that is not journaled never reaches
+// the image.
+
+// a run of data blocks
+typedef struct block_run {
+	int start;
+	int count;
+} block_run;
+
+// in-memory state for each inode, not stored on disk
+typedef struct inode_state {
+	pthread_rwlock_t lock;
+	// open handles; an inode unlinked while open is freed on the last close
+	int open_count;
+	// serializes fsyncs, so that one cannot return while another is still
+	// writing out blocks it took from the list
+	pthread_mutex_t sync_lock;
+	// data blocks written since the last fsync, as sorted runs that neither
+	// overlap nor touch; changed under the exclusive lock
+	block_run* dirty;
+	int num_dirty;
+	int dirty_capacity;
+	// how many of the blocks at the end of the file a write reserved as
+	// spares, for the last close to free; blocks fallocate reserved past
+	// EOF are not counted, so they stay
+	int spare_blocks;
+	// bumped each time the index is freed, so that a frontend handing out
+	// indexes as node IDs can tell a reused one from the old inode
+	unsigned generation;
+} inode_state;
+
+// states are allocated a page at a time on first use, so mounting does
+// not pay for every inode and states never move when the table grows
+const int INODE_STATES_PER_PAGE = 1024;
+static inode_state** inode_state_pages = NULL;
+
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t inode_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t data_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// geometry of the mounted image, in page 0
+static superblock* super = NULL;
+
+// free-space indexes over the inode and data bitmaps
+static bitmap_summary inode_alloc;
+static bitmap_summary data_alloc;
+
 int
 get_num_inodes()
 {
-	return (DATA_BLOCK_PAGE - INODE_PAGE) * PAGE_SIZE / sizeof(iNode);
+	// grow_inode_table publishes a new chunk by raising this
+	return __atomic_load_n(&super->num_inodes, __ATOMIC_ACQUIRE);
+}
+
+int
+get_num_data_blocks()
+{
+	return super->num_data_blocks;
+}
+
+// chunk k > 0 of the inode table holds inodes [first << (k - 1), first << k)
+int
+inode_chunk(int index)
+{
+	int first = super->first_chunk_inodes;
+	return index < first ? 0 : 32 - __builtin_clz(index / first);
+}
+
+int
+inode_chunk_start(int chunk)
+{
+	return chunk == 0 ? 0 : super->first_chunk_inodes << (chunk - 1);
 }
 
 iNode* 
 get_inode(int index)
 {
-	iNode* inode_start = pages_get_page(INODE_PAGE);
-	return inode_start + index;
+	int chunk = inode_chunk(index);
+	iNode* inode_start = pages_get_meta(super->inode_chunks[chunk]);
+	return inode_start + (index - inode_chunk_start(chunk));
+}
+
+int
+inode_index(iNode* node)
+{
+	int num_chunks = __atomic_load_n(&super->num_inode_chunks, __ATOMIC_ACQUIRE);
+	for (int ii = 0; ii < num_chunks; ii++) {
+		iNode* chunk_start = pages_get_meta(super->inode_chunks[ii]);
+		int chunk_size = ii == 0 ? super->first_chunk_inodes : inode_chunk_start(ii);
+		if (node >= chunk_start && node < chunk_start + chunk_size) {
+			return inode_chunk_start(ii) + (node - chunk_start);
+		}
+	}
+	return -1;
+}
+
+inode_state*
+get_inode_state(int inode_index)
+{
+	inode_state** page = &inode_state_pages[inode_index / INODE_STATES_PER_PAGE];
+	inode_state* states = __atomic_load_n(page, __ATOMIC_ACQUIRE);
+	if (states == NULL) {
+		inode_state* fresh = calloc(INODE_STATES_PER_PAGE, sizeof(inode_state));
+		for (int ii = 0; ii < INODE_STATES_PER_PAGE; ii++) {
+			pthread_rwlock_init(&fresh[ii].lock, NULL);
+			pthread_mutex_init(&fresh[ii].sync_lock, NULL);
+		}
+		if (__atomic_compare_exchange_n(page, &states, fresh, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			states = fresh;
+		} else {
+			// another thread got there first
+			free(fresh);
+		}
+	}
+	return &states[inode_index % INODE_STATES_PER_PAGE];
+}
+
+// locks an inode shared or exclusive; fails with -ENOENT, holding nothing,
+// if it is out of range or was freed before the lock was taken
+int
+lock_inode(int inode_index, bool exclusive)
+{
+	if (inode_index < 0 || inode_index >= get_num_inodes()) {
+		return -ENOENT;
+	}
+	pthread_rwlock_t* lock = &get_inode_state(inode_index)->lock;
+	if (exclusive) {
+		pthread_rwlock_wrlock(lock);
+	} else {
+		pthread_rwlock_rdlock(lock);
+	}
+	if (get_inode(inode_index)->mode == 0) {
+		pthread_rwlock_unlock(lock);
+		return -ENOENT;
+	}
+	return 0;
+}
+
+void
+unlock_inode(int inode_index)
+{
+	pthread_rwlock_unlock(&get_inode_state(inode_index)->lock);
+}
+
+// adds data blocks [start, start + count) to the inode's dirty runs,
+// merging it with any run it overlaps or touches, and hands them to the
+// flusher
+void
+note_dirty_blocks(inode_state* state, int start, int count)
+{
+	writeback_dirty(super->data_block_page + start, count);
+	int end = start + count;
+	// the first run that ends at or after start
+	int lo = 0;
+	int hi = state->num_dirty;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (state->dirty[mid].start + state->dirty[mid].count < start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	int next = lo;
+	while (next < state->num_dirty && state->dirty[next].start <= end) {
+		start = min(start, state->dirty[next].start);
+		end = max(end, state->dirty[next].start + state->dirty[next].count);
+		next++;
+	}
+
+	if (next == lo) {
+		if (state->num_dirty == state->dirty_capacity) {
+			state->dirty_capacity = state->dirty_capacity ? state->dirty_capacity * 2 : 4;
+			state->dirty = realloc(state->dirty, state->dirty_capacity * sizeof(block_run));
+		}
+		next = lo + 1;
+		memmove(&state->dirty[next], &state->dirty[lo], (state->num_dirty - lo) * sizeof(block_run));
+		state->num_dirty++;
+	} else {
+		// runs lo to next - 1 become the one at lo
+		memmove(&state->dirty[lo + 1], &state->dirty[next],
+			(state->num_dirty - next) * sizeof(block_run));
+		state->num_dirty -= next - lo - 1;
+	}
+	state->dirty[lo].start = start;
+	state->dirty[lo].count = end - start;
+}
+
+void
+forget_dirty_blocks(inode_state* state)
+{
+	free(state->dirty);
+	state->dirty = NULL;
+	state->num_dirty = 0;
+	state->dirty_capacity = 0;
 }
 
 void*
 get_data_block(int index)
 {
-	return pages_get_page(DATA_BLOCK_PAGE + index);
+	return pages_get_page(super->data_block_page + index);
+}
+
+// a data block holding metadata (directory entries, an index node or
+// extents), as read and written through the private mapping
+void*
+get_meta_block(int index)
+{
+	return pages_get_meta(super->data_block_page + index);
 }
 
 bool
@@ -77,21 +349,19 @@ is_inode_file(iNode* node)
 }
 
 bool
-is_inode_dir(iNode* node)
+is_inline(iNode* node)
 {
-	return (node->mode & S_IFMT) == S_IFDIR;
+	return (node->flags & INODE_INLINE) != 0;
 }
 
-directory*
-get_dir(iNode* node)
+bool
+is_inode_dir(iNode* node)
 {
-	assert(is_inode_dir(node));
-	return (directory*) get_data_block(node->data_block_ids[0]);
+	return (node->mode & S_IFMT) == S_IFDIR;
 }
 
 iNode*
-configure_inode(int inode_id, int mode, int size, int* data_block_ids, 
-	int indirect_data_block_id)
+configure_inode(int inode_id, int mode, int size)
 {
 	iNode* inode = get_inode(inode_id);
 	inode->mode = mode;
@@ -106,797 +376,2805 @@ configure_inode(int inode_id, int mode, int size, int* data_block_ids,
 	inode->last_time_modified = current_time;
 	inode->last_time_status_change = current_time;
 
-	memcpy(inode->data_block_ids, data_block_ids, NUM_DATA_BLOCK_IDS * sizeof(int));
-	inode->indirect_data_block_id = indirect_data_block_id;
-}
-
-ilist*
-get_data_block_ids(iNode* node)
-{
-	ilist* list = NULL;
-	
-	for(int ii = 0; ii < NUM_DATA_BLOCK_IDS; ii++) {
-		if(node->data_block_ids[ii] >= 0) {
-			list = i_cons(node->data_block_ids[ii], list);
-		}
-	}
-	
-	if(node->indirect_data_block_id != -1) {
-		int* extra_data_blocks = (int*) get_data_block(node->indirect_data_block_id);
-		int index_in_extra = 0;
-		while((index_in_extra + 1) * sizeof(int) < PAGE_SIZE) {
-			int curr_block_id = *(extra_data_blocks + index_in_extra);
-			
-			if (curr_block_id == 0) {
-				break;
-			}
-			list = i_cons(curr_block_id, list);
-			index_in_extra++;
-		}
-	}
-	return list;
+	inode->num_extents = 0;
+	inode->extent_block_id = -1;
+	// a new file starts out inline
+	inode->flags = is_inode_file(inode) ? INODE_INLINE : 0;
+	memset(inode->inline_data, 0, sizeof(inode->inline_data));
+	journal_dirty(inode, sizeof(iNode));
+	return inode;
 }
 
 char*
 get_inode_bitmap()
 {
-	return (char*) pages_get_page(INODE_BITMAP_PAGE);
+	return (char*) pages_get_meta(super->inode_bitmap_page);
 }
 
 char*
 get_data_bitmap()
 {
-	return (char*) pages_get_page(DATA_BITMAP_PAGE);
+	return (char*) pages_get_meta(super->data_bitmap_page);
 }
 
-int
-reserve_inode()
+// sets or clears bit index in an allocator and journals the bitmap byte
+void
+allocator_set(bitmap_summary* bs, int index, bool on)
 {
-	char* inode_bitmap = get_inode_bitmap();
-	int new_inode_index = bitmap_first_free(inode_bitmap, get_num_inodes());
-	if(new_inode_index < 0) {
-		return -ENOMEM;
-	}
-	bitmap_set(inode_bitmap, new_inode_index, true);
-	return new_inode_index;
+	bitmap_summary_set(bs, index, on);
+	journal_dirty(bs->bitmap + index / 8, 1);
 }
 
-int
-reserve_data_block()
+// sets or clears data blocks [start, start + count) in the on-disk bitmap
+// and journals the bytes; the caller holds data_alloc_lock
+void
+data_bitmap_set(int start, int count, bool on)
 {
-	char* data_bitmap = get_data_bitmap();
-	int new_block_index = bitmap_first_free(data_bitmap, NUM_DATA_BLOCKS);
-	if(new_block_index < 0) {
-		return -ENOMEM;
+	char* bitmap = get_data_bitmap();
+	for (int ii = start; ii < start + count; ii++) {
+		bitmap_set(bitmap, ii, on);
 	}
-	bitmap_set(data_bitmap, new_block_index, true);
-	return new_block_index;
+	journal_dirty(bitmap + start / 8, (start + count - 1) / 8 - start / 8 + 1);
 }
 
-int
-num_blocks_used(iNode* node)
+// rebuilds the in-memory allocation summaries from the on-disk bitmaps.
+// The data allocator works on a copy of its bitmap, since a freed block
+// stays taken there until the journal has committed the free.
+void
+allocators_init()
 {
-	int count = 0;
-	ilist* data_blocks = get_data_block_ids(node);
-	ilist* curr_block = data_blocks;
-	while(curr_block != NULL) {
-		count++;
-		curr_block = curr_block->next;
-	}
-	i_free(data_blocks);
-	return count;
+	bitmap_summary_init(&inode_alloc, get_inode_bitmap(), get_num_inodes());
+	int bytes = (get_num_data_blocks() + 63) / 64 * 8;
+	char* copy = malloc(bytes);
+	memcpy(copy, get_data_bitmap(), bytes);
+	bitmap_summary_init(&data_alloc, copy, get_num_data_blocks());
 }
 
-int
-add_block_to_node(iNode* node, int block_id)
+// hands data blocks back to the allocator once the journal has committed
+// their free; they are zero by then
+void
+release_data_blocks(int pnum, int count)
 {
-	int curr_num_blocks = num_blocks_used(node);
-	
-	if (curr_num_blocks < NUM_DATA_BLOCK_IDS) {
-		// place it in the array of block ids.
-		node->data_block_ids[curr_num_blocks] = block_id;
-	} else {
-		// place it in the indirect block.
-		int pos_in_indirect = curr_num_blocks - NUM_DATA_BLOCK_IDS;
-		if (pos_in_indirect == 0) {
-			// get an indirect block
-			int indir_block = reserve_data_block();
-			if (indir_block < 0) {
-				return -ENOSPC;
-			}
-			node->indirect_data_block_id = indir_block;
-		}
-		if (pos_in_indirect >= PAGE_SIZE / sizeof(int)) {
-			return -ENOSPC;
-		}
-		int* indirect = (int*) get_data_block(node->indirect_data_block_id);
-		*(indirect + pos_in_indirect) = block_id;
+	pthread_mutex_lock(&data_alloc_lock);
+	for (int ii = 0; ii < count; ii++) {
+		bitmap_summary_set(&data_alloc, pnum - super->data_block_page + ii, false);
 	}
-	
-	return 0;
+	pthread_mutex_unlock(&data_alloc_lock);
 }
 
+// Extends the image so that at least blocks_needed more data blocks are
+// free. The image at least doubles each time, so growth is rare and its
+// cost amortizes away. The caller holds data_alloc_lock.
 int
-add_entry_to_inode(iNode* inode, const char* entry_name, int inode_num)
+grow_data_blocks(int blocks_needed)
 {
-	directory* working_dir;
-	int file_entry_index = -1;
-	
-	
-	ilist* data_blocks = get_data_block_ids(inode);
-	ilist* curr_block = data_blocks;
-	while(curr_block != NULL) {
-		int block_id = curr_block->data;
-		
-		working_dir = (directory*) get_data_block(block_id);
-		char* file_entry_bitmap = (char*) &working_dir->file_entry_bitmap;
-		file_entry_index = bitmap_first_free(file_entry_bitmap, NUM_ENTRIES_IN_DIR);
-		if (file_entry_index >= 0) {
-			break;
-		}
-		curr_block = curr_block->next;
+	int64_t count = super->page_count * 2;
+	if (count < super->page_count + blocks_needed) {
+		count = super->page_count + blocks_needed;
 	}
-	
-	if(file_entry_index == -1) {
-		int new_block = reserve_data_block();
-		if(new_block < 0) {
-			return -ENOSPC;
-		}
-		int rv = add_block_to_node(inode, new_block);
-		if(rv < 0) {
-			return -ENOSPC;
-		}
-		working_dir = (directory*) get_data_block(new_block);
-		file_entry_index = 0;
+	if (count > super->max_page_count) {
+		count = super->max_page_count;
+	}
+	if (count - super->page_count < blocks_needed - data_alloc.num_free) {
+		return -ENOSPC;
 	}
 
-	file_entry entry;
-	strcpy(entry.name, entry_name);
-	entry.iNode_num = inode_num;
-
-	*(&working_dir->entries + file_entry_index) = entry;
-	char* file_entry_bitmap = (char*) &working_dir->file_entry_bitmap;
-	bitmap_set(file_entry_bitmap, file_entry_index, true);
-
+	int rv = pages_grow(count);
+	if (rv < 0) {
+		return rv;
+	}
+	int old_bytes = (super->num_data_blocks + 63) / 64 * 8;
+	super->page_count = count;
+	super->num_data_blocks = count - super->data_block_page;
+	journal_dirty(super, sizeof(superblock));
+	int bytes = (super->num_data_blocks + 63) / 64 * 8;
+	data_alloc.bitmap = realloc(data_alloc.bitmap, bytes);
+	memset(data_alloc.bitmap + old_bytes, 0, bytes - old_bytes);
+	bitmap_summary_grow(&data_alloc, super->num_data_blocks);
 	return 0;
 }
 
-void
-root_init()
+// Reserves count contiguous data blocks and returns the first, or -ENOSPC.
+// The image grows when fewer than count blocks are free, or, if
+// contiguous is set, when the free ones are too fragmented.
+int
+reserve_data_range(int count, bool contiguous)
 {
-	iNode* root = get_inode(0);
-	// check for a root node that already exists
-	if (root->mode != 0) {
-		return;
+	pthread_mutex_lock(&data_alloc_lock);
+	if (data_alloc.num_free < count) {
+		grow_data_blocks(count);
 	}
-	void* data_bitmap = pages_get_page(DATA_BITMAP_PAGE);
-	void* inode_bitmap = pages_get_page(INODE_BITMAP_PAGE);
-	memset(data_bitmap, 0, 4096);
-	memset(inode_bitmap, 0, 4096);
-
-	int root_index = reserve_inode();
-	root = get_inode(root_index);
-
-	int root_mode = S_IFDIR | S_IRWXU;
-	int* data_block_ids = malloc(NUM_DATA_BLOCK_IDS * sizeof(int));
-	int data_block_index = reserve_data_block();
-	data_block_ids[0] = data_block_index;
-	for(int ii = 1; ii < NUM_DATA_BLOCK_IDS; ii++) {
-		data_block_ids[ii] = -1;
+	int start = bitmap_summary_find_range(&data_alloc, count);
+	if (start < 0 && contiguous && grow_data_blocks(count) == 0) {
+		start = bitmap_summary_find_range(&data_alloc, count);
 	}
+	for (int ii = 0; start >= 0 && ii < count; ii++) {
+		bitmap_summary_set(&data_alloc, start + ii, true);
+	}
+	if (start >= 0) {
+		data_bitmap_set(start, count, true);
+	}
+	pthread_mutex_unlock(&data_alloc_lock);
+	return start < 0 ? -ENOSPC : start;
+}
 
-	root = configure_inode(root_index, root_mode, sizeof(directory), data_block_ids, -1);
-	free(data_block_ids);
-
-	add_entry_to_inode(root, ".", data_block_index);
-	add_entry_to_inode(root, "..", data_block_index);
+// reserves the count data blocks starting at goal if all of them are
+// free; returns goal, or -ENOSPC
+int
+reserve_data_range_at(int goal, int count)
+{
+	pthread_mutex_lock(&data_alloc_lock);
+	bool available = free_range_size(data_alloc.bitmap, goal, count, data_alloc.size) == count;
+	for (int ii = 0; available && ii < count; ii++) {
+		bitmap_summary_set(&data_alloc, goal + ii, true);
+	}
+	if (available) {
+		data_bitmap_set(goal, count, true);
+	}
+	pthread_mutex_unlock(&data_alloc_lock);
+	return available ? goal : -ENOSPC;
 }
 
-void
-storage_init(const char* path)
+int
+reserve_data_block()
 {
-	pages_init(path);
-	root_init();
+	pthread_mutex_lock(&data_alloc_lock);
+	int new_block_index = bitmap_summary_first_free(&data_alloc);
+	if(new_block_index < 0 && grow_data_blocks(1) == 0) {
+		new_block_index = bitmap_summary_first_free(&data_alloc);
+	}
+	if(new_block_index >= 0) {
+		bitmap_summary_set(&data_alloc, new_block_index, true);
+		data_bitmap_set(new_block_index, 1, true);
+	}
+	pthread_mutex_unlock(&data_alloc_lock);
+	return new_block_index < 0 ? -ENOSPC : new_block_index;
 }
 
+// doubles the inode table by adding a chunk as large as the existing
+// ones together, carved out of the data blocks; the caller holds
+// inode_alloc_lock
 int
-inode_child(int inode_index, char* inode_name)
+grow_inode_table()
 {
-	iNode* inode = get_inode(inode_index);
-	if(!is_inode_dir(inode)) {
-		return -ENOTDIR;
+	int chunk = super->num_inode_chunks;
+	int new_inodes = super->num_inodes;
+	if (chunk == NUFS_INODE_CHUNKS || super->num_inodes + new_inodes > super->max_inodes) {
+		return -ENOMEM;
 	}
 
-	for(int ii = 0; ii < NUM_DATA_BLOCK_IDS; ii++) {
-		int data_block_id = inode->data_block_ids[ii];
-		directory* curr_dir = (directory*) get_data_block(data_block_id);
-		for(int jj = 0; jj < NUM_ENTRIES_IN_DIR; jj++) {
-			char* file_entry_bitmap = (char*) &curr_dir->file_entry_bitmap;
-			if(bitmap_read(file_entry_bitmap, jj)) {
-				file_entry* entry = (&curr_dir->entries + jj);
-				if(strcmp(entry->name, inode_name) == 0) {
-					return entry->iNode_num;
-				}
-			}
-		}
+	int pages = new_inodes / (PAGE_SIZE / sizeof(iNode));
+	int start = reserve_data_range(pages, true);
+	if (start < 0) {
+		return -ENOMEM;
 	}
-	
-	return -ENOENT;
+	super->inode_chunks[chunk] = super->data_block_page + start;
+	__atomic_store_n(&super->num_inode_chunks, chunk + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&super->num_inodes, super->num_inodes + new_inodes, __ATOMIC_RELEASE);
+	journal_dirty(super, sizeof(superblock));
+	bitmap_summary_grow(&inode_alloc, super->num_inodes);
+	return 0;
 }
 
-slist*
-get_path_components(const char* path)
+int
+reserve_inode()
 {
-	slist* path_components = s_split(path, '/');
-	if(path_components == NULL) {
-		return (slist*) -ENOENT;
+	pthread_mutex_lock(&inode_alloc_lock);
+	int new_inode_index = bitmap_summary_first_free(&inode_alloc);
+	if(new_inode_index < 0 && grow_inode_table() == 0) {
+		new_inode_index = bitmap_summary_first_free(&inode_alloc);
 	}
-
-	if(strcmp(path_components->data, "") == 0) {
-		path_components = path_components->next;
-	} else {
-		return (slist*) -ENOENT;
+	if(new_inode_index >= 0) {
+		allocator_set(&inode_alloc, new_inode_index, true);
 	}
+	pthread_mutex_unlock(&inode_alloc_lock);
+	return new_inode_index < 0 ? -ENOMEM : new_inode_index;
+}
 
-	return path_components;
+// frees data blocks on disk; the allocator gets them back, zeroed, from
+// release_data_blocks once the journal has committed that
+void
+free_data_range(int start, int count)
+{
+	if (count <= 0) {
+		return;
+	}
+	pthread_mutex_lock(&data_alloc_lock);
+	data_bitmap_set(start, count, false);
+	pthread_mutex_unlock(&data_alloc_lock);
+	journal_free(super->data_block_page + start, count);
 }
 
-int
-inode_index_from_path_components(slist* path_components)
+void
+free_data_block(int index)
 {
-	if(path_components < 0) {
-		return -ENOENT;
+	if (index >= 0) {
+		free_data_range(index, 1);
 	}
-	int inode_index = 0;
-	slist* current = path_components;
-	while (current != NULL && strcmp(current->data, "") != 0) {
-		inode_index = inode_child(inode_index, current->data);
-		if (inode_index == -1) {
-			return -1;
-		}
-		current = current->next;
+}
+
+// a node's extents live in the inode until there are more than
+// NUM_INODE_EXTENTS of them, then all of them move to an extent block
+extent*
+inode_extents(iNode* node)
+{
+	if (node->extent_block_id >= 0) {
+		return (extent*) get_meta_block(node->extent_block_id);
 	}
-	return inode_index;
+	return node->extents;
 }
 
+// one past the last mapped file block
 int
-inode_index_from_path(const char* path)
+num_blocks_used(iNode* node)
 {
-	slist* path_components = get_path_components(path);
-	return inode_index_from_path_components(path_components);
+	if (node->num_extents == 0) {
+		return 0;
+	}
+	extent* last = inode_extents(node) + node->num_extents - 1;
+	return last->logical + last->length;
 }
 
+// how many file blocks are mapped, which with holes can be fewer than
+// num_blocks_used
 int
-parent_inode_index_from_path(const char* path)
+num_blocks_mapped(iNode* node)
+{
+	extent* extents = inode_extents(node);
+	int count = 0;
+	for (int ii = 0; ii < node->num_extents; ii++) {
+		count += extents[ii].length;
+	}
+	return count;
+}
+
+bool
+extent_contains(extent* ex, int logical_block)
 {
-	slist* path_components = get_path_components(path);
-	slist* parent_path = s_drop_last(path_components);
-	return inode_index_from_path_components(parent_path);
+	return logical_block >= ex->logical && logical_block < ex->logical + ex->length;
 }
 
+// index of the extent mapping logical_block, or -1. If hint is given, the
+// extent it names and the one after it are tried before the binary search,
+// and it is updated to the extent found.
 int
-get_stat(const char* path, struct stat* st)
+find_extent(iNode* node, int logical_block, int* hint)
 {
-	int inode_index = inode_index_from_path(path);
-	
-	if (inode_index < 0) {
-		return -1;
+	extent* extents = inode_extents(node);
+	if (hint != NULL && *hint >= 0) {
+		for (int ii = *hint; ii < *hint + 2 && ii < node->num_extents; ii++) {
+			if (extent_contains(&extents[ii], logical_block)) {
+				*hint = ii;
+				return ii;
+			}
+		}
 	}
 
-	iNode* inode = get_inode(inode_index);
-
-	memset(st, 0, sizeof(struct stat));
-	st->st_dev = makedev(0, 0);
-	st->st_ino = inode_index;
-	st->st_mode = inode->mode;
-	st->st_nlink = inode->num_hard_links;
-	st->st_uid = inode->user_id;
-	st->st_gid = inode->group_id;
-	st->st_rdev = makedev(0, 0);
-	st->st_size = inode->size;
-	st->st_blksize = 4096;
-	st->st_blocks = (int) ceil(inode->size / 512.0);
-	st->st_atime = inode->last_time_accessed;
-	st->st_mtime = inode->last_time_modified;
-	st->st_ctime = inode->last_time_status_change;
-	
-	return 0;
+	int lo = 0;
+	int hi = node->num_extents - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (logical_block < extents[mid].logical) {
+			hi = mid - 1;
+		} else if (logical_block >= extents[mid].logical + extents[mid].length) {
+			lo = mid + 1;
+		} else {
+			if (hint != NULL) {
+				*hint = mid;
+			}
+			return mid;
+		}
+	}
+	return -1;
 }
 
-slist*
-get_filenames_from_dir(const char* path)
+// data block holding file block logical_block, or -1 if it is unmapped
+int
+block_for(iNode* node, int logical_block)
 {
-	int inode_index = inode_index_from_path(path);
-	if(inode_index < 0) {
-		return (slist*) -ENOENT;
+	int ii = find_extent(node, logical_block, NULL);
+	if (ii < 0) {
+		return -1;
 	}
+	extent* ex = inode_extents(node) + ii;
+	return ex->physical + (logical_block - ex->logical);
+}
 
-	iNode* inode = get_inode(inode_index);
-	if(!is_inode_dir(inode)) {
-		return (slist*) -ENOTDIR;
+// index of the first extent ending past logical_block, or num_extents
+int
+extent_after(iNode* node, int logical_block)
+{
+	extent* extents = inode_extents(node);
+	int lo = 0;
+	int hi = node->num_extents;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (extents[mid].logical + extents[mid].length <= logical_block) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
+	return lo;
+}
 
-	slist* entry_list = NULL;
-	
-	ilist* data_blocks = get_data_block_ids(inode);
-	ilist* curr_block = data_blocks;
-	
-	while(curr_block != NULL) {
-		int data_block_id = curr_block->data;
-		directory* curr_dir = (directory*) get_data_block(data_block_id);
-		for(int jj = 0; jj < NUM_ENTRIES_IN_DIR; jj++) {
-			char* file_entry_bitmap = (char*) &curr_dir->file_entry_bitmap;
-			if(bitmap_read(file_entry_bitmap, jj)) {
-				file_entry* entry = (&curr_dir->entries + jj);
-				entry_list = s_cons(entry->name, entry_list);
-			}
+// opens a slot for a new extent at index ii, moving the extents out to an
+// extent block when the inode is full; returns it, or NULL if the extent
+// block is full too
+extent*
+insert_extent(iNode* node, int ii)
+{
+	if (node->num_extents == NUM_INODE_EXTENTS && node->extent_block_id < 0) {
+		int extent_block = reserve_data_block();
+		if (extent_block < 0) {
+			return NULL;
 		}
-		curr_block = curr_block->next;
+		memcpy(get_meta_block(extent_block), node->extents, sizeof(node->extents));
+		node->extent_block_id = extent_block;
+		journal_dirty(get_meta_block(extent_block), PAGE_SIZE);
+	} else if (node->num_extents == EXTENTS_PER_BLOCK) {
+		return NULL;
 	}
 
-	i_free(data_blocks);
-	return entry_list;
+	extent* extents = inode_extents(node);
+	memmove(&extents[ii + 1], &extents[ii], (node->num_extents - ii) * sizeof(extent));
+	node->num_extents++;
+	journal_dirty(&extents[ii], (node->num_extents - ii) * sizeof(extent));
+	journal_dirty(node, sizeof(iNode));
+	return &extents[ii];
 }
 
 void
-free_data_block(int index)
+remove_extent(iNode* node, int ii)
 {
-	if (index < 0) {
-		return;
-	}
-	void* block = get_data_block(index);
-	memset(block, 0, PAGE_SIZE);
-	
-	bitmap_set(get_data_bitmap(), index, false);
+	extent* extents = inode_extents(node);
+	memmove(&extents[ii], &extents[ii + 1], (node->num_extents - ii - 1) * sizeof(extent));
+	node->num_extents--;
+	journal_dirty(&extents[ii], (node->num_extents - ii + 1) * sizeof(extent));
+	journal_dirty(node, sizeof(iNode));
 }
 
+// moves the extents back into the inode once they fit there again
 void
-free_all_blocks(iNode* node)
+compact_extents(iNode* node)
 {
-	ilist* data_blocks = get_data_block_ids(node);
-	ilist* curr_block = data_blocks;
-	while(curr_block != NULL) {
-		int block_id = curr_block->data;
-		free_data_block(block_id);
-		curr_block = curr_block->next;
-	}	
-	for (int ii = 0; ii < NUM_DATA_BLOCK_IDS; ii++) {
-		node->data_block_ids[ii] = -1;
-	}
-	if (node->indirect_data_block_id != -1) {
-		free_data_block(node->indirect_data_block_id);
-		node->indirect_data_block_id = -1;
-	}
-	i_free(data_blocks);
-}
-
-int 
-reserve_blocks_for_node(iNode* node, int blocks_needed) 
-{
-	// try to find a contiguous range of blocks
-	int start_of_range = bitmap_find_range(
-	get_data_bitmap(), blocks_needed, NUM_DATA_BLOCKS);
-	// if we can't find a continuous range, reserve one-by-one
-	if (start_of_range < 0) {
-		int blocks_reserved = 0;
-		while (blocks_reserved < blocks_needed) {
-			int block_id = reserve_data_block();
-			if (block_id < 0) {
-				free_all_blocks(node);
-				return -ENOSPC;
-			}
-			add_block_to_node(node, block_id);
-			blocks_reserved++;
-		}
+	if (node->extent_block_id >= 0 && node->num_extents <= NUM_INODE_EXTENTS) {
+		memcpy(node->extents, inode_extents(node), node->num_extents * sizeof(extent));
+		free_data_block(node->extent_block_id);
+		node->extent_block_id = -1;
+		journal_dirty(node, sizeof(iNode));
+	}
+}
+
+// maps count already reserved blocks starting at physical onto file blocks
+// from logical on, which must be unmapped and come before extent ii, the
+// first one past them. They join the extents on either side when they
+// follow on from them both in the file and on disk.
+int
+map_extent(iNode* node, int ii, int logical, int physical, int count)
+{
+	extent* extents = inode_extents(node);
+	extent* prev = ii > 0 ? &extents[ii - 1] : NULL;
+	extent* next = ii < node->num_extents ? &extents[ii] : NULL;
+	bool joins_prev = prev != NULL && prev->logical + prev->length == logical
+		&& prev->physical + prev->length == physical;
+	bool joins_next = next != NULL && logical + count == next->logical
+		&& physical + count == next->physical;
+
+	if (joins_prev && joins_next) {
+		// fills the gap between them
+		prev->length += count + next->length;
+		journal_dirty(prev, sizeof(extent));
+		remove_extent(node, ii);
+		compact_extents(node);
+		return 0;
+	} else if (joins_prev) {
+		prev->length += count;
+		journal_dirty(prev, sizeof(extent));
+		return 0;
+	} else if (joins_next) {
+		next->logical = logical;
+		next->physical = physical;
+		next->length += count;
+		journal_dirty(next, sizeof(extent));
 		return 0;
 	}
 
-	// if we find a contiguous range, set them all
-	for (int ii = 0; ii < blocks_needed; ii++) {
-		add_block_to_node(node, start_of_range + ii);
-		bitmap_set(get_data_bitmap(), start_of_range + ii, true);
+	extent* ex = insert_extent(node, ii);
+	if (ex == NULL) {
+		return -ENOSPC;
 	}
+	ex->logical = logical;
+	ex->physical = physical;
+	ex->length = count;
 	return 0;
 }
 
+// maps count already reserved blocks starting at physical onto the end of
+// the file, growing the last extent when they are contiguous with it
 int
-remove_blocks_from_node(iNode* node, int num_to_remove)
+append_blocks(iNode* node, int physical, int count)
 {
-	int curr_num_blocks = num_blocks_used(node);
-	int index_to_remove = curr_num_blocks - 1;
-	int num_removed = 0;
-	while (num_removed < num_to_remove) {
-		free_data_block(node->data_block_ids[index_to_remove]);
-		node->data_block_ids[index_to_remove] = -1;
-		index_to_remove--;
-		if (index_to_remove < 0) {
-			return -1;
-		}
-		num_removed++;
-	}
+	return map_extent(node, node->num_extents, num_blocks_used(node), physical, count);
+}
+
+// frees every block mapped at or past file block keep
+void
+truncate_blocks(iNode* node, int keep)
+{
+	extent* extents = inode_extents(node);
+	while (node->num_extents > 0) {
+		extent* last = &extents[node->num_extents - 1];
+		if (last->logical >= keep) {
+			free_data_range(last->physical, last->length);
+			node->num_extents--;
+			continue;
+		}
+		int excess = last->logical + last->length - keep;
+		if (excess > 0) {
+			free_data_range(last->physical + last->length - excess, excess);
+			last->length -= excess;
+		}
+		break;
+	}
+
+	compact_extents(node);
+	if (node->extent_block_id >= 0) {
+		journal_dirty(get_meta_block(node->extent_block_id), PAGE_SIZE);
+	}
+	journal_dirty(node, sizeof(iNode));
+}
+
+// Maps data blocks onto every unmapped file block in [first, end). Each
+// hole gets a contiguous range if it can, right after the extent before
+// it if possible, and otherwise as few ranges as the free space allows.
+// Blocks mapped before an -ENOSPC stay mapped.
+int
+map_blocks(iNode* node, int first, int end)
+{
+	int logical = first;
+	while (logical < end) {
+		int ii = extent_after(node, logical);
+		extent* extents = inode_extents(node);
+		if (ii < node->num_extents && extents[ii].logical <= logical) {
+			logical = extents[ii].logical + extents[ii].length;
+			continue;
+		}
+
+		int count = end - logical;
+		if (ii < node->num_extents) {
+			count = min(count, extents[ii].logical - logical);
+		}
+		int physical = -ENOSPC;
+		if (ii > 0 && extents[ii - 1].logical + extents[ii - 1].length == logical) {
+			physical = reserve_data_range_at(extents[ii - 1].physical + extents[ii - 1].length, count);
+		}
+		while (physical < 0 && count > 0) {
+			physical = reserve_data_range(count, false);
+			if (physical < 0) {
+				count /= 2;
+			}
+		}
+		if (physical < 0) {
+			return -ENOSPC;
+		}
+		int rv = map_extent(node, ii, logical, physical, count);
+		if (rv < 0) {
+			free_data_range(physical, count);
+			return rv;
+		}
+		logical += count;
+	}
+	return 0;
+}
+
+// frees the data blocks behind file blocks [first, end), leaving a hole;
+// fails with -ENOSPC, having freed only some, if splitting an extent in
+// two needs a slot the extent block does not have
+int
+unmap_blocks(iNode* node, int first, int end)
+{
+	int ii = extent_after(node, first);
+	while (ii < node->num_extents) {
+		extent* ex = inode_extents(node) + ii;
+		int ex_end = ex->logical + ex->length;
+		if (ex->logical >= end) {
+			break;
+		}
+		int cut_start = max(first, ex->logical);
+		int cut_end = min(end, ex_end);
+		int physical = ex->physical + (cut_start - ex->logical);
+
+		if (cut_start > ex->logical && cut_end < ex_end) {
+			// a hole in the middle: the part after it becomes a new extent
+			extent* tail = insert_extent(node, ii + 1);
+			if (tail == NULL) {
+				return -ENOSPC;
+			}
+			ex = inode_extents(node) + ii;
+			tail->logical = cut_end;
+			tail->physical = ex->physical + (cut_end - ex->logical);
+			tail->length = ex_end - cut_end;
+			ex->length = cut_start - ex->logical;
+			journal_dirty(ex, sizeof(extent));
+			ii += 2;
+		} else if (cut_start > ex->logical) {
+			ex->length = cut_start - ex->logical;
+			journal_dirty(ex, sizeof(extent));
+			ii++;
+		} else if (cut_end < ex_end) {
+			ex->physical += cut_end - ex->logical;
+			ex->logical = cut_end;
+			ex->length = ex_end - cut_end;
+			journal_dirty(ex, sizeof(extent));
+			ii++;
+		} else {
+			remove_extent(node, ii);
+		}
+		free_data_range(physical, cut_end - cut_start);
+	}
+
+	compact_extents(node);
+	journal_dirty(node, sizeof(iNode));
+	return 0;
+}
+
+// Directories. A small directory is a list of leaf blocks, searched in
+// full. Once its entries outgrow DIR_INDEX_BLOCKS blocks it is converted to
+// a hash index: logical block 0 becomes the index root, and each index
+// entry names the leaf holding the names whose hash is at least its key.
+// With levels == 1 the root's entries point to index nodes, which in turn
+// point to leaves. Keys may repeat when many names share a hash, so a name
+// can be in any leaf from the last one keyed below its hash to the last one
+// keyed at or below it. Leaves are split when they fill but never merged.
+const int DIR_INDEX_BLOCKS = 1;
+// most blocks an indexed directory reserves at a time
+const int DIR_GROW_MAX_BLOCKS = 1024;
+const unsigned DIR_INDEX_MAGIC = 0x58444e49;
+
+typedef struct dir_index_entry {
+	unsigned hash;
+	int block;  // logical block in the directory
+} dir_index_entry;
+
+// heads the root and every index node; the magic's low half is larger than
+// any record length, so it cannot be mistaken for a leaf's first record
+typedef struct dir_index_header {
+	unsigned magic;
+	int levels;       // root only: index node levels below the root
+	int blocks_used;  // root only: blocks past this are reserved spares
+	int count;
+} dir_index_header;
+
+const int DIR_INDEX_ENTRIES = (4096 - sizeof(dir_index_header)) / sizeof(dir_index_entry);
+
+// a leaf's place in the index
+typedef struct dir_cursor {
+	iNode* inode;
+	dir_index_header* root;
+	int root_slot;
+	dir_index_header* node;  // the root itself when levels == 0
+	int slot;
+} dir_cursor;
+
+unsigned
+dir_hash(const char* name)
+{
+	return name_hash(name, strlen(name));
+}
+
+dir_index_entry*
+dir_index_entries(dir_index_header* node)
+{
+	return (dir_index_entry*) (node + 1);
+}
+
+void*
+dir_block(iNode* inode, int logical_block)
+{
+	return get_meta_block(block_for(inode, logical_block));
+}
+
+bool
+is_dir_index_block(void* block)
+{
+	return ((dir_index_header*) block)->magic == DIR_INDEX_MAGIC;
+}
+
+// the index root, or NULL if the directory is not indexed
+dir_index_header*
+dir_index_root(iNode* inode)
+{
+	if (num_blocks_used(inode) == 0) {
+		return NULL;
+	}
+	dir_index_header* root = dir_block(inode, 0);
+	return is_dir_index_block(root) ? root : NULL;
+}
+
+// leaf block logical_block, or NULL if that block is part of the index
+directory*
+dir_leaf(iNode* inode, int logical_block)
+{
+	void* block = dir_block(inode, logical_block);
+	return is_dir_index_block(block) ? NULL : block;
+}
+
+// Leaves hold variable-length records in the style of ext2. Records never
+// move: an entry is added in the slack at the end of the first record with
+// room for it, and a removed one is folded into the record before it (the
+// first record of a block is only marked unused). A fresh zeroed block
+// counts as empty until its first entry is added.
+//
+// Since records stay put, a record's position, its logical block times the
+// block size plus its offset, serves as a readdir cookie. A leaf split only
+// moves entries to a block after every existing one, and building an index
+// turns block 0 into the root, so resuming from a cookie never skips an
+// entry that was there all along, though it may show a moved one twice.
+
+int
+dir_record_size(int name_len)
+{
+	return (sizeof(dir_record) + name_len + 1 + 3) & ~3;
+}
+
+dir_record*
+dir_leaf_record(directory* leaf, int offset)
+{
+	return (dir_record*) (leaf->records + offset);
+}
+
+// offset of the first used record at or after the record at offset, or -1
+int
+dir_leaf_next(directory* leaf, int offset)
+{
+	while (offset < (int) sizeof(directory)) {
+		dir_record* rec = dir_leaf_record(leaf, offset);
+		if (rec->rec_len == 0) {
+			break;
+		}
+		if (rec->name_len != 0) {
+			return offset;
+		}
+		offset += rec->rec_len;
+	}
+	return -1;
+}
+
+// offset of the first used record starting at or after offset, which
+// need not be a record boundary, or -1
+int
+dir_leaf_seek(directory* leaf, int offset)
+{
+	int off = 0;
+	while (off < offset && off < (int) sizeof(directory)) {
+		int rec_len = dir_leaf_record(leaf, off)->rec_len;
+		if (rec_len == 0) {
+			return -1;
+		}
+		off += rec_len;
+	}
+	return dir_leaf_next(leaf, off);
+}
+
+// offset of the used record after the one at offset, or -1
+int
+dir_leaf_after(directory* leaf, int offset)
+{
+	return dir_leaf_next(leaf, offset + dir_leaf_record(leaf, offset)->rec_len);
+}
+
+int
+dir_leaf_find(directory* leaf, const char* name)
+{
+	int len = strlen(name);
+	for (int off = dir_leaf_next(leaf, 0); off >= 0; off = dir_leaf_after(leaf, off)) {
+		dir_record* rec = dir_leaf_record(leaf, off);
+		if (rec->name_len == len && memcmp(rec->name, name, len) == 0) {
+			return off;
+		}
+	}
+	return -1;
+}
+
+int
+dir_leaf_add(directory* leaf, const char* name, int inode_num)
+{
+	int len = strlen(name);
+	int needed = dir_record_size(len);
+	dir_record* first = dir_leaf_record(leaf, 0);
+	if (first->rec_len == 0) {
+		first->rec_len = sizeof(directory);
+	}
+
+	for (int off = 0; off < (int) sizeof(directory); ) {
+		dir_record* rec = dir_leaf_record(leaf, off);
+		int used = rec->name_len == 0 ? 0 : dir_record_size(rec->name_len);
+		if (rec->rec_len - used >= needed) {
+			if (used > 0) {
+				// carve a new record out of the slack
+				dir_record* next = dir_leaf_record(leaf, off + used);
+				next->rec_len = rec->rec_len - used;
+				rec->rec_len = used;
+				rec = next;
+			}
+			rec->name_len = len;
+			rec->inode_num = inode_num;
+			memcpy(rec->name, name, len + 1);
+			journal_dirty(leaf, sizeof(directory));
+			return 0;
+		}
+		off += rec->rec_len;
+	}
+	return -ENOSPC;
+}
+
+void
+dir_leaf_remove(directory* leaf, int offset)
+{
+	dir_record* rec = dir_leaf_record(leaf, offset);
+	int prev = 0;
+	while (prev + dir_leaf_record(leaf, prev)->rec_len < offset) {
+		prev += dir_leaf_record(leaf, prev)->rec_len;
+	}
+	if (offset == 0) {
+		rec->name_len = 0;
+		rec->inode_num = 0;
+	} else {
+		dir_leaf_record(leaf, prev)->rec_len += rec->rec_len;
+	}
+	journal_dirty(leaf, sizeof(directory));
+}
+
+// zeroes a directory block that is about to be used, journaling it
+int
+dir_fresh_block(iNode* inode, int logical_block)
+{
+	void* block = dir_block(inode, logical_block);
+	memset(block, 0, sizeof(directory));
+	journal_dirty(block, sizeof(directory));
+	return logical_block;
+}
+
+// Maps a zeroed block onto the end of the directory and returns its
+// logical number. Indexed directories reserve blocks in runs, so that a
+// big directory stays within its extent limit, and hand out the spares
+// first.
+int
+dir_new_block(iNode* inode)
+{
+	int used = num_blocks_used(inode);
+	dir_index_header* root = dir_index_root(inode);
+	if (root != NULL && root->blocks_used < used) {
+		journal_dirty(root, sizeof(dir_index_header));
+		return dir_fresh_block(inode, root->blocks_used++);
+	}
+
+	// a quarter again as many, or the longest run free up to that
+	int count = root == NULL ? 1 : clamp(used / 4, 1, DIR_GROW_MAX_BLOCKS);
+	int start = reserve_data_range(count, false);
+	while (start < 0 && count > 1) {
+		count /= 2;
+		start = reserve_data_range(count, false);
+	}
+	if (start < 0) {
+		return -ENOSPC;
+	}
+	if (append_blocks(inode, start, count) < 0) {
+		free_data_range(start, count);
+		return -ENOSPC;
+	}
+	if (root != NULL) {
+		root->blocks_used = used + 1;
+		journal_dirty(root, sizeof(dir_index_header));
+	}
+	return dir_fresh_block(inode, used);
+}
+
+// index of the last entry keyed below hash (at or below it if inclusive),
+// or 0 if there is none
+int
+dir_index_search(dir_index_header* node, unsigned hash, bool inclusive)
+{
+	dir_index_entry* entries = dir_index_entries(node);
+	int lo = 1;
+	int hi = node->count - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (entries[mid].hash < hash || (inclusive && entries[mid].hash == hash)) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo - 1;
+}
+
+void
+dir_index_seek(iNode* inode, dir_cursor* cur, unsigned hash, bool inclusive)
+{
+	cur->inode = inode;
+	cur->root = dir_index_root(inode);
+	cur->root_slot = 0;
+	cur->node = cur->root;
+	if (cur->root->levels > 0) {
+		cur->root_slot = dir_index_search(cur->root, hash, inclusive);
+		cur->node = dir_block(inode, dir_index_entries(cur->root)[cur->root_slot].block);
+	}
+	cur->slot = dir_index_search(cur->node, hash, inclusive);
+}
+
+dir_index_entry*
+dir_cursor_entry(dir_cursor* cur)
+{
+	return dir_index_entries(cur->node) + cur->slot;
+}
+
+directory*
+dir_cursor_leaf(dir_cursor* cur)
+{
+	return dir_block(cur->inode, dir_cursor_entry(cur)->block);
+}
+
+// moves to the next leaf in hash order; false past the last one
+bool
+dir_cursor_next(dir_cursor* cur)
+{
+	if (cur->slot + 1 < cur->node->count) {
+		cur->slot++;
+		return true;
+	}
+	if (cur->node == cur->root || cur->root_slot + 1 >= cur->root->count) {
+		return false;
+	}
+	cur->root_slot++;
+	cur->node = dir_block(cur->inode, dir_index_entries(cur->root)[cur->root_slot].block);
+	cur->slot = 0;
+	return true;
+}
+
+void
+dir_index_insert(dir_index_header* node, int slot, unsigned hash, int block)
+{
+	dir_index_entry* entries = dir_index_entries(node);
+	memmove(&entries[slot + 1], &entries[slot], (node->count - slot) * sizeof(dir_index_entry));
+	entries[slot].hash = hash;
+	entries[slot].block = block;
+	node->count++;
+	journal_dirty(node, PAGE_SIZE);
+}
+
+// makes room in the cursor's full index node, either by pushing the
+// root's entries down into a new node or by splitting the node in two
+int
+dir_index_split_node(dir_cursor* cur)
+{
+	dir_index_header* root = cur->root;
+	if (cur->node != root && root->count == DIR_INDEX_ENTRIES) {
+		return -ENOSPC;
+	}
+	int lb = dir_new_block(cur->inode);
+	if (lb < 0) {
+		return lb;
+	}
+	dir_index_header* node = dir_block(cur->inode, lb);
+	node->magic = DIR_INDEX_MAGIC;
+
+	if (cur->node == root) {
+		node->count = root->count;
+		memcpy(dir_index_entries(node), dir_index_entries(root),
+			root->count * sizeof(dir_index_entry));
+		root->levels = 1;
+		root->count = 1;
+		dir_index_entries(root)[0].hash = 0;
+		dir_index_entries(root)[0].block = lb;
+		journal_dirty(node, PAGE_SIZE);
+		journal_dirty(root, PAGE_SIZE);
+		return 0;
+	}
+
+	int keep = cur->node->count / 2;
+	node->count = cur->node->count - keep;
+	memcpy(dir_index_entries(node), dir_index_entries(cur->node) + keep,
+		node->count * sizeof(dir_index_entry));
+	cur->node->count = keep;
+	journal_dirty(node, PAGE_SIZE);
+	journal_dirty(cur->node, PAGE_SIZE);
+	dir_index_insert(root, cur->root_slot + 1, dir_index_entries(node)[0].hash, lb);
+	return 0;
+}
+
+int
+compare_unsigned(const void* aa, const void* bb)
+{
+	unsigned xx = *(const unsigned*) aa;
+	unsigned yy = *(const unsigned*) bb;
+	return xx < yy ? -1 : xx > yy;
+}
+
+// moves the upper half of the cursor's full leaf, by hash, into a new
+// leaf entered after it in the index
+int
+dir_split_leaf(dir_cursor* cur)
+{
+	directory* leaf = dir_cursor_leaf(cur);
+	unsigned hashes[sizeof(directory) / DIR_RECORD_MIN];
+	int count = 0;
+	for (int off = dir_leaf_next(leaf, 0); off >= 0; off = dir_leaf_after(leaf, off)) {
+		hashes[count++] = dir_hash(dir_leaf_record(leaf, off)->name);
+	}
+	qsort(hashes, count, sizeof(unsigned), compare_unsigned);
+
+	// split at the median hash, or failing that at the first hash above
+	// the lowest; if every name shares one hash, move half of them
+	unsigned split = hashes[count / 2];
+	bool same_hash = split == hashes[0];
+	for (int ii = count / 2; same_hash && ii < count; ii++) {
+		if (hashes[ii] != split) {
+			split = hashes[ii];
+			same_hash = false;
+		}
+	}
+
+	int lb = dir_new_block(cur->inode);
+	if (lb < 0) {
+		return lb;
+	}
+	// the entries that stay keep their offsets, so a listing in progress
+	// does not skip any of them
+	directory* new_leaf = dir_block(cur->inode, lb);
+	int moved = 0;
+	for (int off = dir_leaf_next(leaf, 0); off >= 0; off = dir_leaf_after(leaf, off)) {
+		dir_record* rec = dir_leaf_record(leaf, off);
+		if (same_hash ? moved < count / 2 : dir_hash(rec->name) >= split) {
+			dir_leaf_add(new_leaf, rec->name, rec->inode_num);
+			dir_leaf_remove(leaf, off);
+			moved++;
+		}
+	}
+	dir_index_insert(cur->node, cur->slot + 1, split, lb);
+	return 0;
+}
+
+int
+add_entry_indexed(iNode* inode, const char* name, int inode_num)
+{
+	unsigned hash = dir_hash(name);
+	for (;;) {
+		dir_cursor cur;
+		dir_index_seek(inode, &cur, hash, true);
+		if (dir_leaf_add(dir_cursor_leaf(&cur), name, inode_num) == 0) {
+			return 0;
+		}
+		int rv = cur.node->count == DIR_INDEX_ENTRIES
+			? dir_index_split_node(&cur) : dir_split_leaf(&cur);
+		if (rv < 0) {
+			return rv;
+		}
+	}
+}
+
+typedef struct hashed_entry {
+	unsigned hash;
+	int inode_num;
+	char name[256];
+} hashed_entry;
+
+int
+compare_hashed_entries(const void* aa, const void* bb)
+{
+	return compare_unsigned(&((const hashed_entry*) aa)->hash, &((const hashed_entry*) bb)->hash);
+}
+
+// whether the next entry, of size bytes, starts a new leaf when leaves are
+// filled to two thirds while building an index
+bool
+dir_build_next_leaf(int* fill, int size)
+{
+	bool next = *fill > 0 && *fill + size > (int) sizeof(directory) * 2 / 3;
+	*fill = (next ? 0 : *fill) + size;
+	return next;
+}
+
+// Rewrites a full linear directory as an index: its entries are sorted by
+// hash and packed into leaves left a third empty, behind a root in block 0.
+// Every block needed is mapped before anything is rewritten.
+int
+dir_index_build(iNode* inode)
+{
+	int num_blocks = num_blocks_used(inode);
+	hashed_entry* entries = malloc(num_blocks * (sizeof(directory) / DIR_RECORD_MIN)
+		* sizeof(hashed_entry));
+	int count = 0;
+	int num_leaves = 1;
+	int fill = 0;
+	for (int lb = 0; lb < num_blocks; lb++) {
+		directory* leaf = dir_block(inode, lb);
+		for (int off = dir_leaf_next(leaf, 0); off >= 0; off = dir_leaf_after(leaf, off)) {
+			dir_record* rec = dir_leaf_record(leaf, off);
+			entries[count].hash = dir_hash(rec->name);
+			entries[count].inode_num = rec->inode_num;
+			memcpy(entries[count].name, rec->name, rec->name_len + 1);
+			num_leaves += dir_build_next_leaf(&fill, dir_record_size(rec->name_len));
+			count++;
+		}
+	}
+	while (num_blocks_used(inode) < num_leaves + 1) {
+		if (dir_new_block(inode) < 0) {
+			free(entries);
+			return -ENOSPC;
+		}
+	}
+	qsort(entries, count, sizeof(hashed_entry), compare_hashed_entries);
+
+	// every block past the root becomes a spare for dir_new_block to hand
+	// out as a leaf
+	for (int lb = 0; lb < num_blocks; lb++) {
+		dir_fresh_block(inode, lb);
+	}
+	dir_index_header* root = dir_block(inode, 0);
+	root->magic = DIR_INDEX_MAGIC;
+	root->levels = 0;
+	root->blocks_used = 1;
+	root->count = 0;
+	dir_index_entry* index = dir_index_entries(root);
+	fill = 0;
+	for (int ii = 0; ii < count; ii++) {
+		bool next = dir_build_next_leaf(&fill, dir_record_size(strlen(entries[ii].name)));
+		if (ii == 0 || next) {
+			// each leaf is keyed by the first hash put in it
+			index[root->count].hash = ii == 0 ? 0 : entries[ii].hash;
+			index[root->count].block = dir_new_block(inode);
+			root->count++;
+		}
+		dir_leaf_add(dir_block(inode, index[root->count - 1].block), entries[ii].name,
+			entries[ii].inode_num);
+	}
+	journal_dirty(root, PAGE_SIZE);
+	free(entries);
+	return 0;
+}
+
+// finds name's entry, returning its leaf and setting offset, or NULL
+directory*
+dir_find(iNode* inode, const char* name, int* offset)
+{
+	if (dir_index_root(inode) == NULL) {
+		int num_blocks = num_blocks_used(inode);
+		for (int lb = 0; lb < num_blocks; lb++) {
+			directory* leaf = dir_block(inode, lb);
+			*offset = dir_leaf_find(leaf, name);
+			if (*offset >= 0) {
+				return leaf;
+			}
+		}
+		return NULL;
+	}
+
+	unsigned hash = dir_hash(name);
+	dir_cursor cur;
+	dir_index_seek(inode, &cur, hash, false);
+	do {
+		directory* leaf = dir_cursor_leaf(&cur);
+		*offset = dir_leaf_find(leaf, name);
+		if (*offset >= 0) {
+			return leaf;
+		}
+	} while (dir_cursor_next(&cur) && dir_cursor_entry(&cur)->hash <= hash);
+	return NULL;
+}
+
+int
+add_entry_to_inode(iNode* inode, const char* entry_name, int inode_num)
+{
+	int rv = -ENOSPC;
+	if (dir_index_root(inode) != NULL) {
+		rv = add_entry_indexed(inode, entry_name, inode_num);
+	} else {
+		int num_blocks = num_blocks_used(inode);
+		for (int lb = 0; lb < num_blocks && rv < 0; lb++) {
+			rv = dir_leaf_add(dir_block(inode, lb), entry_name, inode_num);
+		}
+		if (rv < 0 && num_blocks >= DIR_INDEX_BLOCKS) {
+			rv = dir_index_build(inode);
+			if (rv == 0) {
+				rv = add_entry_indexed(inode, entry_name, inode_num);
+			}
+		} else if (rv < 0) {
+			int lb = dir_new_block(inode);
+			rv = lb < 0 ? lb : dir_leaf_add(dir_block(inode, lb), entry_name, inode_num);
+		}
+	}
+	if (rv < 0) {
+		return rv;
+	}
+
+	dcache_insert(inode_index(inode), entry_name, strlen(entry_name), inode_num);
+	return 0;
+}
+
+void
+root_init()
+{
+	int root_index = reserve_inode();
+	int root_mode = S_IFDIR | S_IRWXU;
+	iNode* root = configure_inode(root_index, root_mode, sizeof(directory));
+	append_blocks(root, reserve_data_block(), 1);
+
+	add_entry_to_inode(root, ".", root_index);
+	add_entry_to_inode(root, "..", root_index);
+}
+
+int
+pages_for_bits(int64_t bits)
+{
+	return (bits + PAGE_SIZE * 8 - 1) / (PAGE_SIZE * 8);
+}
+
+// Lays out a new, zeroed image: superblock, data bitmap, inode bitmap,
+// the first inode table chunk, then data blocks to the end of the image.
+// The bitmaps are sized for max_page_count so the image can grow in place.
+void
+format_image(int64_t max_page_count)
+{
+	int64_t page_count = pages_count();
+	int inodes_per_page = PAGE_SIZE / sizeof(iNode);
+	int64_t num_inodes = page_count / INODE_RATIO;
+	if (num_inodes < MIN_INODES) {
+		num_inodes = MIN_INODES;
+	}
+	int inode_pages = (num_inodes + inodes_per_page - 1) / inodes_per_page;
+	num_inodes = inode_pages * inodes_per_page;
+
+	// the inode table doubles as it grows, so capacity is a power-of-two
+	// multiple of the first chunk
+	int64_t max_inodes = num_inodes;
+	int chunks = 1;
+	while (max_inodes * 2 <= max_page_count / INODE_RATIO && max_inodes * 2 <= INT_MAX
+			&& chunks < NUFS_INODE_CHUNKS) {
+		max_inodes *= 2;
+		chunks++;
+	}
+
+	super->magic = NUFS_MAGIC;
+	super->version = NUFS_VERSION;
+	super->page_count = page_count;
+	super->max_page_count = max_page_count;
+	super->num_inodes = num_inodes;
+	super->max_inodes = max_inodes;
+	super->data_bitmap_page = 1;
+	super->inode_bitmap_page = super->data_bitmap_page + pages_for_bits(max_page_count);
+	super->first_chunk_inodes = num_inodes;
+	super->num_inode_chunks = 1;
+	super->inode_chunks[0] = super->inode_bitmap_page + pages_for_bits(max_inodes);
+	super->data_block_page = super->inode_chunks[0] + inode_pages;
+	super->num_data_blocks = page_count - super->data_block_page;
+}
+
+// the superblock and the two bitmaps, which sit in front of the first inode
+// chunk and which one operation may dirty any number of pages of
+int
+journal_shared_pages()
+{
+	return super->inode_chunks[0];
+}
+
+// reserves and formats the journal of a new image; images are only ever
+// made with one, since pages_init refuses any older version
+int
+journal_create()
+{
+	int pages = journal_size(super->max_page_count, journal_shared_pages());
+	int start = reserve_data_range(pages, true);
+	if (start < 0) {
+		return start;
+	}
+	super->journal_page = super->data_block_page + start;
+	super->journal_pages = pages;
+	// with no journal yet to carry them, the superblock and the bitmap
+	// pages just changed go to the image directly
+	int first = super->data_bitmap_page + start / (PAGE_SIZE * 8);
+	int last = super->data_bitmap_page + (start + pages - 1) / (PAGE_SIZE * 8);
+	pages_publish(0, 1);
+	pages_publish(first, last - first + 1);
+	return journal_format(super->journal_page, super->journal_pages,
+		journal_shared_pages());
+}
+
+int
+storage_init(const char* path, int64_t size, int64_t max_size)
+{
+	if (size < MIN_IMAGE_PAGES * PAGE_SIZE) {
+		size = MIN_IMAGE_PAGES * PAGE_SIZE;
+	}
+	if (max_size == 0) {
+		max_size = size * DEFAULT_GROWTH;
+		if (max_size > DEFAULT_MAX_SIZE) {
+			max_size = DEFAULT_MAX_SIZE;
+		}
+	}
+	if (max_size < size) {
+		max_size = size;
+	}
+	if (max_size / PAGE_SIZE > INT_MAX) {
+		max_size = (int64_t) INT_MAX * PAGE_SIZE;
+	}
+
+	int rv = pages_init(path, size, max_size);
+	if (rv < 0) {
+		return rv;
+	}
+	super = pages_get_superblock();
+	bool fresh = super->magic == 0;
+	if (fresh) {
+		format_image(max_size / PAGE_SIZE);
+	} else {
+		rv = journal_recover(super->journal_page, super->journal_pages,
+			journal_shared_pages());
+		if (rv < 0) {
+			return rv;
+		}
+		// a replayed superblock may count pages the image never grew to
+		if (pages_count() < super->page_count) {
+			pages_grow(super->page_count);
+		}
+	}
+
+	inode_state_pages = calloc(super->max_inodes / INODE_STATES_PER_PAGE + 1,
+		sizeof(inode_state*));
+	dcache_init();
+	allocators_init();
+	journal_set_release(release_data_blocks);
+	if (fresh) {
+		rv = journal_create();
+		if (rv < 0) {
+			return rv;
+		}
+		// committed here, without starting the commit thread before FUSE
+		// forks
+		root_init();
+		journal_sync();
+	}
+	return 0;
+}
+
+void
+storage_sync()
+{
+	journal_sync();
+}
+
+void
+storage_close()
+{
+	writeback_close();
+	journal_close();
+}
+
+int
+inode_child(int inode_index, const char* inode_name)
+{
+	iNode* inode = get_inode(inode_index);
+	if(!is_inode_dir(inode)) {
+		return -ENOTDIR;
+	}
+
+	int offset;
+	directory* leaf = dir_find(inode, inode_name, &offset);
+	if(leaf == NULL) {
+		return -ENOENT;
+	}
+	return dir_leaf_record(leaf, offset)->inode_num;
+}
+
+// looks up one path component (not necessarily NUL terminated),
+// going to the directory blocks only when the dcache misses; both
+// hits and misses are remembered. The caller holds the directory's lock.
+int
+lookup_child_locked(int inode_index, const char* name, int len)
+{
+	int child = dcache_lookup(inode_index, name, len);
+	if(child != DCACHE_MISS) {
+		return child;
+	}
+
+	if(len >= NAME_MAX_LEN) {
+		return -ENAMETOOLONG;
+	}
+	char entry_name[NAME_MAX_LEN];
+	memcpy(entry_name, name, len);
+	entry_name[len] = 0;
+
+	child = inode_child(inode_index, entry_name);
+	if(child >= 0) {
+		dcache_insert(inode_index, name, len, child);
+	} else if(child == -ENOENT) {
+		dcache_insert_negative(inode_index, name, len);
+	}
+	return child;
+}
+
+int
+lookup_child(int inode_index, const char* name, int len)
+{
+	// entries only change under the directory's exclusive lock, so a
+	// cached answer can be used without taking it
+	int child = dcache_lookup(inode_index, name, len);
+	if(child != DCACHE_MISS) {
+		return child;
+	}
+
+	int rv = lock_inode(inode_index, false);
+	if(rv < 0) {
+		return rv;
+	}
+	child = lookup_child_locked(inode_index, name, len);
+	unlock_inode(inode_index);
+	return child;
+}
+
+// resolves the first len bytes of an absolute path
+int
+inode_index_from_path_prefix(const char* path, int len)
+{
+	if(len <= 0 || path[0] != '/') {
+		return -ENOENT;
+	}
+
+	int inode_index = 0;
+	int start = 0;
+	while(start < len) {
+		while(start < len && path[start] == '/') {
+			start++;
+		}
+		int end = start;
+		while(end < len && path[end] != '/') {
+			end++;
+		}
+		if(end == start) {
+			break;
+		}
+		inode_index = lookup_child(inode_index, path + start, end - start);
+		if(inode_index < 0) {
+			return inode_index;
+		}
+		start = end;
+	}
+	return inode_index;
+}
+
+int
+inode_index_from_path(const char* path)
+{
+	uint64_t start = stats_begin();
+	int rv = inode_index_from_path_prefix(path, strlen(path));
+	stats_end(STATS_PATH_LOOKUP, start);
+	return rv;
+}
+
+// returns the last component of path, which points into path itself
+const char*
+path_last_component(const char* path)
+{
+	const char* slash = strrchr(path, '/');
+	return slash == NULL ? path : slash + 1;
+}
+
+int
+parent_inode_index_from_path(const char* path)
+{
+	const char* name = path_last_component(path);
+	int parent_len = name - path;
+	if(parent_len <= 1) {
+		// a child of the root
+		return path[0] == '/' ? 0 : -ENOENT;
+	}
+	return inode_index_from_path_prefix(path, parent_len - 1);
+}
+
+// the caller holds the inode's lock
+void
+fill_stat(int inode_index, struct stat* st)
+{
+	iNode* inode = get_inode(inode_index);
+	memset(st, 0, sizeof(struct stat));
+	st->st_dev = makedev(0, 0);
+	st->st_ino = inode_index;
+	st->st_mode = inode->mode;
+	st->st_nlink = inode->num_hard_links;
+	st->st_uid = inode->user_id;
+	st->st_gid = inode->group_id;
+	st->st_rdev = makedev(0, 0);
+	st->st_size = inode->size;
+	st->st_blksize = 4096;
+	// what the file takes up, so holes do not count and blocks reserved
+	// past EOF do
+	st->st_blocks = (blkcnt_t) num_blocks_mapped(inode) * (PAGE_SIZE / 512);
+	st->st_atime = inode->last_time_accessed;
+	st->st_mtime = inode->last_time_modified;
+	st->st_ctime = inode->last_time_status_change;
+}
+
+unsigned
+inode_generation(int inode_index)
+{
+	return __atomic_load_n(&get_inode_state(inode_index)->generation, __ATOMIC_ACQUIRE);
+}
+
+int
+get_stat_inode(int inode_index, struct stat* st)
+{
+	int rv = lock_inode(inode_index, false);
+	if (rv < 0) {
+		return rv;
+	}
+	fill_stat(inode_index, st);
+	unlock_inode(inode_index);
+	return 0;
+}
+
+int
+get_stat(const char* path, struct stat* st)
+{
+	int inode_index = inode_index_from_path(path);
+	
+	if (inode_index < 0) {
+		return -1;
+	}
+
+	return get_stat_inode(inode_index, st);
+}
+
+slist*
+get_filenames_from_inode(int inode_index)
+{
+	int rv = lock_inode(inode_index, false);
+	if(rv < 0) {
+		return (slist*) (long) rv;
+	}
+	iNode* inode = get_inode(inode_index);
+	if(!is_inode_dir(inode)) {
+		unlock_inode(inode_index);
+		return (slist*) -ENOTDIR;
+	}
+
+	slist* entry_list = NULL;
+	
+	int num_blocks = num_blocks_used(inode);
+	for(int lb = 0; lb < num_blocks; lb++) {
+		directory* leaf = dir_leaf(inode, lb);
+		if(leaf == NULL) {
+			continue;
+		}
+		for(int off = dir_leaf_next(leaf, 0); off >= 0; off = dir_leaf_after(leaf, off)) {
+			entry_list = s_cons(dir_leaf_record(leaf, off)->name, entry_list);
+		}
+	}
+
+	unlock_inode(inode_index);
+	return entry_list;
+}
+
+slist*
+get_filenames_from_dir(const char* path)
+{
+	int inode_index = inode_index_from_path(path);
+	if(inode_index < 0) {
+		return (slist*) -ENOENT;
+	}
+	return get_filenames_from_inode(inode_index);
+}
+
+// attributes of child, named name in the directory dir_index, whose lock
+// the caller holds shared
+void
+dir_entry_stat(int dir_index, const char* name, int child, struct stat* st)
+{
+	if(child == dir_index) {
+		fill_stat(child, st);
+		return;
+	}
+
+	// .. comes before us in the lock order, so it is only read if free
+	int rv = 0;
+	if(streq(name, "..")) {
+		pthread_rwlock_t* lock = &get_inode_state(child)->lock;
+		rv = pthread_rwlock_tryrdlock(lock) == 0 ? 0 : -EBUSY;
+	} else {
+		rv = lock_inode(child, false);
+	}
+	if(rv < 0) {
+		memset(st, 0, sizeof(struct stat));
+		st->st_ino = child;
+		st->st_mode = S_IFDIR;
+		return;
+	}
+	fill_stat(child, st);
+	unlock_inode(child);
+}
+
+// lists the directory from the entry at cookie offset, 0 for the start
+int
+read_dir_inode(int inode_index, off_t offset, dir_filler fill, void* ctx)
+{
+	int rv = lock_inode(inode_index, false);
+	if(rv < 0) {
+		return rv;
+	}
+	iNode* inode = get_inode(inode_index);
+	if(!is_inode_dir(inode)) {
+		unlock_inode(inode_index);
+		return -ENOTDIR;
+	}
+
+	int num_blocks = num_blocks_used(inode);
+	int lb = offset / sizeof(directory);
+	int start = offset % sizeof(directory);
+	for(; lb < num_blocks && rv == 0; lb++, start = 0) {
+		directory* leaf = dir_leaf(inode, lb);
+		if(leaf == NULL) {
+			continue;
+		}
+		for(int off = dir_leaf_seek(leaf, start); off >= 0 && rv == 0; off = dir_leaf_after(leaf, off)) {
+			dir_record* rec = dir_leaf_record(leaf, off);
+			struct stat st;
+			dir_entry_stat(inode_index, rec->name, rec->inode_num, &st);
+			off_t next = (off_t) lb * sizeof(directory) + off + rec->rec_len;
+			rv = fill(ctx, rec->name, rec->inode_num, &st, next);
+		}
+	}
+
+	unlock_inode(inode_index);
+	return rv < 0 ? rv : 0;
+}
+
+int
+read_dir(const char* path, off_t offset, dir_filler fill, void* ctx)
+{
+	int inode_index = inode_index_from_path(path);
+	if(inode_index < 0) {
+		return inode_index;
+	}
+	return read_dir_inode(inode_index, offset, fill, ctx);
+}
+
+void
+free_all_blocks(iNode* node)
+{
+	truncate_blocks(node, 0);
+}
+
+int
+reserve_blocks_for_node(iNode* node, int first, int end)
+{
+	uint64_t start = stats_begin();
+	int rv = map_blocks(node, first, end);
+	stats_end(STATS_RESERVE_BLOCKS, start);
+	return rv;
+}
+
+// Moves an inline file's data out to a data block of its own, making it
+// an ordinary file. The journal writes the block out before it commits the
+// inode, so a crash cannot lose data that was already on disk in the
+// inode. The caller holds the inode's exclusive lock.
+int
+uninline_file(iNode* node)
+{
+	char data[sizeof(node->inline_data)];
+	int size = node->size;
+	memcpy(data, node->inline_data, size);
+	memset(node->inline_data, 0, sizeof(node->inline_data));
+	node->flags &= ~INODE_INLINE;
+	node->num_extents = 0;
+	node->extent_block_id = -1;
+	journal_dirty(node, sizeof(iNode));
+	if (size == 0) {
+		return 0;
+	}
+
+	int rv = reserve_blocks_for_node(node, 0, 1);
+	if (rv < 0) {
+		memcpy(node->inline_data, data, size);
+		node->flags |= INODE_INLINE;
+		return rv;
+	}
+	int physical = block_for(node, 0);
+	memcpy(get_data_block(physical), data, size);
+	note_dirty_blocks(get_inode_state(inode_index(node)), physical, 1);
+	journal_order(super->data_block_page + physical, 1);
+	return 0;
+}
+
+// frees the spares writes reserved past EOF; the caller holds the inode's
+// exclusive lock
+void
+trim_preallocation(iNode* node)
+{
+	inode_state* state = get_inode_state(inode_index(node));
+	int total_blocks = (int) ceil(node->size / (PAGE_SIZE * 1.0));
+	int keep = max(total_blocks, num_blocks_used(node) - state->spare_blocks);
+	if (num_blocks_used(node) > keep) {
+		truncate_blocks(node, keep);
+	}
+	state->spare_blocks = 0;
+}
+
+// Sets the file's size. Growing a file maps nothing: the new blocks are a
+// hole until they are written. A write leaves any blocks past EOF alone;
+// a truncate frees them. The caller holds the inode's exclusive lock.
+int
+set_file_to_size(int inode_index, off_t size, bool writing)
+{
+	iNode* node = get_inode(inode_index);
+	
+	if (!is_inode_file(node)) {
+		return -EISDIR;
+	}
+	
+	inode_state* state = get_inode_state(inode_index);
+	if (is_inline(node) && size > INLINE_DATA_MAX) {
+		int rv = uninline_file(node);
+		if (rv < 0) {
+			return rv;
+		}
+	}
+	if (is_inline(node) && size < node->size) {
+		memset(node->inline_data + size, 0, node->size - size);
+	}
+
+	int total_blocks = (int) ceil(size / (PAGE_SIZE * 1.0));
+	if (total_blocks < num_blocks_used(node) && !writing) {
+		// remove some blocks, spares and fallocated ones included
+		truncate_blocks(node, total_blocks);
+		state->spare_blocks = 0;
+	}
+	if (size == 0 && !writing && !is_inline(node)) {
+		// emptied, as by O_TRUNC, so it can go back to being inline
+		memset(node->inline_data, 0, sizeof(node->inline_data));
+		node->flags |= INODE_INLINE;
+	}
+
+	int last = block_for(node, size / PAGE_SIZE);
+	if (size < node->size && size % PAGE_SIZE != 0 && last >= 0) {
+		// zero the cut-off tail so growing the file again reads zeros
+		char* last_block = get_data_block(last);
+		memset(last_block + size % PAGE_SIZE, 0, PAGE_SIZE - size % PAGE_SIZE);
+		note_dirty_blocks(state, last, 1);
+	}
+	node->size = size;
+	journal_dirty(node, sizeof(iNode));
+	return 0;
+}
+
+// copies between buf and the file, one memcpy per extent, or just one for
+// an inline file; returns the number of bytes copied. A hole reads as
+// zeros and stops a write, so writes map their blocks first. hint is
+// passed through to find_extent.
+int
+transfer_extents(iNode* node, int* hint, char* buf, size_t size,
+	off_t offset_in_file, bool to_file)
+{
+	if (is_inline(node)) {
+		// the caller keeps writes within INLINE_DATA_MAX
+		if (to_file) {
+			memcpy(node->inline_data + offset_in_file, buf, size);
+			journal_dirty(node, sizeof(iNode));
+		} else {
+			memcpy(buf, node->inline_data + offset_in_file, size);
+		}
+		return size;
+	}
+
+	size_t offset_in_buf = 0;
+	while (offset_in_buf < size) {
+		int logical_block = offset_in_file / PAGE_SIZE;
+		int ii = find_extent(node, logical_block, hint);
+		if (ii < 0 && to_file) {
+			break;
+		}
+		if (ii < 0) {
+			// up to the next extent, or to the end of the read
+			int next = extent_after(node, logical_block);
+			size_t chunk = size - offset_in_buf;
+			if (next < node->num_extents) {
+				off_t hole_end = (off_t) inode_extents(node)[next].logical * PAGE_SIZE;
+				if (hole_end - offset_in_file < (off_t) chunk) {
+					chunk = hole_end - offset_in_file;
+				}
+			}
+			memset(buf + offset_in_buf, 0, chunk);
+			offset_in_buf += chunk;
+			offset_in_file += chunk;
+			continue;
+		}
+
+		extent* ex = inode_extents(node) + ii;
+		off_t extent_end = (off_t) (ex->logical + ex->length) * PAGE_SIZE;
+		size_t chunk = size - offset_in_buf;
+		if (extent_end - offset_in_file < (off_t) chunk) {
+			chunk = extent_end - offset_in_file;
+		}
+		int physical = ex->physical + (logical_block - ex->logical);
+		char* data = (char*) get_data_block(physical) + offset_in_file % PAGE_SIZE;
+
+		if (to_file) {
+			memcpy(data, buf + offset_in_buf, chunk);
+			int last = ex->physical + ((offset_in_file + chunk - 1) / PAGE_SIZE - ex->logical);
+			note_dirty_blocks(get_inode_state(inode_index(node)), physical, last - physical + 1);
+		} else {
+			memcpy(buf + offset_in_buf, data, chunk);
+		}
+		offset_in_buf += chunk;
+		offset_in_file += chunk;
+	}
+	return offset_in_buf;
+}
+
+// bytes of the file readable from offset_in_file, at most size
+size_t
+readable_size(iNode* node, size_t size, off_t offset_in_file)
+{
+	if (offset_in_file >= node->size) {
+		return 0;
+	}
+	return min(size, node->size - offset_in_file);
+}
+
+int
+read_inode(int inode_index, char* buf, size_t size, off_t offset_in_file)
+{
+	int rv = lock_inode(inode_index, false);
+	if (rv < 0) {
+		return rv;
+	}
+	iNode* node = get_inode(inode_index);
+	if (!is_inode_file(node)) {
+		rv = -EISDIR;
+	} else {
+		size = readable_size(node, size, offset_in_file);
+		rv = transfer_extents(node, NULL, buf, size, offset_in_file, false);
+	}
+	unlock_inode(inode_index);
+	return rv;
+}
+
+int
+read_file(const char* path, char* buf, size_t size, off_t offset_in_file)
+{
+	uint64_t start = stats_begin();
+	int rv = inode_index_from_path(path);
+	rv = rv < 0 ? -ENOENT : read_inode(rv, buf, size, offset_in_file);
+	stats_end(STATS_READ_FILE, start);
+	return rv;
+}
+
+// Maps the blocks a write covers. Only those are mapped, so a write past
+// EOF leaves a hole before it. A write that carries on from the file's
+// last block while the file is open also reserves spares after it. The
+// caller holds the inode's exclusive lock.
+int
+map_written_blocks(int inode_index, size_t size, off_t offset_in_file)
+{
+	iNode* node = get_inode(inode_index);
+	inode_state* state = get_inode_state(inode_index);
+	int first = offset_in_file / PAGE_SIZE;
+	int end = (offset_in_file + size + PAGE_SIZE - 1) / PAGE_SIZE;
+	int used = num_blocks_used(node);
+	int spare = end > used && first <= used && state->open_count > 0
+		? min(end, PREALLOC_MAX_BLOCKS) : 0;
+	int rv = reserve_blocks_for_node(node, first, end + spare);
+	if (rv < 0 && spare > 0) {
+		rv = reserve_blocks_for_node(node, first, end);
+	}
+	if (rv < 0) {
+		if (end > used) {
+			// give back what was mapped past the old last block
+			truncate_blocks(node, max(used, (int) ceil(node->size / (PAGE_SIZE * 1.0))));
+		}
+		return rv;
+	}
+	if (end > used) {
+		state->spare_blocks = max(0, num_blocks_used(node) - end);
+	}
 	return 0;
 }
 
+// the caller holds the inode's exclusive lock
+int
+write_inode_locked(int inode_index, int* hint, const char* buf, size_t size,
+	off_t offset_in_file)
+{
+	iNode* node = get_inode(inode_index);
+	if (!is_inode_file(node)) {
+		return -EISDIR;
+	}
+	if (offset_in_file + (off_t) size > INT_MAX) {
+		// sizes are ints on disk
+		return -EFBIG;
+	}
+	if (is_inline(node) && offset_in_file + (off_t) size > INLINE_DATA_MAX) {
+		int rv = uninline_file(node);
+		if (rv < 0) {
+			return rv;
+		}
+	}
+	if (!is_inline(node)) {
+		int rv = map_written_blocks(inode_index, size, offset_in_file);
+		if (rv < 0) {
+			return rv;
+		}
+	}
+	if (node->size < offset_in_file + (off_t) size) {
+		set_file_to_size(inode_index, size + offset_in_file, true);
+	}
+
+	return transfer_extents(node, hint, (char*) buf, size, offset_in_file, true);
+}
+
+int
+write_inode_in_txn(int inode_index, const char* buf, size_t size, off_t offset_in_file)
+{
+	int rv = lock_inode(inode_index, true);
+	if (rv < 0) {
+		return rv;
+	}
+	rv = write_inode_locked(inode_index, NULL, buf, size, offset_in_file);
+	unlock_inode(inode_index);
+	return rv;
+}
+
+int
+write_inode(int inode_index, const char* buf, size_t size, off_t offset_in_file)
+{
+	journal_begin();
+	int rv = write_inode_in_txn(inode_index, buf, size, offset_in_file);
+	journal_end();
+	return rv;
+}
+
+// tracks sequential access and, once a stream is established, asks
+// the kernel to start reading in the blocks that come next. Requests on
+// one handle can run in parallel, so the fields are only hints and are
+// accessed atomically. The caller holds the inode's lock.
+void
+note_handle_access(file_handle* fh, size_t size, off_t offset_in_file)
+{
+	int streak = 0;
+	if (offset_in_file == __atomic_load_n(&fh->next_offset, __ATOMIC_RELAXED)) {
+		streak = __atomic_add_fetch(&fh->streak, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_store_n(&fh->streak, 0, __ATOMIC_RELAXED);
+	}
+	off_t next_offset = offset_in_file + size;
+	__atomic_store_n(&fh->next_offset, next_offset, __ATOMIC_RELAXED);
+
+	if (streak < SEQUENTIAL_STREAK) {
+		return;
+	}
+	iNode* node = get_inode(fh->inode_index);
+	int next_block = next_offset / PAGE_SIZE;
+	int hint = __atomic_load_n(&fh->extent_hint, __ATOMIC_RELAXED);
+	int ii = find_extent(node, next_block, &hint);
+	if (ii < 0) {
+		return;
+	}
+	extent* ex = inode_extents(node) + ii;
+	int run = min(ex->logical + ex->length - next_block, PREFETCH_BLOCKS);
+	pages_prefetch(super->data_block_page + ex->physical + (next_block - ex->logical), run);
+}
+
+int
+read_handle(file_handle* fh, char* buf, size_t size, off_t offset_in_file)
+{
+	int rv = lock_inode(fh->inode_index, false);
+	if (rv < 0) {
+		return rv;
+	}
+	iNode* node = get_inode(fh->inode_index);
+	if (!is_inode_file(node)) {
+		unlock_inode(fh->inode_index);
+		return -EISDIR;
+	}
+	size = readable_size(node, size, offset_in_file);
+
+	int hint = __atomic_load_n(&fh->extent_hint, __ATOMIC_RELAXED);
+	rv = transfer_extents(node, &hint, buf, size, offset_in_file, false);
+	__atomic_store_n(&fh->extent_hint, hint, __ATOMIC_RELAXED);
+	note_handle_access(fh, rv, offset_in_file);
+	unlock_inode(fh->inode_index);
+	return rv;
+}
+
+int
+write_handle_in_txn(file_handle* fh, const char* buf, size_t size, off_t offset_in_file)
+{
+	int rv = lock_inode(fh->inode_index, true);
+	if (rv < 0) {
+		return rv;
+	}
+	int hint = __atomic_load_n(&fh->extent_hint, __ATOMIC_RELAXED);
+	rv = write_inode_locked(fh->inode_index, &hint, buf, size, offset_in_file);
+	__atomic_store_n(&fh->extent_hint, hint, __ATOMIC_RELAXED);
+	if (rv >= 0) {
+		note_handle_access(fh, rv, offset_in_file);
+	}
+	unlock_inode(fh->inode_index);
+	return rv;
+}
+
+int
+write_handle(file_handle* fh, const char* buf, size_t size, off_t offset_in_file)
+{
+	journal_begin();
+	int rv = write_handle_in_txn(fh, buf, size, offset_in_file);
+	journal_end();
+	return rv;
+}
+
+int
+write_file(const char* path, const char* buf, size_t size, off_t offset_in_file)
+{
+	uint64_t start = stats_begin();
+	int rv = inode_index_from_path(path);
+	rv = rv < 0 ? -ENOENT : write_inode(rv, buf, size, offset_in_file);
+	stats_end(STATS_WRITE_FILE, start);
+	return rv;
+}
+
+// checks that name can be added to the directory parent_index, whose
+// lock the caller holds
+int
+check_new_entry(int parent_index, const char* name)
+{
+	if(!is_inode_dir(get_inode(parent_index))) {
+		return -ENOTDIR;
+	}
+	int len = strlen(name);
+	if(len >= NAME_MAX_LEN) {
+		return -ENAMETOOLONG;
+	}
+	int existing = lookup_child_locked(parent_index, name, len);
+	if(existing >= 0) {
+		return -EEXIST;
+	}
+	return existing == -ENOENT ? 0 : existing;
+}
+
+void
+release_inode(int inode_index)
+{
+	__atomic_add_fetch(&get_inode_state(inode_index)->generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&inode_alloc_lock);
+	allocator_set(&inode_alloc, inode_index, false);
+	pthread_mutex_unlock(&inode_alloc_lock);
+}
+
+// the caller holds the inode's exclusive lock
+void
+free_inode(int inode_index)
+{
+	iNode* inode = get_inode(inode_index);
+	free_all_blocks(inode);
+	memset(inode, 0, sizeof(iNode));
+	journal_dirty(inode, sizeof(iNode));
+	forget_dirty_blocks(get_inode_state(inode_index));
+	dcache_forget_inode(inode_index);
+
+	release_inode(inode_index);
+}
+
+// returns the index of the new directory
+int
+create_dir_at_in_txn(int parent_index, const char* new_dir_name, mode_t mode)
+{
+	int rv = lock_inode(parent_index, true);
+	if(rv < 0) {
+		return rv;
+	}
+	rv = check_new_entry(parent_index, new_dir_name);
+	if(rv < 0) {
+		unlock_inode(parent_index);
+		return rv;
+	}
+	iNode* parent_inode = get_inode(parent_index);
+
+	int new_inode_index = reserve_inode();
+	int new_data_block_index = reserve_data_block();
+	if(new_inode_index < 0 || new_data_block_index < 0) {
+		if(new_inode_index >= 0) {
+			release_inode(new_inode_index);
+		}
+		free_data_block(new_data_block_index);
+		unlock_inode(parent_index);
+		return -ENOSPC;
+	}
+
+	iNode* new_inode = configure_inode(new_inode_index, S_IFDIR | (mode & 07777),
+		sizeof(directory));
+	append_blocks(new_inode, new_data_block_index, 1);
+	
+	add_entry_to_inode(new_inode, ".", new_inode_index);
+	add_entry_to_inode(new_inode, "..", parent_index);
+	rv = add_entry_to_inode(parent_inode, new_dir_name, new_inode_index);
+	if(rv < 0) {
+		free_inode(new_inode_index);
+	}
+
+	unlock_inode(parent_index);
+	return rv < 0 ? rv : new_inode_index;
+}
+
+int
+create_dir_at(int parent_index, const char* new_dir_name, mode_t mode)
+{
+	journal_begin();
+	int rv = create_dir_at_in_txn(parent_index, new_dir_name, mode);
+	journal_end();
+	return rv;
+}
+
+int
+create_dir(const char* path, mode_t mode)
+{
+	int parent_index = parent_inode_index_from_path(path);
+	if(parent_index < 0) {
+		return parent_index;
+	}
+
+	int rv = create_dir_at(parent_index, path_last_component(path), mode);
+	return rv < 0 ? rv : 0;
+}
+
+// returns the index of the new inode
+int
+create_inode_at_in_txn(int parent_index, const char* file_name, mode_t mode)
+{
+	int rv = lock_inode(parent_index, true);
+	if(rv < 0) {
+		return rv;
+	}
+	rv = check_new_entry(parent_index, file_name);
+	if(rv < 0) {
+		unlock_inode(parent_index);
+		return rv;
+	}
+
+	int inode_index = reserve_inode();
+	if (inode_index < 0) {
+		unlock_inode(parent_index);
+		return -ENOSPC;
+	}
+	configure_inode(inode_index, mode, 0);
+	
+	iNode* parent = get_inode(parent_index);
+	rv = add_entry_to_inode(parent, file_name, inode_index);
+	if(rv < 0) {
+		free_inode(inode_index);
+	}
+	unlock_inode(parent_index);
+	return rv < 0 ? rv : inode_index;
+}
+
+int
+create_inode_at(int parent_index, const char* file_name, mode_t mode)
+{
+	journal_begin();
+	int rv = create_inode_at_in_txn(parent_index, file_name, mode);
+	journal_end();
+	return rv;
+}
+
 int
-set_file_to_size(const char* path, off_t size)
+create_inode_at_path(const char* path, mode_t mode)
+{
+	int parent_inode_index = parent_inode_index_from_path(path);
+	if(parent_inode_index < 0) {
+		return parent_inode_index;
+	}
+
+	int rv = create_inode_at(parent_inode_index, path_last_component(path), mode);
+	return rv < 0 ? rv : 0;
+}
+
+int
+truncate_inode_in_txn(int inode_index, off_t size)
+{
+	if (size > INT_MAX) {
+		return -EFBIG;
+	}
+	int rv = lock_inode(inode_index, true);
+	if (rv < 0) {
+		return rv;
+	}
+	rv = set_file_to_size(inode_index, size, false);
+	unlock_inode(inode_index);
+	return rv;
+}
+
+int
+truncate_inode(int inode_index, off_t size)
+{
+	journal_begin();
+	int rv = truncate_inode_in_txn(inode_index, size);
+	journal_end();
+	return rv;
+}
+
+int
+truncate(const char* path, off_t size)
 {
 	int inode_index = inode_index_from_path(path);
 	if (inode_index < 0) {
 		return -ENOENT;
 	}
-	
-	// clear out the file
+	return truncate_inode(inode_index, size);
+}
+
+// lseek's SEEK_DATA and SEEK_HOLE: the first byte at or after offset
+// that is mapped, or that is in a hole, counting EOF as the start of one.
+// Fails with -ENXIO when offset is at or past EOF, or there is no data
+// after it.
+off_t
+seek_inode(int inode_index, off_t offset, int whence)
+{
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		return -EINVAL;
+	}
+	int rv = lock_inode(inode_index, false);
+	if (rv < 0) {
+		return rv;
+	}
 	iNode* node = get_inode(inode_index);
-	
 	if (!is_inode_file(node)) {
+		unlock_inode(inode_index);
 		return -EISDIR;
 	}
-	
-	int curr_num_blocks = num_blocks_used(node);
-	int total_blocks = (int) ceil(size / (PAGE_SIZE * 1.0));
-	int blocks_to_add = total_blocks - curr_num_blocks;
-	
-	node->size = size;
-	if (blocks_to_add == 0) {
-		return 0;
-	} else if (blocks_to_add < 0) {
-		// remove some blocks
-		return remove_blocks_from_node(node, -blocks_to_add);
+	if (offset < 0 || offset >= node->size) {
+		unlock_inode(inode_index);
+		return -ENXIO;
+	}
+
+	extent* extents = inode_extents(node);
+	int ii = extent_after(node, offset / PAGE_SIZE);
+	off_t found;
+	if (is_inline(node)) {
+		// all data
+		found = whence == SEEK_DATA ? offset : node->size;
+	} else if (whence == SEEK_DATA) {
+		found = ii < node->num_extents ? (off_t) extents[ii].logical * PAGE_SIZE : node->size;
+		found = found > offset ? found : offset;
+		if (found >= node->size) {
+			found = -ENXIO;
+		}
+	} else if (ii == node->num_extents || extents[ii].logical > offset / PAGE_SIZE) {
+		found = offset;
 	} else {
-		// reserve some blocks
-		return reserve_blocks_for_node(node, blocks_to_add);
+		// to the end of this run of touching extents
+		int end = extents[ii].logical + extents[ii].length;
+		while (++ii < node->num_extents && extents[ii].logical == end) {
+			end += extents[ii].length;
+		}
+		found = (off_t) end * PAGE_SIZE;
+		found = found < node->size ? found : node->size;
+	}
+	unlock_inode(inode_index);
+	return found;
+}
+
+// zeroes bytes [offset, end) of the file; holes already read as zeros
+void
+zero_range(iNode* node, off_t offset, off_t end)
+{
+	if (is_inline(node)) {
+		if (end > node->size) {
+			end = node->size;
+		}
+		if (offset < end) {
+			memset(node->inline_data + offset, 0, end - offset);
+			journal_dirty(node, sizeof(iNode));
+		}
+		return;
+	}
+
+	inode_state* state = get_inode_state(inode_index(node));
+	while (offset < end) {
+		off_t block_end = (offset / PAGE_SIZE + 1) * PAGE_SIZE;
+		if (block_end > end) {
+			block_end = end;
+		}
+		int physical = block_for(node, offset / PAGE_SIZE);
+		if (physical >= 0) {
+			memset((char*) get_data_block(physical) + offset % PAGE_SIZE, 0, block_end - offset);
+			note_dirty_blocks(state, physical, 1);
+		}
+		offset = block_end;
 	}
 }
 
+// Reserves blocks for [offset, offset + length), or with PUNCH_HOLE frees
+// them, or with ZERO_RANGE zeroes them and reserves any that are missing.
+// Unless KEEP_SIZE is given, a file that ends before the range grows to
+// cover it. Blocks reserved past EOF stay until a truncate, unlike a
+// write's spares.
 int
-next_read_size(iNode* node, int offset_in_file, int size)
+fallocate_inode_in_txn(int inode_index, int mode, off_t offset, off_t length)
 {
-	size = min(node->size, size);
-	int starting_block_index = offset_in_file / PAGE_SIZE;
-	int offset_in_block = offset_in_file % PAGE_SIZE;
-	
-	int read_size = 0;
-	
-	ilist* data_blocks = get_data_block_ids(node);
-	ilist* curr_block = data_blocks;
-	
-	while(starting_block_index > 0) {
-		curr_block = curr_block->next;
-		starting_block_index--;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		return -EOPNOTSUPP;
 	}
-	
-	while (read_size < size && curr_block != NULL) {
-		read_size += PAGE_SIZE - offset_in_block;
-		offset_in_block = 0;
-	
-		if(curr_block->next == NULL) {
-			break;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) {
+		return -EOPNOTSUPP;
+	}
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && (mode & FALLOC_FL_ZERO_RANGE)) {
+		return -EINVAL;
+	}
+	if (offset < 0 || length <= 0) {
+		return -EINVAL;
+	}
+	off_t end = offset + length;
+	if (end > INT_MAX) {
+		// sizes are ints on disk
+		return -EFBIG;
+	}
+
+	int rv = lock_inode(inode_index, true);
+	if (rv < 0) {
+		return rv;
+	}
+	iNode* node = get_inode(inode_index);
+	inode_state* state = get_inode_state(inode_index);
+	if (!is_inode_file(node)) {
+		unlock_inode(inode_index);
+		return is_inode_dir(node) ? -EISDIR : -ENODEV;
+	}
+	if (is_inline(node) && !(mode & FALLOC_FL_PUNCH_HOLE)) {
+		// reserving blocks, so it needs them
+		rv = uninline_file(node);
+		if (rv < 0) {
+			unlock_inode(inode_index);
+			return rv;
 		}
-			
-		int curr_block_id = curr_block->data;
-		int next_block_id = curr_block->next->data;
-		
-		if (curr_block_id + 1 != next_block_id) {
-			break;
+	}
+
+	int end_block = (end + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		// whole blocks are freed, the ends of partial ones zeroed
+		int full_first = (offset + PAGE_SIZE - 1) / PAGE_SIZE;
+		int full_end = end / PAGE_SIZE;
+		if (full_first >= full_end) {
+			zero_range(node, offset, end);
+		} else {
+			zero_range(node, offset, (off_t) full_first * PAGE_SIZE);
+			zero_range(node, (off_t) full_end * PAGE_SIZE, end);
+			rv = unmap_blocks(node, full_first, full_end);
+		}
+	} else {
+		if (mode & FALLOC_FL_ZERO_RANGE) {
+			zero_range(node, offset, end);
+		}
+		rv = map_blocks(node, offset / PAGE_SIZE, end_block);
+		if (rv == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > node->size) {
+			node->size = end;
+			journal_dirty(node, sizeof(iNode));
 		}
-		curr_block = curr_block->next;		
 	}
-	
-	i_free(data_blocks);	
-	return read_size;	
+	// of a write's spares, only those past the range are still its to free
+	state->spare_blocks = max(0, min(state->spare_blocks, num_blocks_used(node) - end_block));
+	unlock_inode(inode_index);
+	return rv;
+}
+
+int
+fallocate_inode(int inode_index, int mode, off_t offset, off_t length)
+{
+	journal_begin();
+	int rv = fallocate_inode_in_txn(inode_index, mode, offset, length);
+	journal_end();
+	return rv;
+}
+
+int
+remove_entry_from_inode(iNode* inode, const char* entry_name)
+{
+	int offset;
+	directory* leaf = dir_find(inode, entry_name, &offset);
+	if(leaf == NULL) {
+		return -ENOENT;
+	}
+	dir_leaf_remove(leaf, offset);
+	dcache_insert_negative(inode_index(inode), entry_name, strlen(entry_name));
+	return 0;
+}
+
+// points entry_name in inode at inode_num in place, which unlike removing
+// it and adding it again cannot run out of room
+int
+set_entry_inode(iNode* inode, const char* entry_name, int inode_num)
+{
+	int offset;
+	directory* leaf = dir_find(inode, entry_name, &offset);
+	if(leaf == NULL) {
+		return -ENOENT;
+	}
+	dir_record* rec = dir_leaf_record(leaf, offset);
+	rec->inode_num = inode_num;
+	journal_dirty(&rec->inode_num, sizeof(rec->inode_num));
+	dcache_insert(inode_index(inode), entry_name, strlen(entry_name), inode_num);
+	return 0;
 }
 
 int
-read_file(const char* path, char* buf, size_t size, off_t offset_in_file)
+open_inode(int inode_index)
 {
-	int inode_index = inode_index_from_path(path);
-	if (inode_index < 0) {
-		return -ENOENT;
-	}
-	iNode* node = get_inode(inode_index);
-	if (!is_inode_file(node)) {
-		return -EISDIR;
-	}
-	size = min(size, node->size);
-	
-	int offset_in_buf = 0;
-	while (offset_in_buf < size) {
-		int read_size = next_read_size(node, offset_in_file, size);
-		
-		int curr_block = offset_in_file / PAGE_SIZE;
-		int offset_in_block = offset_in_file % PAGE_SIZE;
-		void* block = get_data_block(node->data_block_ids[curr_block]);
-	
-		memcpy(buf + offset_in_buf, block + offset_in_block, read_size);
-		offset_in_buf += read_size;
-		offset_in_file += read_size;
+	int rv = lock_inode(inode_index, true);
+	if (rv < 0) {
+		return rv;
 	}
-	
-	return size;
+	get_inode_state(inode_index)->open_count++;
+	unlock_inode(inode_index);
+	return 0;
 }
 
-int
-write_file(const char* path, const char* buf, size_t size, off_t offset_in_file)
+void
+close_inode_in_txn(int inode_index)
 {
-	int inode_index = inode_index_from_path(path);
-	if (inode_index < 0) {
-		return -ENOENT;
+	if (lock_inode(inode_index, true) < 0) {
+		return;
 	}
+	inode_state* state = get_inode_state(inode_index);
+	state->open_count--;
 	iNode* node = get_inode(inode_index);
-	if (!is_inode_file(node)) {
-		return -EISDIR;
+	if (state->open_count == 0 && node->num_hard_links <= 0) {
+		// the last name went away while it was open
+		free_inode(inode_index);
+	} else if (state->open_count == 0 && is_inode_file(node)) {
+		trim_preallocation(node);
 	}
-	if (node->size < size + offset_in_file) {
-		set_file_to_size(path, size + offset_in_file);
-	}
-	
-	int offset_in_buf = 0;
-	while (offset_in_buf < size) {
-		int read_size = next_read_size(node, offset_in_file, size);
-		
-		int curr_block = offset_in_file / PAGE_SIZE;
-		int offset_in_block = offset_in_file % PAGE_SIZE;
-		void* block = get_data_block(node->data_block_ids[curr_block]);
-	
-		memcpy(block + offset_in_block, buf + offset_in_buf, read_size);
-		offset_in_buf += read_size;
-		offset_in_file += read_size;
-	}
-	
-	return size;
+	unlock_inode(inode_index);
 }
 
+void
+close_inode(int inode_index)
+{
+	journal_begin();
+	close_inode_in_txn(inode_index);
+	journal_end();
+}
 
+// Makes a file durable: the data blocks written since the last sync go to
+// disk as one msync per contiguous run, and then the journal commits, so
+// the metadata never points at data that is not on disk yet. The file's
+// inode, bitmap and directory pages are covered by the journal commit,
+// which is one msync of the journal however many pages it holds.
 int
-create_dir(const char* path)
+sync_inode(int inode_index)
 {
-
-	slist* tokens = get_path_components(path);
-	if(tokens < 0) {
+	if (inode_index < 0 || inode_index >= get_num_inodes()) {
 		return -ENOENT;
 	}
-	if(tokens == NULL) {
-		return -ENOENT;
+	inode_state* state = get_inode_state(inode_index);
+	pthread_mutex_lock(&state->sync_lock);
+	int rv = lock_inode(inode_index, true);
+	if (rv < 0) {
+		pthread_mutex_unlock(&state->sync_lock);
+		return rv;
 	}
-
-	int parent_index = 0;
-	slist* curr = tokens;
-	while(curr->next != NULL) {
-		parent_index = inode_child(parent_index, curr->data);
-		if(parent_index == -1) {
-			return -ENOENT;
+	// writes may go on while the runs taken here are written out
+	block_run* runs = state->dirty;
+	int num_runs = state->num_dirty;
+	state->dirty = NULL;
+	state->num_dirty = 0;
+	state->dirty_capacity = 0;
+	unlock_inode(inode_index);
+
+	for (int ii = 0; ii < num_runs; ii++) {
+		int err = pages_sync(super->data_block_page + runs[ii].start, runs[ii].count);
+		if (err < 0 && rv == 0) {
+			rv = err;
 		}
-
-		curr = curr->next;
 	}
-
-	iNode* parent_inode = get_inode(parent_index);
-	if(!is_inode_dir(parent_inode)) {
-		return -ENOTDIR;
+	free(runs);
+	if (rv == 0) {
+		journal_sync();
 	}
+	pthread_mutex_unlock(&state->sync_lock);
+	return rv;
+}
 
-	char* new_dir_name = curr->data;
+// . and .. are managed by the directories themselves, and locking them as
+// entries would take a lock out of order
+bool
+is_dot_entry(const char* name)
+{
+	return streq(name, ".") || streq(name, "..");
+}
 
-	int new_inode_index = reserve_inode();
-	int new_data_block_index = reserve_data_block();
-	if(new_inode_index < 0 || new_data_block_index < 0) {
-		return -ENOMEM;
+bool
+dir_is_empty(iNode* inode)
+{
+	int num_blocks = num_blocks_used(inode);
+	for(int lb = 0; lb < num_blocks; lb++) {
+		directory* leaf = dir_leaf(inode, lb);
+		if(leaf == NULL) {
+			continue;
+		}
+		for(int off = dir_leaf_next(leaf, 0); off >= 0; off = dir_leaf_after(leaf, off)) {
+			if(!is_dot_entry(dir_leaf_record(leaf, off)->name)) {
+				return false;
+			}
+		}
 	}
+	return true;
+}
 
-	int mode = S_IFDIR | S_IRWXU;
-	int* data_block_ids = malloc(NUM_DATA_BLOCK_IDS * sizeof(int));
-	data_block_ids[0] = new_data_block_index;
-	for(int ii = 1; ii < NUM_DATA_BLOCK_IDS; ii++) {
-		data_block_ids[ii] = -1;
+// drops a link to inode_index, freeing it once nothing links to it or has
+// it open; the caller holds it exclusively
+void
+drop_link(int inode_index)
+{
+	iNode* inode = get_inode(inode_index);
+	inode->num_hard_links--;
+	journal_dirty(inode, sizeof(iNode));
+	if(inode->num_hard_links > 0 || get_inode_state(inode_index)->open_count > 0) {
+		return;
 	}
-	
-	iNode* new_inode = configure_inode(new_inode_index, mode, sizeof(directory), data_block_ids, -1);
-	
-	add_entry_to_inode(new_inode, ".", new_inode_index);
-	add_entry_to_inode(new_inode, "..", parent_index);
-	add_entry_to_inode(parent_inode, new_dir_name, new_inode_index);
 
-	return 0;
+	free_inode(inode_index);
 }
 
+// removes entry_name, which names inode_index, from the parent and drops
+// the link; the caller holds both exclusively
 int
-create_inode_at_path(const char* path, mode_t mode)
+unlink_locked(int parent_inode_index, const char* entry_name, int inode_index)
 {
-	int inode_index = reserve_inode();
-	if (inode_index < 0) {
+	iNode* parent_inode = get_inode(parent_inode_index);
+	int rv = remove_entry_from_inode(parent_inode, entry_name);
+	if(rv != 0) {
 		return -ENOENT;
 	}
-	int* data_block_ids = malloc(NUM_DATA_BLOCK_IDS * sizeof(int));
-	for(int ii = 0; ii < NUM_DATA_BLOCK_IDS; ii++) {
-		data_block_ids[ii] = -1;
-	}
-	configure_inode(inode_index, mode, 0, data_block_ids, -1);
-	
-	int parent_inode_index = parent_inode_index_from_path(path);
-	iNode* parent = get_inode(parent_inode_index);
-	
-	const char* file_name = s_get_last(get_path_components(path));
-	add_entry_to_inode(parent, file_name, inode_index);
+	drop_link(inode_index);
 	return 0;
 }
 
+// locks parent_index and its entry entry_name exclusively, returning the
+// entry's index; on failure nothing is left locked
 int
-truncate(const char* path, off_t size)
+lock_entry(int parent_inode_index, const char* entry_name)
 {
-	int inode_index = inode_index_from_path(path);
-	if (inode_index < 0) {
-		return -ENOENT;
+	if(is_dot_entry(entry_name)) {
+		return -EINVAL;
 	}
-	
-	// clear out the file
-	iNode* node = get_inode(inode_index);
-	free_all_blocks(node);
-	set_file_to_size(path, size);
+	int rv = lock_inode(parent_inode_index, true);
+	if(rv < 0) {
+		return rv;
+	}
+	int inode_index = lookup_child_locked(parent_inode_index, entry_name, strlen(entry_name));
+	if(inode_index >= 0) {
+		rv = lock_inode(inode_index, true);
+		if(rv < 0) {
+			inode_index = rv;
+		}
+	}
+	if(inode_index < 0) {
+		unlock_inode(parent_inode_index);
+	}
+	return inode_index;
 }
 
 int
-remove_entry_from_dir(directory* dir, const char* entry_name)
+unlink_file_at_in_txn(int parent_inode_index, const char* entry_name)
 {
-	char* file_entry_bitmap = (char*) &dir->file_entry_bitmap;
-	for(int ii = 0; ii < NUM_ENTRIES_IN_DIR; ii++) {
-		int entry_in_use = bitmap_read(file_entry_bitmap, ii);
-		if(entry_in_use) {
-			file_entry entry = *(&dir->entries + ii);
-			if(strcmp(entry.name, entry_name) == 0) {
-				bitmap_set(file_entry_bitmap, ii, false);
-				memset(&dir->entries + ii, 0, sizeof(file_entry));
-				return 0;
-			}
-		}
+	int inode_index = lock_entry(parent_inode_index, entry_name);
+	if (inode_index < 0) {
+		return inode_index;
 	}
 
-	return -1;
+	int rv = unlink_locked(parent_inode_index, entry_name, inode_index);
+	unlock_inode(inode_index);
+	unlock_inode(parent_inode_index);
+	return rv;
 }
 
 int
-remove_entry_from_inode(iNode* inode, const char* entry_name)
+unlink_file_at(int parent_inode_index, const char* entry_name)
 {
-	ilist* data_blocks = get_data_block_ids(inode);
-	ilist* curr_block = data_blocks;	
-		
-	while(curr_block != NULL) {
-		int curr_data_block = curr_block->data;
-		if(curr_data_block < 0) {
-			continue;
-		}
+	journal_begin();
+	int rv = unlink_file_at_in_txn(parent_inode_index, entry_name);
+	journal_end();
+	return rv;
+}
 
-		directory* working_dir = (directory*) get_data_block(curr_data_block);
-		int rv = remove_entry_from_dir(working_dir, entry_name);
-		if(rv == 0) {
-			i_free(data_blocks);
-			return 0;
-		}
-		curr_block = curr_block->next;
+int
+unlink_file(const char* path)
+{
+	int parent_inode_index = parent_inode_index_from_path(path);
+	if(parent_inode_index < 0) {
+		return -ENOENT;
 	}
 
-	i_free(data_blocks);
-	return -ENOENT;
+	return unlink_file_at(parent_inode_index, path_last_component(path));
 }
 
-void
-free_inode(int inode_index)
+int
+link_file_at_in_txn(int inode_index, int parent_inode_index, const char* entry_name)
 {
-	iNode* inode = get_inode(inode_index);
-	free_all_blocks(inode);
-	memset(inode, 0, sizeof(iNode));
+	if(inode_index < 0 || inode_index >= get_num_inodes()
+			|| is_inode_dir(get_inode(inode_index))) {
+		// no hard links to directories; this also keeps the inode a leaf,
+		// so locking it after the parent is in order
+		return -EPERM;
+	}
+
+	int rv = lock_inode(parent_inode_index, true);
+	if(rv < 0) {
+		return rv;
+	}
+	rv = lock_inode(inode_index, true);
+	if(rv < 0) {
+		unlock_inode(parent_inode_index);
+		return rv;
+	}
+
+	rv = check_new_entry(parent_inode_index, entry_name);
+	if(rv == 0) {
+		iNode* parent_inode = get_inode(parent_inode_index);
+		rv = add_entry_to_inode(parent_inode, entry_name, inode_index);
+	}
+	if(rv == 0) {
+		iNode* inode = get_inode(inode_index);
+		inode->num_hard_links++;
+		journal_dirty(inode, sizeof(iNode));
+	}
 
-	char* inode_bitmap = get_inode_bitmap();
-	bitmap_set(inode_bitmap, inode_index, false);
+	unlock_inode(inode_index);
+	unlock_inode(parent_inode_index);
+	return rv;
 }
 
 int
-unlink_file(const char* path)
+link_file_at(int inode_index, int parent_inode_index, const char* entry_name)
 {
-	int inode_index = inode_index_from_path(path);
+	journal_begin();
+	int rv = link_file_at_in_txn(inode_index, parent_inode_index, entry_name);
+	journal_end();
+	return rv;
+}
+
+int
+link_file(const char* path_old, const char* path_new)
+{
+	int inode_index = inode_index_from_path(path_old);
 	if (inode_index < 0) {
 		return -ENOENT;
 	}
 
-	int parent_inode_index = parent_inode_index_from_path(path);
+	int parent_inode_index = parent_inode_index_from_path(path_new);
 	if(parent_inode_index < 0) {
 		return -ENOENT;
 	}
 
-	iNode* parent_inode = get_inode(parent_inode_index);
-	slist* path_components = get_path_components(path);
-	const char* entry_name = s_get_last(path_components);
+	return link_file_at(inode_index, parent_inode_index, path_last_component(path_new));
+}
 
-	int rv = remove_entry_from_inode(parent_inode, entry_name);
-	s_free(path_components);
-	if(rv != 0) {
-		return -ENOENT;
+int
+remove_dir_at_in_txn(int parent_inode_index, const char* entry_name)
+{
+	int inode_index = lock_entry(parent_inode_index, entry_name);
+	if (inode_index < 0) {
+		return inode_index;
 	}
-	
+
 	iNode* inode = get_inode(inode_index);
-	inode->num_hard_links--;
-	if(inode->num_hard_links > 0) {
-		return 0;
+	int rv;
+	if(!is_inode_dir(inode)) {
+		rv = -ENOTDIR;
+	} else if(!dir_is_empty(inode)) {
+		rv = -ENOTEMPTY;
+	} else {
+		rv = unlink_locked(parent_inode_index, entry_name, inode_index);
 	}
 
-	free_inode(inode_index);
-	return 0;
+	unlock_inode(inode_index);
+	unlock_inode(parent_inode_index);
+	return rv;
 }
 
 int
-link_file(const char* path_old, const char* path_new)
+remove_dir_at(int parent_inode_index, const char* entry_name)
 {
-	int inode_index = inode_index_from_path(path_old);
-	if (inode_index < 0) {
+	journal_begin();
+	int rv = remove_dir_at_in_txn(parent_inode_index, entry_name);
+	journal_end();
+	return rv;
+}
+
+int
+remove_dir(const char* path)
+{
+	int parent_inode_index = parent_inode_index_from_path(path);
+	if(parent_inode_index < 0) {
 		return -ENOENT;
 	}
 
+	return remove_dir_at(parent_inode_index, path_last_component(path));
+}
+
+// whether directory ancestor_index is above inode_index; the caller holds
+// rename_lock, so no .. entry can change during the walk
+bool
+is_ancestor(int ancestor_index, int inode_index)
+{
+	while(inode_index > 0) {
+		inode_index = lookup_child(inode_index, "..", 2);
+		if(inode_index == ancestor_index) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int
+rename_file_at_in_txn(int parent_index, const char* name, int new_parent_index, const char* new_name)
+{
+	if(is_dot_entry(name) || is_dot_entry(new_name)) {
+		return -EINVAL;
+	}
+	int new_name_len = strlen(new_name);
+	if(new_name_len >= NAME_MAX_LEN) {
+		return -ENAMETOOLONG;
+	}
+
+	pthread_mutex_lock(&rename_lock);
+	int inode_index;
+	int existing;
+	int rv;
+	for(;;) {
+		inode_index = lookup_child(parent_index, name, strlen(name));
+		existing = lookup_child(new_parent_index, new_name, new_name_len);
+		rv = inode_index < 0 ? inode_index
+			: existing < 0 && existing != -ENOENT ? existing : 0;
+		if(rv == 0 && existing == inode_index) {
+			// already there
+			rv = 1;
+		} else if(rv == 0 && is_inode_dir(get_inode(inode_index))
+				&& (inode_index == new_parent_index
+				|| is_ancestor(inode_index, new_parent_index))) {
+			// can't move a directory inside itself
+			rv = -EINVAL;
+		} else if(rv == 0 && existing >= 0
+				&& (existing == parent_index || is_ancestor(existing, parent_index))) {
+			// the destination contains the source, so it is not empty
+			rv = -ENOTEMPTY;
+		}
+		if(rv != 0) {
+			pthread_mutex_unlock(&rename_lock);
+			return rv < 0 ? rv : 0;
+		}
+
+		// parents, ancestor first; unrelated ones by index
+		int first = min(parent_index, new_parent_index);
+		int second = max(parent_index, new_parent_index);
+		if(is_ancestor(second, first)) {
+			first = second;
+			second = min(parent_index, new_parent_index);
+		}
+		rv = lock_inode(first, true);
+		if(rv == 0 && second != first && (rv = lock_inode(second, true)) < 0) {
+			unlock_inode(first);
+		}
+		if(rv < 0) {
+			pthread_mutex_unlock(&rename_lock);
+			return rv;
+		}
+
+		// an entry may have changed between the lookups and the locks
+		if(lookup_child_locked(parent_index, name, strlen(name)) == inode_index
+				&& lookup_child_locked(new_parent_index, new_name, new_name_len) == existing) {
+			break;
+		}
+		if(second != first) {
+			unlock_inode(second);
+		}
+		unlock_inode(first);
+	}
+
+	// neither entry is above the other, so take them by index
+	if(existing >= 0 && existing < inode_index) {
+		lock_inode(existing, true);
+	}
+	lock_inode(inode_index, true);
+	if(existing > inode_index) {
+		lock_inode(existing, true);
+	}
+
 	iNode* inode = get_inode(inode_index);
-	
-	int parent_inode_index = parent_inode_index_from_path(path_new);
-	if(parent_inode_index < 0) {
-		return -ENOENT;
+	iNode* new_parent = get_inode(new_parent_index);
+	if(existing >= 0) {
+		// replace whatever is already at the destination; its entry is
+		// pointed at the source in place, so nothing can fail once the
+		// old inode loses its link
+		iNode* existing_inode = get_inode(existing);
+		if(is_inode_dir(inode) && !is_inode_dir(existing_inode)) {
+			rv = -ENOTDIR;
+		} else if(!is_inode_dir(inode) && is_inode_dir(existing_inode)) {
+			rv = -EISDIR;
+		} else if(is_inode_dir(existing_inode) && !dir_is_empty(existing_inode)) {
+			rv = -ENOTEMPTY;
+		} else {
+			rv = set_entry_inode(new_parent, new_name, inode_index);
+		}
+		if(rv == 0) {
+			drop_link(existing);
+		}
+		unlock_inode(existing);
+	} else if(!is_inode_dir(new_parent)) {
+		rv = -ENOTDIR;
+	} else {
+		rv = add_entry_to_inode(new_parent, new_name, inode_index);
 	}
 
-	iNode* parent_inode = get_inode(parent_inode_index);
-	slist* path_components = get_path_components(path_new);
-	const char* entry_name = s_get_last(path_components);
+	if(rv == 0) {
+		remove_entry_from_inode(get_inode(parent_index), name);
+		if(is_inode_dir(inode) && parent_index != new_parent_index) {
+			set_entry_inode(inode, "..", new_parent_index);
+		}
+	}
 
-	int rv = add_entry_to_inode(parent_inode, entry_name, inode_index);
-	s_free(path_components);
-	if(rv != 0) {
-		return -ENOTDIR;
+	unlock_inode(inode_index);
+	if(new_parent_index != parent_index) {
+		unlock_inode(new_parent_index);
 	}
+	unlock_inode(parent_index);
+	pthread_mutex_unlock(&rename_lock);
+	return rv;
+}
 
-	inode->num_hard_links++;
-	return 0;
+int
+rename_file_at(int parent_index, const char* name, int new_parent_index, const char* new_name)
+{
+	journal_begin();
+	int rv = rename_file_at_in_txn(parent_index, name, new_parent_index, new_name);
+	journal_end();
+	return rv;
 }
 
 int
 rename_file(const char* from, const char* to)
 {
-	int rv = link_file(from, to);
-	if(rv != 0) {
-		return rv;
+	int parent_index = parent_inode_index_from_path(from);
+	if(parent_index < 0) {
+		return parent_index;
+	}
+	int new_parent_index = parent_inode_index_from_path(to);
+	if(new_parent_index < 0) {
+		return new_parent_index;
 	}
 
-	return unlink_file(from); 
+	return rename_file_at(parent_index, path_last_component(from),
+		new_parent_index, path_last_component(to));
 }
 
 int
-remove_dir(const char* path)
+set_time_inode_in_txn(int inode_index, const struct timespec ts[2])
 {
-	int inode_index = inode_index_from_path(path);
-	if (inode_index < 0) {
-		return -ENOENT;
+	int rv = lock_inode(inode_index, true);
+	if (rv < 0) {
+		return rv;
 	}
-
 	iNode* inode = get_inode(inode_index);
+	inode->last_time_accessed = ts[0].tv_sec;
+	inode->last_time_modified = ts[1].tv_sec;
+	journal_dirty(inode, sizeof(iNode));
+	unlock_inode(inode_index);
+	return 0;
+}
 
-	if(!is_inode_dir(inode)) {
-		return -ENOTDIR;
-	}
-	
-	ilist* data_blocks = get_data_block_ids(inode);
-	ilist* curr_block = data_blocks;
-
-	while(curr_block != NULL) {
-		int block_id = curr_block->data;
-		directory* curr_dir = (directory*) get_data_block(block_id);
-		for(int ii = 0; ii < NUM_ENTRIES_IN_DIR; ii++) {
-			char* dir_bitmap = (char*) &curr_dir->file_entry_bitmap;
-			if(bitmap_read(dir_bitmap, ii)) {
-				file_entry entry = *(&curr_dir->entries + ii);
-				if(!streq(entry.name, ".") && !streq(entry.name, "..")) {
-					i_free(data_blocks);
-					return -ENOTEMPTY;
-				}
-			}
-		}
-		curr_block->next;
-	}
-	
-	i_free(data_blocks);
-	int rv = unlink_file(path);
+int
+set_time_inode(int inode_index, const struct timespec ts[2])
+{
+	journal_begin();
+	int rv = set_time_inode_in_txn(inode_index, ts);
+	journal_end();
 	return rv;
 }
 
@@ -908,12 +3186,32 @@ set_time(const char* path, const struct timespec ts[2])
 		return -ENOENT;
 	}
 
+	return set_time_inode(inode_index, ts);
+}
+
+int
+set_mode_inode_in_txn(int inode_index, mode_t mode)
+{
+	int rv = lock_inode(inode_index, true);
+	if (rv < 0) {
+		return rv;
+	}
 	iNode* inode = get_inode(inode_index);
-	inode->last_time_accessed = ts[0].tv_sec;
-	inode->last_time_modified = ts[1].tv_sec;
+	inode->mode = mode;
+	journal_dirty(inode, sizeof(iNode));
+	unlock_inode(inode_index);
 	return 0;
 }
 
+int
+set_mode_inode(int inode_index, mode_t mode)
+{
+	journal_begin();
+	int rv = set_mode_inode_in_txn(inode_index, mode);
+	journal_end();
+	return rv;
+}
+
 int
 set_mode(const char* path, mode_t mode)
 {
@@ -922,8 +3220,5 @@ set_mode(const char* path, mode_t mode)
 		return -ENOENT;
 	}
 	
-	iNode* inode = get_inode(inode_index);
-	inode->mode = mode;
-	return 0;
+	return set_mode_inode(inode_index, mode);
 }
-
@@ -4,14 +4,39 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdint.h>
 
 #include "slist.h"
 
-void storage_init(const char* path);
+// state for one open file, kept between read/write calls
+typedef struct file_handle {
+	int inode_index;
+	int extent_hint;    // extent the last access landed in
+	off_t next_offset;  // where the next sequential access would start
+	int streak;         // back-to-back sequential accesses so far
+} file_handle;
+
+// mounts the image at path, formatting a new one of size bytes that can
+// grow to max_size (0 for a default) if the file is empty; returns -EINVAL
+// if it is not a nufs image
+int storage_init(const char* path, int64_t size, int64_t max_size);
+// waits until every metadata change made so far is on disk
+void storage_sync();
+// starts writing back dirty data, and commits and checkpoints the journal,
+// before unmounting
+void storage_close();
 int         get_stat(const char* path, struct stat* st);
 const char* get_data(const char* path);
 slist* get_filenames_from_dir(const char* path);
-int create_dir(const char* path);
+// called with each entry of a directory, its inode index and attributes,
+// and the cookie to resume the listing after it; a nonzero result stops
+// the walk
+typedef int (*dir_filler)(void* ctx, const char* name, int inode_index,
+                          const struct stat* st, off_t next);
+// walks a directory's blocks once, with no per-entry path lookups,
+// starting from a cookie given to the filler, or 0
+int read_dir(const char* path, off_t offset, dir_filler fill, void* ctx);
+int create_dir(const char* path, mode_t mode);
 // should this include rdev from mknod??
 int create_inode_at_path(const char* path, mode_t mode);
 int truncate(const char* path, off_t size);
@@ -24,4 +49,40 @@ int remove_dir(const char* path);
 int set_time(const char* path, const struct timespec ts[2]);
 int set_mode(const char* path, mode_t mode);
 
+// the same operations addressed by inode index (0 is the root directory)
+// and, where a directory entry is involved, parent index + name
+int    inode_index_from_path(const char* path);
+int    lookup_child(int inode_index, const char* name, int len);
+int    get_stat_inode(int inode_index, struct stat* st);
+// how many times the index was freed, for telling a reused one apart
+unsigned inode_generation(int inode_index);
+slist* get_filenames_from_inode(int inode_index);
+int    read_dir_inode(int inode_index, off_t offset, dir_filler fill, void* ctx);
+int    create_dir_at(int parent_index, const char* name, mode_t mode);
+int    create_inode_at(int parent_index, const char* name, mode_t mode);
+int    truncate_inode(int inode_index, off_t size);
+int    read_inode(int inode_index, char* buf, size_t size, off_t offset_in_file);
+int    write_inode(int inode_index, const char* buf, size_t size, off_t offset_in_file);
+int    link_file_at(int inode_index, int parent_index, const char* name);
+int    unlink_file_at(int parent_index, const char* name);
+int    rename_file_at(int parent_index, const char* name, int new_parent_index, const char* new_name);
+int    remove_dir_at(int parent_index, const char* name);
+int    set_time_inode(int inode_index, const struct timespec ts[2]);
+int    set_mode_inode(int inode_index, mode_t mode);
+
+// open files; see handle.h for the table that owns file_handles
+int open_inode(int inode_index);
+void close_inode(int inode_index);
+int read_handle(file_handle* fh, char* buf, size_t size, off_t offset_in_file);
+int write_handle(file_handle* fh, const char* buf, size_t size, off_t offset_in_file);
+// writes out what has changed in a file or directory and waits for it
+int sync_inode(int inode_index);
+// fallocate(2) on a file: mode 0 or FALLOC_FL_KEEP_SIZE, optionally with
+// FALLOC_FL_ZERO_RANGE, or FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE
+int fallocate_inode(int inode_index, int mode, off_t offset, off_t length);
+// lseek(2) with SEEK_DATA or SEEK_HOLE. Engine-only: the FUSE 2 API the
+// frontends are built on has no lseek callback, so on a mount the kernel
+// answers these itself and reports the whole file as data.
+off_t seek_inode(int inode_index, off_t offset, int whence);
+
 #endif
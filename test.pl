@@ -2,18 +2,49 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 101;
 use IO::Handle;
+use Fcntl;
+use POSIX ();
 
 sub mount {
     system("(make mount 2>&1) >> test.log &");
     sleep 1;
 }
 
+# mounts data.nufs with nufs flags that make mount doesn't pass
+sub mount_with {
+    my @flags = @_;
+    system("mkdir -p mnt");
+    system("(./nufs @flags -f mnt data.nufs 2>&1) >> test.log &");
+    sleep 1;
+}
+
 sub unmount {
     system("(make unmount 2>&1) >> test.log");
 }
 
+# kills the filesystem without letting it write anything more out
+sub crash {
+    system("pkill -9 -x nufs");
+    sleep 1;
+    unmount();
+}
+
+# fsync commits the whole journal, not just the file
+sub sync_file {
+    my ($name) = @_;
+    open my $fh, ">>", "mnt/$name" or return 0;
+    my $rv = $fh->sync;
+    close $fh;
+    return $rv;
+}
+
+sub blocks_of {
+    my ($name) = @_;
+    return (stat "mnt/$name")[12];
+}
+
 sub write_text {
     my ($name, $data) = @_;
     open my $fh, ">", "mnt/$name" or return;
@@ -31,6 +62,24 @@ sub read_text {
     return $data;
 }
 
+sub write_bytes {
+    my ($name, $data, $offset) = @_;
+    sysopen my $fh, "mnt/$name", O_WRONLY | O_CREAT or return -1;
+    sysseek $fh, $offset || 0, 0;
+    my $rv = syswrite $fh, $data;
+    close $fh;
+    return $rv;
+}
+
+sub read_bytes {
+    my ($name) = @_;
+    open my $fh, "<", "mnt/$name" or return "";
+    local $/ = undef;
+    my $data = <$fh> // "";
+    close $fh;
+    return $data;
+}
+
 sub read_text_slice {
     my ($name, $count, $offset) = @_;
     open my $fh, "<", "mnt/$name" or return "";
@@ -141,3 +190,671 @@ $right = "ng is four";
 ok($huge2 eq $right, "Read with offset & length");
 
 unmount();
+
+say "#           == Lookup Cache Tests ==";
+mount();
+
+system("mkdir -p mnt/a/b");
+write_text("a/b/c.txt", "cached");
+my $cached = read_text("a/b/c.txt");
+system("mv mnt/a mnt/z");
+ok(read_text("z/b/c.txt") eq $cached && !-e "mnt/a/b/c.txt",
+   "Lookups follow a renamed directory.");
+
+system("rm -rf mnt/z");
+system("mkdir -p mnt/z/b");
+write_text("z/b/c.txt", "made again");
+ok(read_text("z/b/c.txt") eq "made again",
+   "Lookups find a directory made again under the same name.");
+
+system("rm -rf mnt/z");
+unmount();
+
+say "#           == Negative Lookup Tests ==";
+mount();
+
+ok(!-e "mnt/later.txt", "A missing file is missing.");
+write_text("later.txt", "made later");
+ok(read_text("later.txt") eq "made later", "Find a file made after a failed lookup.");
+
+system("rm -f mnt/later.txt");
+ok(!-e "mnt/later.txt", "A removed file is missing.");
+system("mkdir mnt/later.txt");
+ok(-d "mnt/later.txt", "A name made again has its new type.");
+
+rmdir "mnt/later.txt";
+unmount();
+
+say "#           == Low-Level Frontend Tests ==";
+mount_with("--lowlevel");
+
+write_text("ll.txt", "low level");
+ok(read_text("ll.txt") eq "low level", "Read back data through the low-level frontend.");
+
+system("mkdir mnt/lldir");
+system("mv mnt/ll.txt mnt/lldir/moved.txt");
+system("ln mnt/lldir/moved.txt mnt/linked.txt");
+ok(read_text("lldir/moved.txt") eq "low level" && !-e "mnt/ll.txt"
+   && read_text("linked.txt") eq "low level", "Rename and link by inode.");
+
+write_text("lldir/other.txt", "replaced");
+system("mv mnt/lldir/other.txt mnt/lldir/moved.txt");
+ok(read_text("lldir/moved.txt") eq "replaced" && !-e "mnt/lldir/other.txt"
+   && read_text("linked.txt") eq "low level", "Rename over an existing file.");
+
+system("mkdir mnt/lldir/sub");
+ok(!rename("mnt/lldir/sub", "mnt/lldir/moved.txt") && $!{ENOTDIR}
+   && !rename("mnt/lldir/moved.txt", "mnt/lldir/sub") && $!{EISDIR}
+   && -d "mnt/lldir/sub" && read_text("lldir/moved.txt") eq "replaced",
+   "Refuse to rename a directory over a file or a file over a directory.");
+
+my $old_umask = umask(022);
+mkdir "mnt/lldir/modes", 0750;
+umask($old_umask);
+ok(((stat "mnt/lldir/modes")[2] & 07777) == 0750, "Make a directory with the mode asked for.");
+
+rmdir "mnt/lldir/sub";
+rmdir "mnt/lldir/modes";
+system("rm -f mnt/lldir/moved.txt");
+ok(!-e "mnt/lldir/moved.txt" && rmdir("mnt/lldir"), "Unlink and rmdir by inode.");
+
+unmount();
+mount();
+
+ok(read_text("linked.txt") eq "low level" && !-e "mnt/lldir",
+   "The path-based frontend sees the same tree.");
+
+system("rm -f mnt/linked.txt");
+unmount();
+
+say "#           == Open File Tests ==";
+mount();
+
+open my $wh, ">", "mnt/open.txt";
+$wh->autoflush(1);
+print $wh "first ";
+system("mv mnt/open.txt mnt/renamed.txt");
+print $wh "second";
+close $wh;
+ok(read_text("renamed.txt") eq "first second", "Write to a file renamed while open.");
+
+open my $rh, "<", "mnt/renamed.txt";
+unlink "mnt/renamed.txt";
+my $kept = <$rh>;
+close $rh;
+ok(!-e "mnt/renamed.txt" && $kept eq "first second", "Read a file unlinked while open.");
+
+unmount();
+
+say "#           == Extent Tests ==";
+mount();
+
+# interleave the writes so neither file gets two blocks in a row
+my ($even, $odd) = ("", "");
+for my $ii (0..31) {
+    my $block0 = chr(65 + $ii % 26) x 4096;
+    my $block1 = chr(97 + $ii % 26) x 4096;
+    write_bytes("even.bin", $block0, $ii * 4096);
+    write_bytes("odd.bin", $block1, $ii * 4096);
+    $even .= $block0;
+    $odd .= $block1;
+}
+ok(read_bytes("even.bin") eq $even && read_bytes("odd.bin") eq $odd,
+   "Read back fragmented files.");
+
+unmount();
+mount();
+
+ok(read_bytes("even.bin") eq $even && read_bytes("odd.bin") eq $odd,
+   "Read back fragmented files after remount.");
+
+truncate("mnt/even.bin", 10 * 4096 + 100);
+system("rm -f mnt/odd.bin");
+write_bytes("even.bin", "tail", 20 * 4096);
+my $even1 = substr($even, 0, 10 * 4096 + 100) . ("\0" x (10 * 4096 - 100)) . "tail";
+ok(read_bytes("even.bin") eq $even1, "Truncate and regrow a fragmented file.");
+
+system("rm -f mnt/even.bin");
+unmount();
+
+say "#           == Allocation Tests ==";
+mount();
+
+# free blocks must be found again wherever they are in the bitmaps
+for my $ii (0..29) {
+    write_bytes("alloc$ii", chr(65 + $ii % 26) x 8192);
+}
+for my $ii (grep { $_ % 2 == 0 } 0..29) {
+    unlink "mnt/alloc$ii";
+}
+for my $ii (grep { $_ % 2 == 0 } 0..29) {
+    write_bytes("alloc$ii", chr(97 + $ii % 26) x 12288);
+}
+my $found = 0;
+for my $ii (0..29) {
+    my $want = $ii % 2 ? chr(65 + $ii % 26) x 8192 : chr(97 + $ii % 26) x 12288;
+    $found++ if read_bytes("alloc$ii") eq $want;
+}
+ok($found == 30, "Reuse blocks and inodes freed across the bitmaps.");
+
+my $rounds = 0;
+for my $ii (0..4) {
+    $rounds++ if write_bytes("churn", "c" x 307200) == 307200;
+    unlink "mnt/churn";
+}
+ok($rounds == 5, "Allocate blocks freed by unlink again.");
+
+system("rm -f mnt/alloc*");
+unmount();
+
+say "#           == Superblock Tests ==";
+system("rm -f data.nufs");
+mount_with("--size=4M");
+
+write_text("super.txt", "superblock");
+
+unmount();
+
+open my $image, "<", "data.nufs";
+binmode $image;
+read $image, my $head, 8;
+close $image;
+my ($magic, $version) = unpack("V V", $head);
+ok($magic == 0x5346554e && -s "data.nufs" >= 4 * 1048576,
+   "A new image has a superblock and at least the size asked for.");
+
+mount();
+
+ok(read_text("super.txt") eq "superblock", "Mount an image by its superblock.");
+
+unmount();
+
+say "#           == Growth Tests ==";
+system("rm -f data.nufs");
+mount();
+
+my $size0 = -s "data.nufs";
+my $grown = join("", map { sprintf("%07d\n", $_) } 0..524287);
+write_bytes("grown.bin", $grown);
+for my $ii (0..299) {
+    write_text("inode$ii", "inode $ii");
+}
+ok(-s "data.nufs" > $size0, "The image grows when it fills up.");
+
+unmount();
+mount();
+
+$found = 0;
+for my $ii (0..299) {
+    $found++ if read_text("inode$ii") eq "inode $ii";
+}
+ok(read_bytes("grown.bin") eq $grown && $found == 300,
+   "Read back data and inodes past the first size after remount.");
+
+unmount();
+
+say "#           == Concurrency Tests ==";
+mount();
+
+system("mkdir mnt/shared");
+my @kids;
+for my $kk (0..7) {
+    my $pid = fork();
+    if ($pid == 0) {
+        for my $ii (0..49) {
+            write_text("shared/k$kk-$ii", "kid $kk file $ii");
+            if ($ii % 2) {
+                rename "mnt/shared/k$kk-$ii", "mnt/shared/r$kk-$ii";
+            }
+            elsif ($ii % 10 == 0) {
+                unlink "mnt/shared/k$kk-$ii";
+            }
+        }
+        POSIX::_exit(0);
+    }
+    push @kids, $pid;
+}
+waitpid($_, 0) for @kids;
+
+$found = 0;
+for my $kk (0..7) {
+    for my $ii (0..49) {
+        my $name = ($ii % 2 ? "r" : "k") . "$kk-$ii";
+        if ($ii % 10 == 0) {
+            $found++ unless -e "mnt/shared/$name";
+        }
+        else {
+            $found++ if read_text("shared/$name") eq "kid $kk file $ii";
+        }
+    }
+}
+ok($found == 400, "Create, rename and unlink from eight processes at once.");
+
+unmount();
+
+say "#           == Large Directory Tests ==";
+mount();
+
+system("mkdir mnt/big");
+for my $ii (0..1999) {
+    write_text("big/file$ii", "data $ii");
+}
+my @names = grep { !/^\.\.?$/ } `ls -a mnt/big`;
+ok(scalar(@names) == 2000, "Listed 2000 files.");
+ok(read_text("big/file0") eq "data 0" && read_text("big/file1234") eq "data 1234"
+   && read_text("big/file1999") eq "data 1999", "Looked up files in a big directory.");
+
+unmount();
+mount();
+
+$found = 0;
+for my $ii (0..1999) {
+    $found++ if read_text("big/file$ii") eq "data $ii";
+}
+ok($found == 2000, "Looked up every file after remount.");
+
+unmount();
+
+say "#           == Directory Entry Tests ==";
+mount();
+
+system("mkdir mnt/names");
+for my $len (1..255) {
+    write_text("names/" . ("n" x $len), "len $len");
+}
+@names = grep { !/^\.\.?$/ } `ls -a mnt/names`;
+ok(scalar(@names) == 255, "Listed names of every length.");
+
+unmount();
+mount();
+
+$found = 0;
+for my $len (1..255) {
+    $found++ if read_text("names/" . ("n" x $len)) eq "len $len";
+}
+ok($found == 255, "Looked up names of every length after remount.");
+
+# swap short names for long ones and back, reusing the freed records
+for my $len (1..127) {
+    rename "mnt/names/" . ("n" x $len), "mnt/names/" . ("m" x (256 - $len));
+}
+for my $len (1..127) {
+    rename "mnt/names/" . ("m" x (256 - $len)), "mnt/names/" . ("n" x $len);
+}
+$found = 0;
+for my $len (1..255) {
+    $found++ if read_text("names/" . ("n" x $len)) eq "len $len";
+}
+ok($found == 255, "Renamed entries to longer names and back.");
+
+unmount();
+
+say "#           == Listing Tests ==";
+mount();
+
+system("mkdir -p mnt/listing/sub");
+for my $ii (1..5) {
+    write_bytes("listing/f$ii", "l" x (1000 * $ii));
+}
+my @long = `ls -l mnt/listing`;
+my %sizes = map { (split)[8] => (split)[4] } grep { /^-/ } @long;
+ok(keys(%sizes) == 5 && (grep { $sizes{"f$_"} == 1000 * $_ } 1..5) == 5
+   && (grep { /^d.* sub$/ } @long) == 1, "List a directory with attributes.");
+
+unmount();
+
+say "#           == Readdir Cookie Tests ==";
+mount();
+
+system("mkdir mnt/cookies");
+for my $ii (0..999) {
+    write_text("cookies/old$ii", "x");
+}
+
+# entries added during a listing may or may not show up, but none that
+# were there all along may be skipped
+opendir my $dh, "mnt/cookies";
+my %seen;
+my $added = 0;
+while (my $name = readdir $dh) {
+    $seen{$name}++;
+    write_text("cookies/new" . $added++, "y");
+}
+closedir $dh;
+ok((grep { $seen{"old$_"} } 0..999) == 1000, "Adding entries during a listing skips none.");
+
+# removing entries while reading the directory must not skip or repeat any
+opendir $dh, "mnt/cookies";
+%seen = ();
+my $repeats = 0;
+while (my $name = readdir $dh) {
+    next if $name =~ /^\.\.?$/;
+    $repeats++ if $seen{$name}++;
+    unlink "mnt/cookies/$name";
+}
+closedir $dh;
+ok(keys(%seen) == 1000 + $added && $repeats == 0 && rmdir("mnt/cookies"),
+   "Emptied a directory while reading it.");
+
+unmount();
+
+say "#           == Trace Tests ==";
+system("rm -f test-trace.log");
+mount_with("--trace=debug", "--trace-file=test-trace.log");
+
+write_text("traced.txt", "traced");
+
+unmount();
+
+ok(`cat test-trace.log` =~ /traced\.txt/, "Trace callbacks at debug level.");
+ok(system("timeout 5 ./nufs --trace=loud -f mnt data.nufs >/dev/null 2>&1") != 0,
+   "Refuse a bad trace level.");
+system("rm -f test-trace.log");
+
+say "#           == Stats Tests ==";
+mount();
+
+write_text("counted.txt", "counted");
+read_text("counted.txt");
+my $stats = read_bytes(".nufs/stats");
+my ($writes) = $stats =~ /^write\s+(\d+)/m;
+ok($stats =~ /^op\s+count\s+mean_us/ && $writes && $writes > 0,
+   "Serve per-op counts at /.nufs/stats.");
+ok(`ls -a mnt` !~ /\.nufs/, "The stats directory is not listed.");
+
+unmount();
+mount_with("--lowlevel");
+
+write_text("counted.txt", "counted again");
+$stats = read_bytes(".nufs/stats");
+my ($lookups) = $stats =~ /^lookup\s+(\d+)/m;
+($writes) = $stats =~ /^write\s+(\d+)/m;
+ok($lookups && $writes && `ls mnt/.nufs` =~ /^stats$/m && `ls -a mnt` !~ /\.nufs/,
+   "Serve per-op counts at /.nufs/stats through the low-level frontend.");
+
+system("rm -f mnt/counted.txt");
+unmount();
+
+say "#           == Benchmark Tests ==";
+my $bench = `(make bench/storage_bench >/dev/null 2>&1) && ./bench/storage_bench deep truncate`;
+ok($bench =~ /^deep/m && $bench =~ /^truncate/m && $bench !~ /errors/,
+   "Run the storage benchmark.");
+
+say "#           == Capture Tests ==";
+system("rm -f data.nufs test-capture.bin test-replay.nufs");
+mount_with("--capture=test-capture.bin");
+
+system("mkdir mnt/cap");
+for my $ii (0..19) {
+    write_text("cap/f$ii", "captured $ii");
+}
+system("mv mnt/cap/f0 mnt/cap/g0");
+system("rm -f mnt/cap/f1");
+read_text("cap/f2");
+
+unmount();
+
+my $replay = `(make nufs-replay >/dev/null 2>&1) && ./nufs-replay test-capture.bin test-replay.nufs`;
+my @diverged = $replay =~ /^\w+\s+\d+\s+[\d.]+\s+[\d.]+\s+(\d+)$/mg;
+ok(@diverged > 0 && !grep({ $_ != 0 } @diverged), "Replay a capture with no divergences.");
+
+# a capture_record is 56 bytes after the 16-byte header, starting with the
+# start and finish times and then the op, flags and length of the names
+open my $capture, "<:raw", "test-capture.bin";
+read $capture, my $capture_head, 16;
+my ($records, $started) = (0, 0);
+while (read($capture, my $record, 56) == 56) {
+    my ($op_start, $op_end, $op, $flags, $names_len) = unpack("Q Q C C S", $record);
+    seek $capture, $names_len, 1;
+    $records++;
+    $started++ if $op_start > 0 && $op_start <= $op_end;
+}
+close $capture;
+ok($records > 0 && $started == $records, "Captured ops carry when they started.");
+
+system("rm -f test-replay.nufs");
+$replay = `./nufs-replay -t test-capture.bin test-replay.nufs`;
+@diverged = $replay =~ /^\w+\s+\d+\s+[\d.]+\s+[\d.]+\s+(\d+)$/mg;
+ok(@diverged > 0 && !grep({ $_ != 0 } @diverged), "Replay a capture at its recorded pace.");
+system("rm -f test-capture.bin test-replay.nufs");
+
+say "#           == Journal Tests ==";
+mount();
+
+system("mkdir mnt/jdir");
+for my $ii (0..99) {
+    write_text("jdir/file$ii", "journal $ii");
+}
+system("mv mnt/jdir/file0 mnt/jdir/moved");
+system("rm -f mnt/jdir/file1");
+sync_file("jdir/moved");
+crash();
+mount();
+
+$found = 0;
+for my $ii (2..99) {
+    $found++ if read_text("jdir/file$ii") eq "journal $ii";
+}
+ok($found == 98 && read_text("jdir/moved") eq "journal 0" && !-e "mnt/jdir/file1",
+   "Synced changes survive a crash.");
+
+# changes that never committed may be lost, but what is left must be whole
+for my $ii (0..99) {
+    write_text("jdir/late$ii", "late $ii");
+    unlink "mnt/jdir/file$ii" if $ii % 2 == 0;
+}
+crash();
+mount();
+
+my $broken = 0;
+for my $name (grep { !/^\.\.?$/ } `ls -a mnt/jdir`) {
+    chomp $name;
+    my $data = read_text("jdir/$name");
+    $broken++ unless $data =~ /^(journal|late) \d+$/;
+}
+write_text("jdir/after", "after crash");
+ok($broken == 0 && read_text("jdir/after") eq "after crash",
+   "Unsynced changes leave a usable filesystem after a crash.");
+
+# a directory block freed and then reused for file data must not come
+# back over the data when the journal is replayed; start from an empty
+# image so the files get the freed blocks
+unmount();
+system("rm -f data.nufs");
+mount();
+
+write_text("after", "sync");
+system("mkdir mnt/gone");
+for my $ii (0..299) {
+    write_text("gone/entry-with-a-long-name-$ii", "x");
+}
+sync_file("after");
+system("rm -f mnt/gone/*");
+sync_file("after");
+rmdir "mnt/gone";
+sync_file("after");
+my $xs = "X" x 4096;
+for my $ii (0..7) {
+    write_bytes("reused$ii", $xs);
+    sync_file("reused$ii");
+}
+crash();
+mount();
+
+$found = 0;
+for my $ii (0..7) {
+    $found++ if read_bytes("reused$ii") eq $xs;
+}
+ok($found == 8, "Replay leaves reused metadata blocks alone.");
+ok(!-e "mnt/gone", "Removed directory stays removed after replay.");
+
+unmount();
+
+say "#           == Fsync Tests ==";
+mount();
+
+my $data0 = join("", map { sprintf("%07d\n", $_) } 0..49999);
+open my $fh, ">", "mnt/synced.txt";
+print $fh $data0;
+$fh->flush;
+ok($fh->sync, "Fsync a file.");
+close $fh;
+crash();
+mount();
+
+ok(read_bytes("synced.txt") eq $data0, "Fsynced data survives a crash.");
+
+# a new file is only safe once its directory is synced
+write_text("dirsync.txt", "in the directory");
+open $fh, "<", "mnt";
+ok($fh->sync, "Fsync a directory.");
+close $fh;
+crash();
+mount();
+
+ok(read_text("dirsync.txt") eq "in the directory",
+   "A file synced with its directory survives a crash.");
+
+unmount();
+
+say "#           == Writeback Tests ==";
+mount_with("--dirty-limit=64K", "--dirty-expire=10");
+
+my $flushed = join("", map { sprintf("%07d\n", $_) } 0..99999);
+write_bytes("flushed.txt", $flushed);
+sleep 1;
+ok(read_bytes("flushed.txt") eq $flushed, "Read back data the flusher wrote out.");
+
+unmount();
+mount();
+
+ok(read_bytes("flushed.txt") eq $flushed, "Read back flushed data after remount.");
+
+unmount();
+
+say "#           == Preallocation Tests ==";
+mount();
+
+sysopen my $ah, "mnt/append.log", O_WRONLY | O_CREAT | O_APPEND;
+syswrite $ah, "a" x 100 for 1..1000;
+my $open_blocks = blocks_of("append.log");
+close $ah;
+# the release comes after close returns, and the kernel keeps the old
+# attributes for a second
+sleep 2;
+ok($open_blocks > 200 && blocks_of("append.log") == 200,
+   "Appends reserve spare blocks and close frees them.");
+
+sysopen $ah, "mnt/append.log", O_WRONLY | O_APPEND;
+syswrite $ah, "b" x 100 for 1..500;
+truncate("mnt/append.log", 10000);
+ok(blocks_of("append.log") == 24 && read_bytes("append.log") eq "a" x 10000,
+   "Truncating an open file frees its spare blocks.");
+close $ah;
+
+unmount();
+
+say "#           == Fallocate Tests ==";
+mount();
+
+system("fallocate -l 1M mnt/prealloc");
+ok(-s "mnt/prealloc" == 1048576 && blocks_of("prealloc") >= 2048
+   && read_bytes("prealloc") eq ("\0" x 1048576), "Preallocate a file.");
+
+system("touch mnt/keepsize && fallocate -n -l 64K mnt/keepsize");
+ok(-s "mnt/keepsize" == 0 && blocks_of("keepsize") >= 128,
+   "Preallocate past EOF, keeping the size.");
+
+my $as = "A" x 65536;
+write_bytes("punched", $as);
+my $blocks0 = blocks_of("punched");
+system("fallocate -p -o 8192 -l 16384 mnt/punched");
+substr($as, 8192, 16384) = "\0" x 16384;
+ok(read_bytes("punched") eq $as && blocks_of("punched") == $blocks0 - 32,
+   "Punch a hole.");
+
+system("fallocate -z -o 40000 -l 100 mnt/punched");
+substr($as, 40000, 100) = "\0" x 100;
+ok(read_bytes("punched") eq $as && -s "mnt/punched" == 65536, "Zero a range.");
+
+unmount();
+mount();
+
+ok(read_bytes("punched") eq $as && blocks_of("keepsize") >= 128,
+   "Fallocated files read back after remount.");
+
+sysopen $fh, "mnt/toobig", O_WRONLY | O_CREAT;
+sysseek $fh, 2 ** 31, 0;
+ok(!defined(syswrite $fh, "x") && $!{EFBIG}, "Writes past 2 GiB fail with EFBIG.");
+close $fh;
+ok(!truncate("mnt/toobig", 2 ** 31 + 1) && $!{EFBIG}, "Truncates past 2 GiB fail with EFBIG.");
+
+unmount();
+
+say "#           == Sparse File Tests ==";
+mount();
+
+system("truncate -s 10M mnt/sparse");
+ok(-s "mnt/sparse" == 10 * 1048576 && blocks_of("sparse") == 0,
+   "Growing a file with truncate leaves a hole.");
+
+write_bytes("sparse", "middle", 5 * 1048576);
+write_bytes("sparse", "start", 0);
+ok(blocks_of("sparse") == 16, "Writes map only the blocks they touch.");
+
+my $sparse = "\0" x (10 * 1048576);
+substr($sparse, 0, 5) = "start";
+substr($sparse, 5 * 1048576, 6) = "middle";
+ok(read_bytes("sparse") eq $sparse, "Holes read back as zeros.");
+
+unmount();
+mount();
+
+ok(blocks_of("sparse") == 16 && read_bytes("sparse") eq $sparse,
+   "Holes are still holes after remount.");
+
+unmount();
+
+say "#           == Inline Data Tests ==";
+mount();
+
+for my $size (195, 196, 197) {
+    write_bytes("inline$size", chr(48 + $size % 10) x $size);
+}
+ok(blocks_of("inline195") == 0 && blocks_of("inline196") == 0
+   && blocks_of("inline197") == 8, "Files up to 196 bytes are inline.");
+
+unmount();
+mount();
+
+$found = 0;
+for my $size (195, 196, 197) {
+    $found++ if read_bytes("inline$size") eq chr(48 + $size % 10) x $size;
+}
+ok($found == 3, "Read back files around the inline limit after remount.");
+
+write_bytes("inline196", "+", 196);
+ok(blocks_of("inline196") == 8 && read_bytes("inline196") eq ("6" x 196) . "+",
+   "Growing past 196 bytes moves the data out of the inode.");
+
+truncate("mnt/inline197", 0);
+ok(-s "mnt/inline197" == 0 && blocks_of("inline197") == 0, "Truncate to 0.");
+
+write_bytes("inline197", "i" x 100);
+ok(blocks_of("inline197") == 0 && read_bytes("inline197") eq "i" x 100,
+   "A file truncated to 0 is inline again.");
+
+write_bytes("inline197", "j" x 5000, 100);
+ok(read_bytes("inline197") eq ("i" x 100) . ("j" x 5000), "Regrow a truncated file.");
+
+# the data moved out of the inode must be on disk before the inode
+# that points at it
+write_bytes("inline195", "k" x 100, 195);
+sync_file("inline195");
+crash();
+mount();
+
+ok(read_bytes("inline195") eq ("5" x 195) . ("k" x 100),
+   "Data moved out of the inode survives a crash.");
+
+unmount();
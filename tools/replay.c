@@ -0,0 +1,352 @@
+// nufs-replay: runs a capture recorded with nufs --capture=PATH straight
+// against the storage engine, with no FUSE in the way, either as fast as
+// it will go or at the pace it was recorded. Two builds replaying the same
+// capture see identical input.
+//
+//   make nufs-replay
+//   ./nufs-replay [-t] capture image
+//
+// The image is changed in place, so replay against a copy of the image as
+// it was when the capture started, or a new file to start from empty.
+// Writes replay a fixed pattern, since data is not captured.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../storage.h"
+#include "../handle.h"
+#include "../capture.h"
+
+typedef struct replay_totals {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t diverged;  // returned differently than when captured
+} replay_totals;
+
+static const char* op_names[CAPTURE_NUM_OPS] = {
+	[CAPTURE_LOOKUP]   = "lookup",
+	[CAPTURE_GETATTR]  = "getattr",
+	[CAPTURE_READDIR]  = "readdir",
+	[CAPTURE_MKNOD]    = "mknod",
+	[CAPTURE_MKDIR]    = "mkdir",
+	[CAPTURE_LINK]     = "link",
+	[CAPTURE_UNLINK]   = "unlink",
+	[CAPTURE_RMDIR]    = "rmdir",
+	[CAPTURE_RENAME]   = "rename",
+	[CAPTURE_CHMOD]    = "chmod",
+	[CAPTURE_TRUNCATE] = "truncate",
+	[CAPTURE_OPEN]     = "open",
+	[CAPTURE_RELEASE]  = "release",
+	[CAPTURE_READ]     = "read",
+	[CAPTURE_WRITE]    = "write",
+	[CAPTURE_UTIMENS]  = "utimens",
+	[CAPTURE_FSYNC]    = "fsync",
+	[CAPTURE_FALLOCATE] = "fallocate",
+};
+
+static replay_totals totals[CAPTURE_NUM_OPS];
+
+// captured inode index -> the one the same object got here; the identity
+// until a lookup or create says otherwise
+static int* inode_map = NULL;
+static int inode_map_size = 0;
+
+// captured handle id -> handle opened here, 0 for none
+static uint64_t* handle_map = NULL;
+static uint64_t handle_map_size = 0;
+
+static char* buf = NULL;
+static size_t buf_size = 0;
+
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+map_inode(int inode)
+{
+	return inode >= 0 && inode < inode_map_size && inode_map[inode] >= 0
+		? inode_map[inode] : inode;
+}
+
+static void
+learn_inode(int captured, int replayed)
+{
+	if (captured < 0 || replayed < 0) {
+		return;
+	}
+	if (captured >= inode_map_size) {
+		int new_size = captured * 2 + 64;
+		inode_map = realloc(inode_map, new_size * sizeof(int));
+		memset(inode_map + inode_map_size, 0xff, (new_size - inode_map_size) * sizeof(int));
+		inode_map_size = new_size;
+	}
+	inode_map[captured] = replayed;
+}
+
+static uint64_t*
+handle_slot(uint64_t captured)
+{
+	if (captured >= handle_map_size) {
+		uint64_t new_size = captured * 2 + 64;
+		handle_map = realloc(handle_map, new_size * sizeof(uint64_t));
+		memset(handle_map + handle_map_size, 0, (new_size - handle_map_size) * sizeof(uint64_t));
+		handle_map_size = new_size;
+	}
+	return &handle_map[captured];
+}
+
+static char*
+io_buffer(size_t size)
+{
+	if (size > buf_size) {
+		buf = realloc(buf, size);
+		for (size_t ii = buf_size; ii < size; ii++) {
+			buf[ii] = ii % 251;
+		}
+		buf_size = size;
+	}
+	return buf;
+}
+
+static int
+count_entry(void* ctx, const char* name, int inode_index, const struct stat* st, off_t next)
+{
+	(*(int*) ctx)++;
+	return 0;
+}
+
+static int
+replay_open(capture_record* rec, const char* name)
+{
+	int inode = rec->flags & CAPTURE_BY_INODE ? map_inode(rec->inode)
+	                                          : inode_index_from_path(name);
+	int rv = inode < 0 ? inode : handle_open(inode);
+	if (rv > 0 && rec->handle != 0) {
+		*handle_slot(rec->handle) = rv;
+	}
+	return rv < 0 ? rv : 0;
+}
+
+static int
+replay_release(capture_record* rec)
+{
+	uint64_t* slot = handle_slot(rec->handle);
+	if (*slot != 0) {
+		handle_release(*slot);
+		*slot = 0;
+	}
+	return 0;
+}
+
+static int
+replay_io(capture_record* rec, const char* name, int writing)
+{
+	char* data = io_buffer(rec->size);
+	file_handle* fh = rec->handle ? handle_get(*handle_slot(rec->handle)) : NULL;
+	if (fh != NULL) {
+		return writing ? write_handle(fh, data, rec->size, rec->offset)
+		               : read_handle(fh, data, rec->size, rec->offset);
+	}
+	if (rec->flags & CAPTURE_BY_INODE) {
+		int inode = map_inode(rec->inode);
+		return writing ? write_inode(inode, data, rec->size, rec->offset)
+		               : read_inode(inode, data, rec->size, rec->offset);
+	}
+	return writing ? write_file(name, data, rec->size, rec->offset)
+	               : read_file(name, data, rec->size, rec->offset);
+}
+
+static int
+replay_by_path(capture_record* rec, const char* name, const char* name2)
+{
+	struct stat st;
+	struct timespec ts[2] = { { rec->offset, 0 }, { rec->size, 0 } };
+	int entries = 0;
+	switch (rec->op) {
+	case CAPTURE_GETATTR:  return get_stat(name, &st);
+	case CAPTURE_READDIR:  return read_dir(name, rec->offset, count_entry, &entries);
+	case CAPTURE_MKNOD:    return create_inode_at_path(name, rec->size);
+	case CAPTURE_MKDIR:    return create_dir(name, rec->size);
+	case CAPTURE_LINK:     return link_file(name, name2);
+	case CAPTURE_UNLINK:   return unlink_file(name);
+	case CAPTURE_RMDIR:    return remove_dir(name);
+	case CAPTURE_RENAME:   return rename_file(name, name2);
+	case CAPTURE_CHMOD:    return set_mode(name, rec->size);
+	case CAPTURE_TRUNCATE: return truncate(name, rec->size);
+	case CAPTURE_UTIMENS:  return set_time(name, ts);
+	case CAPTURE_FSYNC:    return sync_inode(inode_index_from_path(name));
+	case CAPTURE_FALLOCATE:
+		return fallocate_inode(inode_index_from_path(name), rec->handle, rec->offset, rec->size);
+	default:               return rec->result;
+	}
+}
+
+static int
+replay_by_inode(capture_record* rec, const char* name, const char* name2)
+{
+	struct stat st;
+	struct timespec ts[2] = { { rec->offset, 0 }, { rec->size, 0 } };
+	int entries = 0;
+	int inode = map_inode(rec->inode);
+	int inode2 = map_inode(rec->inode2);
+	int rv;
+	switch (rec->op) {
+	case CAPTURE_LOOKUP:
+		rv = lookup_child(inode, name, strlen(name));
+		learn_inode(rec->result, rv);
+		return rv;
+	case CAPTURE_MKNOD:
+		rv = create_inode_at(inode, name, rec->size);
+		learn_inode(rec->result, rv);
+		return rv;
+	case CAPTURE_MKDIR:
+		rv = create_dir_at(inode, name, rec->size);
+		learn_inode(rec->result, rv);
+		return rv;
+	case CAPTURE_GETATTR:  return get_stat_inode(inode, &st);
+	case CAPTURE_READDIR:  return read_dir_inode(inode, rec->offset, count_entry, &entries);
+	case CAPTURE_LINK:     return link_file_at(inode, inode2, name2);
+	case CAPTURE_UNLINK:   return unlink_file_at(inode, name);
+	case CAPTURE_RMDIR:    return remove_dir_at(inode, name);
+	case CAPTURE_RENAME:   return rename_file_at(inode, name, inode2, name2);
+	case CAPTURE_CHMOD:    return set_mode_inode(inode, rec->size);
+	case CAPTURE_TRUNCATE: return truncate_inode(inode, rec->size);
+	case CAPTURE_UTIMENS:  return set_time_inode(inode, ts);
+	case CAPTURE_FSYNC:    return sync_inode(inode);
+	case CAPTURE_FALLOCATE: return fallocate_inode(inode, rec->handle, rec->offset, rec->size);
+	default:               return rec->result;
+	}
+}
+
+static int
+replay(capture_record* rec, const char* name, const char* name2)
+{
+	switch (rec->op) {
+	case CAPTURE_OPEN:    return replay_open(rec, name);
+	case CAPTURE_RELEASE: return replay_release(rec);
+	case CAPTURE_READ:    return replay_io(rec, name, 0);
+	case CAPTURE_WRITE:   return replay_io(rec, name, 1);
+	}
+	return rec->flags & CAPTURE_BY_INODE ? replay_by_inode(rec, name, name2)
+	                                     : replay_by_path(rec, name, name2);
+}
+
+// inode indexes may differ from the capture, so creates and lookups only
+// have to agree on success
+static int
+diverged(capture_record* rec, int rv)
+{
+	if (rv < 0 || rec->result < 0) {
+		return rv != rec->result;
+	}
+	switch (rec->op) {
+	case CAPTURE_LOOKUP:
+	case CAPTURE_MKNOD:
+	case CAPTURE_MKDIR:
+		return 0;
+	}
+	return rv != rec->result;
+}
+
+static void
+report(uint64_t records, double seconds)
+{
+	printf("%lu records in %.3f s, %.0f ops/s\n", (unsigned long) records, seconds,
+		records / seconds);
+	printf("%-10s %10s %10s %10s %10s\n", "op", "count", "mean_us", "max_us", "diverged");
+	for (int op = 0; op < CAPTURE_NUM_OPS; op++) {
+		replay_totals* tt = &totals[op];
+		if (tt->count == 0) {
+			continue;
+		}
+		printf("%-10s %10lu %10.1f %10.1f %10lu\n", op_names[op], (unsigned long) tt->count,
+			tt->total_ns / 1e3 / tt->count, tt->max_ns / 1e3, (unsigned long) tt->diverged);
+	}
+}
+
+int
+main(int argc, char* argv[])
+{
+	int timed = 0;
+	int usage = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "t")) != -1) {
+		switch (opt) {
+		case 't':
+			timed = 1;
+			break;
+		default:
+			usage = 1;
+		}
+	}
+	if (usage || argc - optind != 2) {
+		fprintf(stderr, "usage: %s [-t] capture image\n", argv[0]);
+		return 1;
+	}
+
+	FILE* capture = fopen(argv[optind], "rb");
+	if (capture == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (capture_read_header(capture) < 0) {
+		fprintf(stderr, "nufs-replay: %s is not a nufs capture\n", argv[optind]);
+		return 1;
+	}
+	if (storage_init(argv[optind + 1], 1024 * 1024, 0) < 0) {
+		fprintf(stderr, "nufs-replay: %s is not a nufs image\n", argv[optind + 1]);
+		return 1;
+	}
+
+	char* names = malloc(CAPTURE_NAMES_MAX);
+	const char* name2;
+	capture_record rec;
+	uint64_t records = 0;
+	uint64_t begin = now_ns();
+	int rv;
+	while ((rv = capture_read(capture, &rec, names, &name2)) > 0) {
+		if (timed) {
+			// by when the op started, so overlapping ops overlap again
+			// rather than each waiting for the one that finished first
+			uint64_t due = begin + rec.start;
+			uint64_t now = now_ns();
+			if (due > now) {
+				struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		uint64_t start = now_ns();
+		int result = replay(&rec, names, name2);
+		uint64_t ns = now_ns() - start;
+
+		replay_totals* tt = &totals[rec.op];
+		tt->count++;
+		tt->total_ns += ns;
+		tt->max_ns = ns > tt->max_ns ? ns : tt->max_ns;
+		tt->diverged += diverged(&rec, result);
+		records++;
+	}
+	if (rv < 0) {
+		fprintf(stderr, "nufs-replay: %s is damaged after %lu records\n", argv[optind],
+			(unsigned long) records);
+	}
+
+	report(records, (now_ns() - begin) / 1e9);
+	// leaves the image as an unmount would
+	storage_close();
+	fclose(capture);
+	free(names);
+	return rv < 0;
+}
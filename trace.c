@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+// Each thread that traces claims a ring of its own, found through a
+// thread-local pointer, and is its only writer; the drain thread is its
+// only reader. head and tail count bytes ever written and drained, and
+// each side publishes its counter with a release store, so neither side
+// takes a lock. A full ring drops the message rather than wait. Rings go
+// back on the shared list when their thread exits and are reused by the
+// next thread that traces.
+
+#define TRACE_RING_SIZE (64 * 1024)
+#define TRACE_LINE_MAX  512
+// how long the drain thread sleeps when every ring is empty
+const int TRACE_DRAIN_USEC = 10000;
+
+typedef struct trace_ring {
+	struct trace_ring* next;
+	int in_use;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+	uint64_t dropped_reported;
+	char data[TRACE_RING_SIZE];
+} trace_ring;
+
+int trace_level = TRACE_OFF;
+
+static trace_ring* rings = NULL;
+static __thread trace_ring* my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static FILE* trace_file = NULL;
+static pthread_t drain_thread;
+static int draining = 0;
+static int stopping = 0;
+
+static const char* level_names[] = { "off", "error", "info", "debug" };
+
+int
+trace_parse_level(const char* name)
+{
+	for (int ii = TRACE_OFF; ii <= TRACE_DEBUG; ii++) {
+		if (strcmp(name, level_names[ii]) == 0) {
+			return ii;
+		}
+	}
+	return -1;
+}
+
+int
+trace_open(int level, const char* path)
+{
+	if (level == TRACE_OFF) {
+		return 0;
+	}
+	trace_file = strcmp(path, "-") == 0 ? stdout : fopen(path, "a");
+	if (trace_file == NULL) {
+		return -errno;
+	}
+	trace_level = level;
+	return 0;
+}
+
+static void
+ring_release(void* ring)
+{
+	__atomic_store_n(&((trace_ring*) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+ring_key_init()
+{
+	pthread_key_create(&ring_key, ring_release);
+}
+
+// the calling thread's ring, claimed or allocated on first use
+static trace_ring*
+ring_for_thread()
+{
+	if (my_ring != NULL) {
+		return my_ring;
+	}
+
+	trace_ring* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	for (; ring != NULL; ring = ring->next) {
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&ring->in_use, &unused, 1, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(trace_ring));
+		ring->in_use = 1;
+		ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, false,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+	}
+
+	pthread_once(&ring_key_once, ring_key_init);
+	pthread_setspecific(ring_key, ring);
+	my_ring = ring;
+	return ring;
+}
+
+void
+trace_write(int level, const char* fmt, ...)
+{
+	char line[TRACE_LINE_MAX];
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int len = snprintf(line, sizeof(line), "%ld.%06ld %s ", (long) now.tv_sec,
+		now.tv_nsec / 1000, level_names[level]);
+
+	va_list args;
+	va_start(args, fmt);
+	len += vsnprintf(line + len, sizeof(line) - len, fmt, args);
+	va_end(args);
+	if (len > (int) sizeof(line) - 1) {
+		len = sizeof(line) - 1;
+	}
+	if (line[len - 1] != '\n') {
+		line[len++] = '\n';
+	}
+
+	trace_ring* ring = ring_for_thread();
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail + len > TRACE_RING_SIZE) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	int start = head % TRACE_RING_SIZE;
+	int first = len < TRACE_RING_SIZE - start ? len : TRACE_RING_SIZE - start;
+	memcpy(ring->data + start, line, first);
+	memcpy(ring->data, line + first, len - first);
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+// writes out whatever the rings hold; returns the number of bytes written
+static uint64_t
+drain_rings()
+{
+	uint64_t total = 0;
+	trace_ring* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	for (; ring != NULL; ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = ring->tail;
+		while (tail < head) {
+			int start = tail % TRACE_RING_SIZE;
+			uint64_t room = TRACE_RING_SIZE - start;
+			uint64_t count = head - tail < room ? head - tail : room;
+			fwrite(ring->data + start, 1, count, trace_file);
+			tail += count;
+			total += count;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->dropped_reported) {
+			fprintf(trace_file, "trace: dropped %lu messages\n",
+				(unsigned long) (dropped - ring->dropped_reported));
+			ring->dropped_reported = dropped;
+		}
+	}
+	if (total > 0) {
+		fflush(trace_file);
+	}
+	return total;
+}
+
+static void*
+drain_main(void* arg)
+{
+	(void) arg;
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		if (drain_rings() == 0) {
+			usleep(TRACE_DRAIN_USEC);
+		}
+	}
+	drain_rings();
+	return NULL;
+}
+
+void
+trace_start()
+{
+	if (trace_file == NULL || draining) {
+		return;
+	}
+	if (pthread_create(&drain_thread, NULL, drain_main, NULL) == 0) {
+		draining = 1;
+	}
+}
+
+void
+trace_stop()
+{
+	if (!draining) {
+		return;
+	}
+	trace_level = TRACE_OFF;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(drain_thread, NULL);
+	draining = 0;
+	if (trace_file != stdout) {
+		fclose(trace_file);
+	}
+	trace_file = NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Leveled tracing. Messages are formatted into a ring buffer owned by the
+// calling thread and written out by a background thread, so tracing never
+// blocks on the log file. With tracing off, TRACE costs one compare.
+
+#define TRACE_OFF   0
+#define TRACE_ERROR 1
+#define TRACE_INFO  2
+#define TRACE_DEBUG 3
+
+extern int trace_level;
+
+#define TRACE(level, ...) \
+	do { \
+		if (__builtin_expect(trace_level >= (level), 0)) { \
+			trace_write((level), __VA_ARGS__); \
+		} \
+	} while (0)
+
+// parses "off", "error", "info" or "debug"; -1 if it is none of them
+int  trace_parse_level(const char* name);
+// sets the level and the file to trace to ("-" for stdout); returns -errno
+// if the file cannot be opened
+int  trace_open(int level, const char* path);
+// starts the thread draining the buffers; call after any fork
+void trace_start();
+// drains everything buffered and stops the thread
+void trace_stop();
+void trace_write(int level, const char* fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#endif
@@ -2,7 +2,12 @@
 #define UTIL_H
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 static int
 streq(const char* aa, const char* bb)
@@ -28,6 +33,18 @@ clamp(int x, int v0, int v1)
     return max(v0, min(x, v1));
 }
 
+// FNV-1a over the first len bytes of name
+static unsigned
+name_hash(const char* name, int len)
+{
+	unsigned hash = 2166136261u;
+	for (int ii = 0; ii < len; ii++) {
+		hash ^= (unsigned char) name[ii];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 static void
 bitmap_set(char* bitmap, int index, bool on)
 {
@@ -48,15 +65,85 @@ bitmap_read(char* bitmap, int index)
 	return (int) ((*byte & (char)(1 << pos)) >> pos);
 }
 
+// Bitmaps are scanned a 64-bit word at a time. Bit ii lives in byte ii / 8
+// at position ii % 8, which on a little-endian machine is bit ii % 64 of
+// word ii / 64. Bits at or past size read as used.
+static uint64_t
+bitmap_word(const char* bitmap, int word, int size)
+{
+	uint64_t ww = 0;
+	int bits = size - word * 64;
+	if (bits >= 64) {
+		memcpy(&ww, bitmap + word * 8, sizeof(ww));
+		return ww;
+	}
+	memcpy(&ww, bitmap + word * 8, (bits + 7) / 8);
+	return ww | (~0ull << bits);
+}
+
+// first word at or after word, and before end, that is not equal to fill
+// (all zeros or all ones); vectorized when the target allows it
+static int
+bitmap_skip_words(const char* bitmap, int word, int end, uint64_t fill)
+{
+#if defined(__AVX2__)
+	__m256i pattern = _mm256_set1_epi8((char) fill);
+	for (; word + 4 <= end; word += 4) {
+		__m256i vv = _mm256_loadu_si256((const __m256i*) (bitmap + word * 8));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(vv, pattern)) != -1) {
+			break;
+		}
+	}
+#elif defined(__SSE2__)
+	__m128i pattern = _mm_set1_epi8((char) fill);
+	for (; word + 2 <= end; word += 2) {
+		__m128i vv = _mm_loadu_si128((const __m128i*) (bitmap + word * 8));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(vv, pattern)) != 0xffff) {
+			break;
+		}
+	}
+#endif
+	while (word < end && bitmap_word(bitmap, word, end * 64) == fill) {
+		word++;
+	}
+	return word;
+}
+
 static int
 bitmap_next_free(char* bitmap, int from, int size)
 {
-	for (int ii = from; ii < size; ++ii) {
-		if (bitmap_read(bitmap, ii) == 0) {
-			return ii;
+	if (from >= size) {
+		return -1;
+	}
+	int word = from / 64;
+	uint64_t ww = ~bitmap_word(bitmap, word, size) & (~0ull << (from % 64));
+	while (ww == 0) {
+		word = bitmap_skip_words(bitmap, word + 1, size / 64, ~0ull);
+		if (word * 64 >= size) {
+			return -1;
+		}
+		ww = ~bitmap_word(bitmap, word, size);
+	}
+	return word * 64 + __builtin_ctzll(ww);
+}
+
+// first used bit at or after from, or size if there is none
+static int
+bitmap_next_used(char* bitmap, int from, int size)
+{
+	if (from >= size) {
+		return size;
+	}
+	int word = from / 64;
+	uint64_t ww = bitmap_word(bitmap, word, size) & (~0ull << (from % 64));
+	while (ww == 0) {
+		word = bitmap_skip_words(bitmap, word + 1, size / 64, 0);
+		if (word * 64 >= size) {
+			return size;
 		}
+		ww = bitmap_word(bitmap, word, size);
 	}
-	return -1;
+	return word * 64 + __builtin_ctzll(ww);
 }
 
 static int
@@ -68,49 +155,169 @@ bitmap_first_free(char* bitmap, int size)
 static int
 free_range_size(char* bitmap, int start, int range, int size)
 {
-	if (start + range >= size) {
+	if (start + range > size) {
 		return -1;
 	}
-	
-	for (int ii = start; ii < start + range; ii++) {
-		if (bitmap_read(bitmap, ii)) {
-			return ii - start;
-		}
-	}
-	return range;
+	return bitmap_next_used(bitmap, start, start + range) - start;
 }
 
 static int
 bitmap_find_range(char* bitmap, int range, int size)
 {
-	int curr_range_start = 0;
-	int curr_range_size = 0;
-	while (curr_range_size < range) {
-		curr_range_start = bitmap_next_free(bitmap, 
-						    curr_range_start + curr_range_size,
-						    size);
-		if (curr_range_start < 0) {
+	int start = bitmap_next_free(bitmap, 0, size);
+	while (start >= 0) {
+		int run = free_range_size(bitmap, start, range, size);
+		if (run < 0) {
 			return -1;
 		}
-		curr_range_size = free_range_size(bitmap, curr_range_start, range, size);
-		if (curr_range_size < 0) {
-			return -1;
+		if (run == range) {
+			return start;
 		}
+		start = bitmap_next_free(bitmap, start + run, size);
 	}
-	return curr_range_start;
+	return -1;
 }
 
 static bool
 bitmap_all_free(char* bitmap, int size)
 {
-	for (int ii = 0; ii < size; ii++) {
-		if (bitmap_read(bitmap, ii)) {
-			return false;
+	return bitmap_next_used(bitmap, 0, size) == size;
+}
+
+// In-memory index over an on-disk bitmap: bit ii of summary is set while
+// word ii of the bitmap still has a free bit, so finding a free bit reads
+// one summary word per 4096 bits instead of 64 bitmap words. first is a
+// lower bound on the first summary word with a bit set.
+typedef struct bitmap_summary {
+	char* bitmap;
+	int size;
+	int num_free;
+	uint64_t* summary;
+	int num_summary_words;
+	int first;
+} bitmap_summary;
+
+static void
+bitmap_summary_update(bitmap_summary* bs, int word)
+{
+	uint64_t* sw = &bs->summary[word / 64];
+	if (bitmap_word(bs->bitmap, word, bs->size) != ~0ull) {
+		*sw |= 1ull << (word % 64);
+		bs->first = min(bs->first, word / 64);
+	} else {
+		*sw &= ~(1ull << (word % 64));
+	}
+}
+
+// (re)builds the summary from the bitmap's current contents
+static void
+bitmap_summary_init(bitmap_summary* bs, char* bitmap, int size)
+{
+	int num_words = (size + 63) / 64;
+	free(bs->summary);
+	bs->bitmap = bitmap;
+	bs->size = size;
+	bs->num_summary_words = (num_words + 63) / 64;
+	bs->summary = calloc(bs->num_summary_words, sizeof(uint64_t));
+	bs->first = bs->num_summary_words;
+	bs->num_free = 0;
+	for (int ii = 0; ii < num_words; ii++) {
+		bitmap_summary_update(bs, ii);
+		bs->num_free += __builtin_popcountll(~bitmap_word(bitmap, ii, size));
+	}
+}
+
+// extends the summary over bits [size, new_size), which must be clear
+static void
+bitmap_summary_grow(bitmap_summary* bs, int new_size)
+{
+	int old_words = (bs->size + 63) / 64;
+	int num_words = (new_size + 63) / 64;
+	int num_summary_words = (num_words + 63) / 64;
+	if (num_summary_words > bs->num_summary_words) {
+		bs->summary = realloc(bs->summary, num_summary_words * sizeof(uint64_t));
+		memset(bs->summary + bs->num_summary_words, 0,
+			(num_summary_words - bs->num_summary_words) * sizeof(uint64_t));
+		bs->num_summary_words = num_summary_words;
+	}
+	bs->num_free += new_size - bs->size;
+	bs->size = new_size;
+	// the old last word may have been partial
+	for (int ii = max(old_words - 1, 0); ii < num_words; ii++) {
+		bitmap_summary_update(bs, ii);
+	}
+}
+
+static void
+bitmap_summary_set(bitmap_summary* bs, int index, bool on)
+{
+	if (bitmap_read(bs->bitmap, index) != on) {
+		bs->num_free += on ? -1 : 1;
+	}
+	bitmap_set(bs->bitmap, index, on);
+	bitmap_summary_update(bs, index / 64);
+}
+
+static int
+bitmap_summary_next_free(bitmap_summary* bs, int from)
+{
+	if (from >= bs->size) {
+		return -1;
+	}
+	int word = from / 64;
+	uint64_t ww = ~bitmap_word(bs->bitmap, word, bs->size) & (~0ull << (from % 64));
+	if (ww != 0) {
+		return word * 64 + __builtin_ctzll(ww);
+	}
+
+	// find the next word with a free bit through the summary
+	word++;
+	int sw = max(word / 64, bs->first);
+	if (sw >= bs->num_summary_words) {
+		return -1;
+	}
+	uint64_t ss = sw == word / 64 && word % 64 != 0
+		? bs->summary[sw] & (~0ull << (word % 64)) : bs->summary[sw];
+	while (ss == 0) {
+		if (++sw >= bs->num_summary_words) {
+			return -1;
 		}
+		ss = bs->summary[sw];
+	}
+	word = sw * 64 + __builtin_ctzll(ss);
+	return word * 64 + __builtin_ctzll(~bitmap_word(bs->bitmap, word, bs->size));
+}
+
+static int
+bitmap_summary_first_free(bitmap_summary* bs)
+{
+	// skip summary words that have filled up since first was lowered
+	while (bs->first < bs->num_summary_words && bs->summary[bs->first] == 0) {
+		bs->first++;
 	}
-	return true;
+	if (bs->first >= bs->num_summary_words) {
+		return -1;
+	}
+	int word = bs->first * 64 + __builtin_ctzll(bs->summary[bs->first]);
+	return word * 64 + __builtin_ctzll(~bitmap_word(bs->bitmap, word, bs->size));
 }
 
+static int
+bitmap_summary_find_range(bitmap_summary* bs, int range)
+{
+	int start = bitmap_summary_first_free(bs);
+	while (start >= 0) {
+		int run = free_range_size(bs->bitmap, start, range, bs->size);
+		if (run < 0) {
+			return -1;
+		}
+		if (run == range) {
+			return start;
+		}
+		start = bitmap_summary_next_free(bs, start + run);
+	}
+	return -1;
+}
 
 
 
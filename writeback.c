@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "writeback.h"
+#include "pages.h"
+#include "util.h"
+
+// Dirty pages are kept in the order they were first written, each with
+// that time, so the expired ones are always a prefix. A hash set over them
+// keeps a page that is written again from being counted twice; a page
+// written again after its writeback started is simply dirty anew.
+//
+// The pages are split among WRITEBACK_SHARDS shards by the region of the
+// image they are in, each with its own lock, list and set, so writes to
+// different regions do not wait for each other, and a write's pages stay
+// together. The list is a queue that only moves down once half of it is
+// spent, and pages leave the set as tombstones, which the set drops when
+// it is rebuilt to grow, so a flush pass costs what it writes back rather
+// than what is dirty.
+//
+// Writeback only starts I/O and does not wait for it, so the thread never
+// holds anything while the disk works. It holds no lock that the storage
+// engine takes either, so flushing never stalls an operation.
+
+#define WRITEBACK_DEFAULT_LIMIT     (32 << 20)
+#define WRITEBACK_DEFAULT_EXPIRE_MS 2000
+#define WRITEBACK_SHARDS            16
+// pages in a region, all of which go to one shard (1M)
+#define WRITEBACK_REGION_PAGES      256
+
+#define SET_EMPTY     (-1)
+#define SET_TOMBSTONE (-2)
+
+typedef struct dirty_page {
+	int pnum;
+	uint64_t time;  // ms, when it was first written
+} dirty_page;
+
+typedef struct writeback_shard {
+	pthread_mutex_t lock;
+	dirty_page* dirty;  // [head, tail) are dirty, oldest first
+	int head;
+	int tail;
+	int capacity;
+	int* set;
+	int set_size;
+	int set_used;       // pages and tombstones
+} __attribute__((aligned(64))) writeback_shard;
+
+static int limit_pages = WRITEBACK_DEFAULT_LIMIT / 4096;
+static int expire_ms = WRITEBACK_DEFAULT_EXPIRE_MS;
+
+static writeback_shard shards[WRITEBACK_SHARDS];
+static int num_dirty = 0;
+
+static bool stopping = false;
+static bool thread_started = false;
+static pthread_t flusher;
+// guards starting and stopping the thread, which waits on writeback_cond
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+void
+writeback_config(int64_t dirty_limit, int expire)
+{
+	if (dirty_limit > 0) {
+		limit_pages = max(dirty_limit / 4096, 1);
+	}
+	if (expire > 0) {
+		expire_ms = expire;
+	}
+}
+
+static void
+shards_init()
+{
+	for (int ii = 0; ii < WRITEBACK_SHARDS; ii++) {
+		pthread_mutex_init(&shards[ii].lock, NULL);
+	}
+}
+
+static uint64_t
+now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static writeback_shard*
+shard_for(int pnum)
+{
+	return &shards[(pnum / WRITEBACK_REGION_PAGES) % WRITEBACK_SHARDS];
+}
+
+// adds pnum to the set, returning false if it was already there
+static bool
+dirty_set_add(writeback_shard* ws, int pnum)
+{
+	int* reuse = NULL;
+	for (unsigned slot = (unsigned) pnum * 0x9e3779b1u;; slot++) {
+		int* entry = &ws->set[slot & (ws->set_size - 1)];
+		if (*entry == pnum) {
+			return false;
+		}
+		if (*entry == SET_TOMBSTONE && reuse == NULL) {
+			reuse = entry;
+		}
+		if (*entry == SET_EMPTY) {
+			if (reuse == NULL) {
+				reuse = entry;
+				ws->set_used++;
+			}
+			*reuse = pnum;
+			return true;
+		}
+	}
+}
+
+static void
+dirty_set_remove(writeback_shard* ws, int pnum)
+{
+	for (unsigned slot = (unsigned) pnum * 0x9e3779b1u;; slot++) {
+		int* entry = &ws->set[slot & (ws->set_size - 1)];
+		if (*entry == pnum) {
+			*entry = SET_TOMBSTONE;
+			return;
+		}
+		if (*entry == SET_EMPTY) {
+			return;
+		}
+	}
+}
+
+// rebuilds the set over the shard's dirty pages, dropping the tombstones,
+// at a size that leaves it at most half full once it holds count more
+static void
+dirty_set_rebuild(writeback_shard* ws, int count)
+{
+	int size = max(ws->set_size, 1024);
+	while (size < (ws->tail - ws->head + count) * 2) {
+		size *= 2;
+	}
+	if (size != ws->set_size) {
+		free(ws->set);
+		ws->set = malloc(size * sizeof(int));
+		ws->set_size = size;
+	}
+	memset(ws->set, 0xff, ws->set_size * sizeof(int));
+	ws->set_used = 0;
+	for (int ii = ws->head; ii < ws->tail; ii++) {
+		dirty_set_add(ws, ws->dirty[ii].pnum);
+	}
+}
+
+// makes room in the shard for count more pages; the caller holds its lock
+static void
+shard_reserve(writeback_shard* ws, int count)
+{
+	if ((ws->set_used + count) * 2 > ws->set_size) {
+		dirty_set_rebuild(ws, count);
+	}
+	if (ws->tail + count > ws->capacity && ws->head > 0) {
+		memmove(ws->dirty, ws->dirty + ws->head, (ws->tail - ws->head) * sizeof(dirty_page));
+		ws->tail -= ws->head;
+		ws->head = 0;
+	}
+	if (ws->tail + count > ws->capacity) {
+		ws->capacity = max(ws->capacity * 2, ws->tail + count);
+		ws->dirty = realloc(ws->dirty, ws->capacity * sizeof(dirty_page));
+	}
+}
+
+static int
+compare_pnum(const void* aa, const void* bb)
+{
+	int xx = *(const int*) aa;
+	int yy = *(const int*) bb;
+	return xx < yy ? -1 : xx > yy;
+}
+
+// takes the first count pages off the shard's list and starts writing
+// them back, one call per contiguous run; the caller holds the shard's
+// lock, which is dropped while the writes are started
+static void
+write_back(writeback_shard* ws, int count)
+{
+	if (count == 0) {
+		return;
+	}
+	int* pages = malloc(count * sizeof(int));
+	for (int ii = 0; ii < count; ii++) {
+		pages[ii] = ws->dirty[ws->head + ii].pnum;
+		dirty_set_remove(ws, pages[ii]);
+	}
+	ws->head += count;
+	if (ws->head == ws->tail) {
+		ws->head = 0;
+		ws->tail = 0;
+	}
+	__atomic_sub_fetch(&num_dirty, count, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&ws->lock);
+	qsort(pages, count, sizeof(int), compare_pnum);
+	int start = 0;
+	for (int ii = 1; ii <= count; ii++) {
+		if (ii == count || pages[ii] != pages[ii - 1] + 1) {
+			pages_writeback(pages[start], ii - start);
+			start = ii;
+		}
+	}
+	free(pages);
+	pthread_mutex_lock(&ws->lock);
+}
+
+// writes back the shard's expired pages, and when too much is dirty its
+// oldest ones down to its share of half the limit
+static void
+flush_shard(writeback_shard* ws, uint64_t cutoff, bool over)
+{
+	pthread_mutex_lock(&ws->lock);
+	int expired = 0;
+	int count = ws->tail - ws->head;
+	while (expired < count && ws->dirty[ws->head + expired].time <= cutoff) {
+		expired++;
+	}
+	if (over) {
+		expired = max(expired, count - limit_pages / 2 / WRITEBACK_SHARDS);
+	}
+	write_back(ws, expired);
+	pthread_mutex_unlock(&ws->lock);
+}
+
+static void*
+flusher_thread(void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&writeback_lock);
+	while (!stopping) {
+		// the oldest page is written back at most a quarter of the expiry
+		// age late
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		int64_t ns = until.tv_nsec + (int64_t) max(expire_ms / 4, 1) * 1000000;
+		until.tv_sec += ns / 1000000000;
+		until.tv_nsec = ns % 1000000000;
+		pthread_cond_timedwait(&writeback_cond, &writeback_lock, &until);
+		pthread_mutex_unlock(&writeback_lock);
+
+		uint64_t cutoff = now_ms() - expire_ms;
+		bool over = __atomic_load_n(&num_dirty, __ATOMIC_RELAXED) > limit_pages;
+		for (int ii = 0; ii < WRITEBACK_SHARDS; ii++) {
+			flush_shard(&shards[ii], cutoff, over);
+		}
+		pthread_mutex_lock(&writeback_lock);
+	}
+	pthread_mutex_unlock(&writeback_lock);
+	return NULL;
+}
+
+static void
+start_thread()
+{
+	pthread_once(&shards_once, shards_init);
+	if (__atomic_load_n(&thread_started, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	pthread_mutex_lock(&writeback_lock);
+	if (!thread_started && !stopping) {
+		// from the first write, so it runs in the process serving requests
+		bool started = pthread_create(&flusher, NULL, flusher_thread, NULL) == 0;
+		__atomic_store_n(&thread_started, started, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&writeback_lock);
+}
+
+// notes pages [pnum, pnum + count), which are all in one region
+static void
+shard_dirty(int pnum, int count, uint64_t now)
+{
+	writeback_shard* ws = shard_for(pnum);
+	pthread_mutex_lock(&ws->lock);
+	shard_reserve(ws, count);
+	int added = 0;
+	for (int ii = 0; ii < count; ii++) {
+		if (dirty_set_add(ws, pnum + ii)) {
+			ws->dirty[ws->tail].pnum = pnum + ii;
+			ws->dirty[ws->tail].time = now;
+			ws->tail++;
+			added++;
+		}
+	}
+	pthread_mutex_unlock(&ws->lock);
+	__atomic_add_fetch(&num_dirty, added, __ATOMIC_RELAXED);
+}
+
+void
+writeback_dirty(int pnum, int count)
+{
+	start_thread();
+	uint64_t now = now_ms();
+	while (count > 0) {
+		int run = min(count, WRITEBACK_REGION_PAGES - pnum % WRITEBACK_REGION_PAGES);
+		shard_dirty(pnum, run, now);
+		pnum += run;
+		count -= run;
+	}
+	if (__atomic_load_n(&num_dirty, __ATOMIC_RELAXED) > limit_pages) {
+		// without writeback_lock the thread may miss this, but then it
+		// wakes within a quarter of the expiry age anyway
+		pthread_cond_signal(&writeback_cond);
+	}
+}
+
+void
+writeback_close()
+{
+	pthread_once(&shards_once, shards_init);
+	pthread_mutex_lock(&writeback_lock);
+	stopping = true;
+	pthread_cond_signal(&writeback_cond);
+	pthread_mutex_unlock(&writeback_lock);
+	if (thread_started) {
+		pthread_join(flusher, NULL);
+	}
+
+	for (int ii = 0; ii < WRITEBACK_SHARDS; ii++) {
+		writeback_shard* ws = &shards[ii];
+		pthread_mutex_lock(&ws->lock);
+		write_back(ws, ws->tail - ws->head);
+		pthread_mutex_unlock(&ws->lock);
+	}
+	pthread_mutex_lock(&writeback_lock);
+	thread_started = false;
+	stopping = false;
+	pthread_mutex_unlock(&writeback_lock);
+}
@@ -0,0 +1,21 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdint.h>
+
+// Background writeback of file data. The kernel would hold dirty pages of
+// the shared mapping until it chose to write them, then write a lot at
+// once; the flusher thread starts writing each page once it has been
+// dirty for the expiry age, or sooner when too much is dirty, so writes
+// see no flush storms and a crash loses a bounded amount of data.
+
+// bytes of dirty data that start writeback without waiting for the
+// expiry age (32M by default), and the age in milliseconds (2000); 0 keeps
+// the default. Call before storage_init.
+void writeback_config(int64_t dirty_limit, int expire_ms);
+// notes that image pages [pnum, pnum + count) hold newly written data
+void writeback_dirty(int pnum, int count);
+// starts writing back everything still dirty and stops the thread
+void writeback_close();
+
+#endif